@@ -0,0 +1,84 @@
+//! \file projbench.cpp
+//! \brief Microbenchmark of the projection accumulator, reports GB/s of source slices on one core.
+//!
+//! Usage: projbench [sizeX sizeY sizeZ]   (default 2048 2048 32)
+
+#include "projkernel.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace std;
+
+template<typename T>
+static void run(const char *typeName, size_t sizeX, size_t sizeY, size_t sizeZ)
+{
+    vector<T> stack(sizeX * sizeY * sizeZ);
+    for (size_t i = 0; i < stack.size(); i++)
+        stack[i] = (T)(i * 2654435761u >> 20);
+
+    vector<float> maxXY(sizeX * sizeY), meanXY(sizeX * sizeY);
+    vector<float> maxXZ(sizeX * sizeZ), meanXZ(sizeX * sizeZ);
+    vector<float> maxYZ(sizeY * sizeZ), meanYZ(sizeY * sizeZ);
+
+    ProjKernelIsa isas[2] = {PROJ_ISA_SCALAR, PROJ_ISA_SSE2};
+    for (int i = 0; i < 2; i++)
+    {
+        if (!proj_kernel_select(isas[i]))
+            continue;
+
+        // best of a few runs, the first one also warms up the pages
+        double best = 1e30;
+        for (int rep = 0; rep < 5; rep++)
+        {
+            auto start = chrono::steady_clock::now();
+            proj_init_xy(maxXY.data(), meanXY.data(), maxXY.size());
+            for (size_t z = 0; z < sizeZ; z++)
+            {
+                ProjSliceTargets targets;
+                targets.maxXY = maxXY.data();
+                targets.meanXY = meanXY.data();
+                targets.maxXZ = maxXZ.data() + z*sizeX;
+                targets.meanXZ = meanXZ.data() + z*sizeX;
+                targets.maxYZ = maxYZ.data() + z*sizeY;
+                targets.meanYZ = meanYZ.data() + z*sizeY;
+                targets.scaleXY = 1.0f / sizeZ;
+                targets.scaleXZ = 1.0f / sizeY;
+                targets.scaleYZ = 1.0f / sizeX;
+                proj_accumulate_slice(stack.data() + z*sizeX*sizeY, sizeX, sizeY, targets);
+            }
+            auto stop = chrono::steady_clock::now();
+            double seconds = chrono::duration<double>(stop - start).count();
+            if (seconds < best)
+                best = seconds;
+        }
+
+        double gb = stack.size() * sizeof(T) / 1e9;
+        printf("%-6s %-6s %8.3f ms  %7.2f GB/s  %7.2f Gpixel/s\n", typeName, proj_kernel_isa_name(isas[i]),
+               best * 1e3, gb / best, stack.size() / best / 1e9);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t sizeX = 2048, sizeY = 2048, sizeZ = 32;
+    if (argc == 4)
+    {
+        sizeX = strtoul(argv[1], nullptr, 10);
+        sizeY = strtoul(argv[2], nullptr, 10);
+        sizeZ = strtoul(argv[3], nullptr, 10);
+    }
+    else if (argc != 1)
+    {
+        fprintf(stderr, "usage: %s [sizeX sizeY sizeZ]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%zu x %zu x %zu slices, single thread\n", sizeX, sizeY, sizeZ);
+    run<unsigned char>("uint8", sizeX, sizeY, sizeZ);
+    run<uint16_t>("uint16", sizeX, sizeY, sizeZ);
+    run<float>("float", sizeX, sizeY, sizeZ);
+    return 0;
+}
@@ -33,6 +33,10 @@ struct animOptions {
     double scale_x = 1.0;
     double scale_z = 1.0;
     uint verbose = 0;
+    // only make the frames, used while an acquisition is still running
+    bool skip_video = false;
+    // take the ranges of the max frames from the statistics skim --stats wrote next to the nhdr files
+    bool stats = false;
 };
 
 void setup_anim(CLI::App &app);
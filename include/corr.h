@@ -27,8 +27,9 @@ void setup_corr(CLI::App &app);
 
 std::vector<double> corr_main(corrOptions const &opt);
 
+template<typename T>
 static double
-crossCorr(const unsigned short *aa, const unsigned short *bb,
+crossCorr(const T *aa, const T *bb,
           const unsigned int sza[2], const unsigned int szb[2],
           const int off[2]);
 
@@ -28,6 +28,11 @@ struct corrfindOptions
 
 void setup_corrfind(CLI::App &app);
 
+//! \brief Alignment file name of every timepoint of "images" (sequence number and name, ascending), after its
+//! sequence number, and the index of the timepoint its shift is found against, -1 for the first one. Timepoints
+//! that left no projections, e.g. damaged ones, are not in "images", so a shift may span several of them.
+std::vector< std::pair<std::string, int> > corrfind_jobs(std::vector< std::pair<int, std::string> > const &images);
+
 class Corrfind{
 public:
 	Corrfind(corrfindOptions const &opt = corrfindOptions());
@@ -0,0 +1,76 @@
+//! \file czidataset.h
+//! \brief CZI datasets that are split over several files, and the mosaic tiles inside them.
+//!
+//! ZEN splits large acquisitions into a master file (FilePart 0) and further parts that carry the
+//! FileGuid of the master as their PrimaryFileGuid. Part files are named like timepoints, e.g.
+//! "scan.czi", "scan(1).czi", so they can only be told apart by their file header. The directory of
+//! the master lists the subblocks of all parts, each entry says in which part its data lies.
+//!
+//! A mosaic acquisition has one subblock per tile for every (c, z), told apart by the M index and
+//! the X/Y start of the tile in the pixels of the whole mosaic. With more than one tile, skim writes
+//! one nhdr per tile into NNN-tiles/ and a layout descriptor, NNN-tiles/layout.txt:
+//!     # comment lines
+//!     mosaic: <sizeX> <sizeY>
+//!     tiles: <count>
+//!     <nhdr file> <x> <y> <sizeX> <sizeY> <m>
+//! with one line per tile, x and y being the offset of the tile in the stitched mosaic in pixels.
+//! The space origin of every tile nhdr is that offset in um, so the tiles line up in space as well.
+
+#ifndef LSP_CZIDATASET_H
+#define LSP_CZIDATASET_H
+
+#include "skimczi.h"
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+//! \brief Read the file header of the CZI file at "path"; false when it is not a CZI file.
+bool czi_read_file_header(std::string const &path, CziHeaderInfo &header);
+
+//! \brief Move the part files (FilePart > 0) of directory "dir" out of the (sequence number, name)
+//! list "files" and return them grouped by master file name, FilePart -> name. Headers are read in
+//! parallel. Parts whose master is not in "files" are dropped with a warning.
+std::map<std::string, std::map<int, std::string> >
+czi_group_file_parts(std::string const &dir, std::vector< std::pair<int, std::string> > &files);
+
+//! \brief Parts of the master file "master" in directory "dir", FilePart -> name; empty for a file
+//! that is not split.
+std::map<int, std::string> czi_find_file_parts(std::string const &dir, std::string const &master);
+
+//! \brief Whether the file at "path" is a part (FilePart > 0) of a split dataset rather than a timepoint.
+bool czi_is_file_part(std::string const &path);
+
+//! \brief Number of timepoints "numT", the distinct T, and of files "numParts", 1 + the highest FilePart
+//! of its entries, that the SubBlockDirectory of the CZI file at "path" lists; 1 and 1 when the directory
+//! can't be read.
+void czi_directory_extent(std::string const &path, int &numT, int &numParts);
+
+//! \brief Number of timepoints of the CZI file at "path", see czi_directory_extent.
+int czi_timepoint_count(std::string const &path);
+
+//! \brief Number of the first nhdr of every file of "files" in directory "dir", sorted by sequence
+//! number and without part files: its sequence number plus the timepoints beyond the first of all the
+//! files before it, so every timepoint of a file of several gets a number of its own. "counts" gets the
+//! number of timepoints of every file. Directories are read in parallel.
+std::vector<int> czi_first_timepoints(std::string const &dir, std::vector< std::pair<int, std::string> > const &files,
+                                      std::vector<int> &counts);
+
+//! \brief Name of the directory with the tile nhdrs of the timepoint "nhdrFileName", 000.nhdr -> 000-tiles/.
+std::string czi_tiles_dir(std::string const &nhdrFileName);
+
+//! \brief Name of the layout descriptor of the timepoint "nhdrFileName".
+std::string czi_tiles_layout_file_name(std::string const &nhdrFileName);
+
+//! \brief Give every subblock the index of its (m, x, y) tile among the distinct ones, in that order,
+//! move x and y to the top left corner of the mosaic (CZI starts can be negative) and return the
+//! tiles as the first subblock of each.
+std::vector<CziSubBlockInfo> czi_index_tiles(std::vector<CziSubBlockInfo> &subBlocks);
+
+//! \brief Write the layout descriptor "fileName" for "tiles", whose nhdrs are "tileNhdrs"
+//! (relative to the descriptor). Throws LSPException on failure.
+void czi_write_tiles_layout(std::string const &fileName, std::vector<CziSubBlockInfo> const &tiles,
+                            std::vector<std::string> const &tileNhdrs);
+
+#endif //LSP_CZIDATASET_H
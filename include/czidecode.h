@@ -0,0 +1,46 @@
+//! \file czidecode.h
+//! \brief Decoding of compressed CZI image subblocks (LZW, zstd) into raw slices.
+
+#ifndef LSP_CZIDECODE_H
+#define LSP_CZIDECODE_H
+
+#include "skimczi.h"
+#include "czimap.h"
+
+#include <cstddef>
+#include <vector>
+
+//! \brief Whether subblocks with this compression can be decoded by this build.
+bool czi_compression_supported(int compression);
+
+//! \brief Decode "srcSize" bytes of subblock data into exactly "dstSize" bytes, throws LSPException on failure.
+void czi_decode_subblock(int compression, const unsigned char *src, size_t srcSize,
+                         unsigned char *dst, size_t dstSize, size_t pixelSize);
+
+//! \brief Decodes batches of subblocks of a mapped CZI file in parallel and keeps the raw slices.
+class CziSliceCache {
+public:
+    //! \brief Room for "capacity" slices of "sliceBytes" each. files[p] is the mapping of file part p,
+    //! where the subblocks with entry.FilePart p lie.
+    CziSliceCache(std::vector<const CziMappedFile*> const &files, std::vector<CziSubBlockInfo> const &subBlocks,
+                  size_t sliceBytes, size_t pixelSize, size_t capacity);
+
+    //! \brief Decode subblocks [first, first + count), count <= capacity, replacing the previous batch.
+    void decode(size_t first, size_t count);
+    //! \brief Raw slice of subblock i, which must be in the last decoded batch.
+    const unsigned char *slice(size_t i) const;
+
+    size_t capacity() const { return cap; }
+    //! \brief Bytes of compressed subblock data the batches so far have read.
+    size_t bytes_read() const { return bytesRead; }
+
+private:
+    std::vector<const CziMappedFile*> files;
+    std::vector<CziSubBlockInfo> const &subBlocks;
+    size_t sliceBytes, pixelSize, cap;
+    size_t first, count;
+    size_t bytesRead;
+    std::vector<unsigned char> buffer;
+};
+
+#endif //LSP_CZIDECODE_H
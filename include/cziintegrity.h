@@ -0,0 +1,48 @@
+//! \file cziintegrity.h
+//! \brief Subblock coverage of every skimmed timepoint, kept in a manifest next to the nhdr files
+//! so that later stages can skip damaged timepoints without reading their pixel data.
+//!
+//! The manifest is "integrity.txt" in the nhdr directory, one line per timepoint:
+//!     NNN status slices complete truncated missing [c:z:t|m ...]
+//! where status is "complete", "truncated" (slice data runs past the end of the file) or
+//! "incomplete" (slices are missing), and the damaged slices follow as channel:z:kind.
+//! Lines are only ever appended, the last line of a timepoint is the one that counts.
+
+#ifndef LSP_CZIINTEGRITY_H
+#define LSP_CZIINTEGRITY_H
+
+#include "skimczi.h"
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct TimepointIntegrity {
+    std::string name;           // base name of the nhdr file, e.g. 003
+    size_t slices = 0;          // sizeC*sizeZ slices the XML promises
+    size_t complete = 0;
+    std::vector< std::pair<int, int> > truncated;   // (c, z) of slices whose data runs past the end of the file
+    std::vector< std::pair<int, int> > missing;     // (c, z) of slices without a subblock
+
+    bool ok() const { return truncated.empty() && missing.empty(); }
+    const char *status() const;
+};
+
+//! \brief Check the C x Z coverage of subblocks [first, last) of one timepoint, and that every
+//! subblock segment and its pixel data lie inside its file, partFiles[entry.FilePart] (-1 for a
+//! part that is not there, its slices count as missing). Only segment headers are read.
+TimepointIntegrity czi_check_integrity(std::vector<int> const &partFiles, std::vector<CziSubBlockInfo> const &subBlocks,
+                                       size_t first, size_t last, ImageDims const &dims);
+
+//! \brief Append the entry of one timepoint to the manifest in nhdrPath, safe with several skim jobs.
+void append_integrity_manifest(std::string const &nhdrPath, TimepointIntegrity const &entry);
+
+//! \brief Latest entry of every timepoint in the manifest of nhdrPath, empty without a manifest.
+std::map<std::string, TimepointIntegrity> read_integrity_manifest(std::string const &nhdrPath);
+
+//! \brief Remove the (sequence number, base name) pairs the manifest marks as damaged from "files",
+//! reporting each one; returns how many were removed.
+size_t skip_damaged_timepoints(std::string const &nhdrPath, std::vector< std::pair<int, std::string> > &files);
+
+#endif //LSP_CZIINTEGRITY_H
@@ -0,0 +1,43 @@
+//! \file czimap.h
+//! \brief Read-only memory mapping of a CZI file that hands out typed views of its pixel data.
+
+#ifndef LSP_CZIMAP_H
+#define LSP_CZIMAP_H
+
+#include <cstddef>
+#include <string>
+
+class CziMappedFile {
+public:
+    //! \brief Map the whole file read-only, throws LSPException on failure.
+    CziMappedFile(std::string const &fileName);
+    ~CziMappedFile();
+
+    CziMappedFile(CziMappedFile const &) = delete;
+    CziMappedFile &operator=(CziMappedFile const &) = delete;
+
+    size_t size() const { return length; }
+    const unsigned char *data() const { return base; }
+
+    //! \brief View of "count" elements of type T starting at byte "offset", nullptr if that runs past the end.
+    template<typename T>
+    const T *view(size_t offset, size_t count) const
+    {
+        if (offset > length || count > (length - offset) / sizeof(T))
+            return nullptr;
+        return reinterpret_cast<const T*>(base + offset);
+    }
+
+    //! \brief Tell the kernel the mapping will be read front to back.
+    void advise_sequential() const;
+    //! \brief Ask the kernel to start reading [offset, offset+bytes) ahead of use.
+    void will_need(size_t offset, size_t bytes) const;
+
+private:
+    std::string fileName;
+    int fd;
+    size_t length;
+    unsigned char *base;
+};
+
+#endif //LSP_CZIMAP_H
@@ -0,0 +1,112 @@
+//! \file czipreview.h
+//! \brief Low resolution previews of CZI timepoints, written by skim --preview at a small fraction of
+//! the I/O of reading the full resolution slices.
+//!
+//! ZEN may store an image pyramid next to the full resolution data: subblocks that are downsampled
+//! from the area they cover (their stored size is smaller than their size) and carry a PyramidType.
+//! When a timepoint has a pyramid layer covering every (c, z), the preview is built from the layer
+//! that comes closest to CZIPREVIEW_MIN_WIDTH pixels across. Otherwise every CZIPREVIEW_STRIDE-th
+//! pixel of every CZIPREVIEW_STRIDE-th row and slice is read, only those rows for uncompressed data.
+//! Mosaic tiles are placed at their position, so the preview shows the stitched mosaic.
+//!
+//! For the timepoint NNN, the preview directory gets NNN-projXY.nrrd, NNN-projXZ.nrrd and
+//! NNN-projYZ.nrrd, laid out like the projections of skim --with-proj with the space directions
+//! scaled to the preview resolution, and NNN-max.png, the XY max projection as an 8-bit frame
+//! coloured like those of lsp anim. The thumbnail ZEN embeds as an attachment, if any, is copied
+//! to NNN-thumbnail.jpg (or the extension of its type) for the first timepoint of the file.
+
+#ifndef LSP_CZIPREVIEW_H
+#define LSP_CZIPREVIEW_H
+
+#include "skimczi.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//! \brief Sampling stride along x, y and z when a timepoint has no usable pyramid layer.
+const int CZIPREVIEW_STRIDE = 4;
+//! \brief Width in pixels the pyramid layer used for a preview should at least have.
+const int CZIPREVIEW_MIN_WIDTH = 512;
+
+//! \brief One entry of the attachment directory.
+struct CziAttachmentInfo {
+    std::string name;           // e.g. "Thumbnail"
+    std::string contentType;    // e.g. "JPG"
+    int filePart;
+    uint64_t filePosition;      // of the ZISRAWATTACH segment
+};
+
+//! \brief Load the AttachmentDirectory segment at "position" of the opened CZI file. Returns false
+//! (and leaves "attachments" empty) if the file has none or it is damaged.
+bool czi_read_attachment_directory(int cziFile, uint64_t position, std::vector<CziAttachmentInfo> &attachments);
+
+//! \brief Read the data of "attachment" from the opened CZI file; false if it cannot be read.
+bool czi_read_attachment(int cziFile, CziAttachmentInfo const &attachment, std::vector<unsigned char> &data);
+
+//! \brief Name of the frame of the timepoint "nhdrFileName" in "previewPath".
+std::string czi_preview_frame_name(std::string const &previewPath, std::string const &nhdrFileName);
+
+class CziPreviewBuilder {
+public:
+    //! \brief Previews of timepoints with the full resolution "dims"; partFiles[p] is the opened
+    //! file part p, -1 when missing.
+    CziPreviewBuilder(ImageDims const &dims, std::vector<int> const &partFiles);
+    ~CziPreviewBuilder();
+
+    CziPreviewBuilder(CziPreviewBuilder const &) = delete;
+    CziPreviewBuilder &operator=(CziPreviewBuilder const &) = delete;
+
+    //! \brief Build the preview of the timepoint with the full resolution subblocks "slices" (with
+    //! tile positions relative to the mosaic) and the pyramid subblocks "pyramid". Throws LSPException.
+    void build(std::vector<CziSubBlockInfo> const &slices, std::vector<CziSubBlockInfo> const &pyramid);
+
+    //! \brief Save the projections and the frame of the last build as "baseName"-projXY.nrrd, ...
+    //! and "baseName"-max.png. Throws LSPException on failure.
+    void save(std::string const &baseName);
+
+    //! \brief Downsampling along x/y and z of the last build.
+    int factor_xy() const { return factorXY; }
+    int factor_z() const { return factorZ; }
+    //! \brief Whether the last build read pyramid subblocks rather than sampling the full resolution slices.
+    bool from_pyramid() const { return fromPyramid; }
+    //! \brief Bytes of pixel data the last build read from the files.
+    size_t bytes_read() const { return bytesRead; }
+
+private:
+    struct PasteBlock;
+    struct SampleRows;
+
+    template<typename T>
+    void paste_block(const unsigned char *block, int width, int height, int x0, int y0);
+    template<typename T>
+    void sample_rows(const unsigned char *rows, size_t rowCount, size_t rowStride, int x0, int firstX,
+                     int y0, int width);
+
+    bool choose_pyramid(std::vector<CziSubBlockInfo> const &slices, std::vector<CziSubBlockInfo> const &pyramid,
+                        std::vector<CziSubBlockInfo> &layer);
+    void allocate(int sizeX, int sizeY, int sizeZ);
+    void read_block(CziSubBlockInfo const &block, size_t width, size_t height, std::vector<unsigned char> &out);
+    void add_pyramid_block(CziSubBlockInfo const &block);
+    void add_sampled_tile(CziSubBlockInfo const &tile);
+    void project_canvas(int c, int z);
+
+    ImageDims dims;
+    std::vector<int> partFiles;
+    airArray *mop;
+
+    int factorXY, factorZ;
+    bool fromPyramid;
+    size_t bytesRead;
+    // origin of the preview grid in full resolution pixels of the mosaic
+    int originX, originY;
+
+    // one preview slice of one channel, filled by the blocks of the current (c, z)
+    int canvasX, canvasY, canvasZ;
+    std::vector<float> canvas;
+    std::vector<unsigned char> buffer, compressed;
+
+    Nrrd *nproj_xy, *nproj_xz, *nproj_yz;
+};
+
+#endif //LSP_CZIPREVIEW_H
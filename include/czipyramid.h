@@ -0,0 +1,75 @@
+//! \file czipyramid.h
+//! \brief Box-downsampled levels of every timepoint, written by skim in the same pass that reads its slices.
+//!
+//! Level L is 2^L times smaller along x, y and z (channels are kept) and is saved as an attached-header
+//! NRRD next to the nhdr file, 000.nhdr -> 000-L1.nrrd, 000-L2.nrrd, ... Every voxel is the mean of the
+//! 2^L x 2^L x 2^L box of full resolution voxels it covers, fewer at the far edges when a size is not a
+//! multiple of 2^L. Type, axis order and units are those of the nhdr file; the space directions are
+//! scaled by 2^L and the origin moved to the center of the first box, so all levels line up in space.
+
+#ifndef LSP_CZIPYRAMID_H
+#define LSP_CZIPYRAMID_H
+
+#include "skimczi.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//! \brief Number of levels skim can write, 2x, 4x and 8x.
+const int CZIPYRAMID_MAX_LEVELS = 3;
+
+//! \brief Name of level "level" of the timepoint "nhdrFileName".
+std::string czi_pyramid_file_name(std::string const &nhdrFileName, int level);
+
+//! \brief File to read for "nhdrFileName" at "level": the coarsest existing level up to "level",
+//! or the nhdr file itself for level 0 or when skim wrote no levels.
+std::string czi_pyramid_pick(std::string const &nhdrFileName, int level);
+
+class CziPyramidWriter {
+public:
+    //! \brief Create levels 1 to "levels" of the timepoint "nhdrFileName", whose first voxel lies
+    //! (originX, originY) pixels into the mosaic. Throws LSPException on failure.
+    CziPyramidWriter(ImageDims const &dims, int levels, std::string const &nhdrFileName,
+                     int originX = 0, int originY = 0);
+    ~CziPyramidWriter();
+
+    CziPyramidWriter(CziPyramidWriter const &) = delete;
+    CziPyramidWriter &operator=(CziPyramidWriter const &) = delete;
+
+    //! \brief Add the raw slice (c, z) of the file's pixel type. Slices come in ascending z; a box
+    //! is written out as soon as a slice beyond it arrives.
+    void add_slice(int c, int z, const unsigned char *slice);
+
+    //! \brief Write out the boxes still open and close the files.
+    void finish();
+
+private:
+    struct Level {
+        int factor;
+        size_t sizeX, sizeY, sizeZ;
+        std::string fileName;
+        int fd;
+        size_t dataOffset;              // length of the header in front of the data
+        int block;                      // z of the box being summed, -1 when there is none
+        std::vector<double> sum;        // sizeX*sizeY per channel
+        std::vector<uint32_t> slices;   // full resolution slices summed per channel
+    };
+
+    template<typename T>
+    void accumulate(int c, const T *slice);
+    template<typename T>
+    void store_plane(Level const &level, int c);
+    struct Accumulate;
+    struct StorePlane;
+    void start_block(size_t l, int block);
+    void flush(size_t l);
+    void write_header(Level &level);
+
+    ImageDims dims;
+    int originX, originY;
+    std::vector<Level> levels;
+    std::vector<unsigned char> plane;   // one converted plane, reused
+};
+
+#endif //LSP_CZIPYRAMID_H
@@ -0,0 +1,103 @@
+//! \file czistats.h
+//! \brief Pixel statistics of every timepoint, gathered by skim while it reads the slices and kept in
+//! a binary sidecar next to the nhdr file (000.nhdr -> 000.stats), so that later stages can take their
+//! quantization ranges from histograms instead of scanning the data again.
+//!
+//! The sidecar is written in the byte order of the machine that skimmed:
+//!     CziStatsHeader
+//!     sizeC*sizeZ CziSliceStats, slice (c, z) at c + z*sizeC
+//!     for every channel, CZISTATS_NUM_HISTOGRAMS histograms of "bins" uint64_t counts
+//! The histograms cover [histMin, histMax) in equal bins: 256 for 8-bit and 4096 for 16-bit data.
+//! Float data has no fixed range and gets no histograms (bins is 0).
+
+#ifndef LSP_CZISTATS_H
+#define LSP_CZISTATS_H
+
+#include "skimczi.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#pragma pack(push,1)
+typedef struct {
+    char magic[8];          // "LSPSTATS"
+    uint32_t version;       // 1
+    int32_t pixelType;      // CziPixelType of the data
+    int32_t sizeX, sizeY, sizeC, sizeZ;
+    uint32_t bins;          // bins of every histogram, 0 for none
+    double histMin, histMax;
+} CziStatsHeader;
+#pragma pack(pop)
+
+#pragma pack(push,1)
+typedef struct {
+    uint64_t count;         // pixels seen, 0 for a slice without subblock
+    double min, max, mean;
+} CziSliceStats;
+#pragma pack(pop)
+
+// histograms kept for every channel
+typedef enum {
+    CZISTATS_VOLUME = 0,        // all pixels
+    CZISTATS_MAX_XY,            // max projection along z, the "z" frames of anim
+    CZISTATS_MAX_XY_CENTER,     // same, central half in x and y, as resamp crops it for its ranges
+    CZISTATS_MAX_YZ,            // max projection along x, the "x" frames of anim
+    CZISTATS_NUM_HISTOGRAMS
+} CziStatsHistogram;
+
+class CziStats {
+public:
+    CziStatsHeader header;
+    std::vector<CziSliceStats> slices;
+    std::vector<uint64_t> histograms;
+
+    //! \brief Statistics of channel c, merged over all of its slices.
+    CziSliceStats channel(int c) const;
+
+    //! \brief Counts of histogram "kind" of channel c, header.bins of them.
+    const uint64_t *histogram(int c, CziStatsHistogram kind) const;
+
+    //! \brief Value below which "fraction" of the pixels in histogram "kind" of channel c lie,
+    //! interpolated within its bin.
+    double percentile(int c, CziStatsHistogram kind, double fraction) const;
+
+    //! \brief Range from the same strings nrrdRangePercentileFromStringSet takes: "N%" is the value
+    //! N percent from the bottom (minStr) or from the top (maxStr), anything else a value as is.
+    //! Returns false when there are no histograms or channel c has no pixels.
+    bool range(int c, CziStatsHistogram kind, std::string const &minStr, std::string const &maxStr,
+               double &min, double &max) const;
+};
+
+//! \brief Name of the sidecar that belongs to "nhdrFileName".
+std::string czi_stats_file_name(std::string const &nhdrFileName);
+
+//! \brief Read the sidecar "fileName"; false when it is missing or not a sidecar this version reads.
+bool czi_stats_load(std::string const &fileName, CziStats &stats);
+
+//! \brief Collects the statistics of one timepoint from its raw slices, in any order.
+class CziStatsAccumulator {
+public:
+    explicit CziStatsAccumulator(ImageDims const &dims);
+
+    //! \brief Add the raw slice (c, z) of sizeX*sizeY pixels of the file's pixel type.
+    void add_slice(int c, int z, const unsigned char *slice);
+
+    //! \brief Histogram the projections and write the sidecar. Throws LSPException on failure.
+    void save(std::string const &fileName);
+
+    CziStats const &stats() const { return result; }
+
+private:
+    template<typename T>
+    void add(int c, int z, const T *slice);
+    struct AddSlice;
+    size_t bin(double value) const;
+
+    CziStats result;
+    double binScale;
+    // running max projections, -FLT_MAX where no slice has been seen
+    std::vector<float> maxXY, maxYZ;
+};
+
+#endif //LSP_CZISTATS_H
@@ -0,0 +1,57 @@
+//! \file cziwatch.h
+//! \brief Watches a live acquisition directory and hands out each CZI file once it has been written completely.
+
+#ifndef LSP_CZIWATCH_H
+#define LSP_CZIWATCH_H
+
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+#include <sys/types.h>
+
+//! \brief Whether the CZI file at "path" has been finalized: a file header without a pending update,
+//! a metadata segment inside the file and a subblock directory that reads back.
+bool czi_file_complete(std::string const &path);
+
+//! \brief Sequence number of a timepoint .czi file name, the number between its last parentheses
+//! or 0 when it has none; false for names that are not timepoint .czi files.
+bool czi_file_sequence_number(std::string const &name, int &sequenceNum);
+
+class CziDirectoryWatcher {
+public:
+    //! \brief Watch "dir" with inotify; a file is complete once its size did not change for
+    //! "settleSeconds" (or it was closed after writing) and czi_file_complete says so.
+    //! Files already in the directory are handed out first. Throws LSPException on failure.
+    CziDirectoryWatcher(std::string const &dir, int settleSeconds);
+    ~CziDirectoryWatcher();
+
+    CziDirectoryWatcher(CziDirectoryWatcher const &) = delete;
+    CziDirectoryWatcher &operator=(CziDirectoryWatcher const &) = delete;
+
+    //! \brief Wait for the next complete file, lowest sequence number first, and return its name.
+    //! Returns false once nothing in the directory changed for "idleSeconds" (0 waits forever).
+    bool next(std::string &name, int idleSeconds);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+    struct Pending {
+        off_t size;
+        Clock::time_point changed;
+        bool closed;    // closed after writing, no need to wait for the size to settle
+    };
+
+    void rescan();
+    void read_events(int timeoutMs);
+    void add_pending(std::string const &name, bool closed);
+    bool take_ready(std::string &name);
+
+    std::string dir;
+    int settleSeconds;
+    int fd, wd;
+    std::map<std::string, Pending> pending;
+    std::set<std::string> handedOut;
+    Clock::time_point lastActivity, lastRescan;
+};
+
+#endif //LSP_CZIWATCH_H
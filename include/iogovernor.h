@@ -0,0 +1,98 @@
+//! \file iogovernor.h
+//! \brief Adaptive limit on the file reads the directory loops of skim, proj and resamp have in flight,
+//! optionally shared with other processes, on other nodes as well, through a lock file.
+//!
+//! Every read of pixel data (the slices of a skimmed timepoint, an nhdr volume or slab) waits for a
+//! slot. The number of slots of a process follows its measured read bandwidth, additive increase /
+//! multiplicative decrease: one more while the bandwidth of a window of reads grows by a tenth, half as many when it drops to three
+//! quarters, and one more as a probe after a few steady windows. Workers waiting for a slot do not
+//! compute either, so the compute workers in use follow the same limit.
+//!
+//! With shared slots, a read also holds one of the first "shared_slots" bytes of the lock file under
+//! an fcntl write lock, which works across nodes on the shared file systems that support POSIX locks.
+//! Locks go away with the process, so a job that is killed never leaves a slot taken.
+
+#ifndef LSP_IOGOVERNOR_H
+#define LSP_IOGOVERNOR_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "CLI11.hpp"
+
+struct ioOptions {
+    // most reads one process has in flight, 0 for as many as it has workers
+    int max_reads = 0;
+    // reads in flight over all processes using the same lock file, 0 for no coordination
+    int shared_slots = 0;
+    // lock file of the shared slots, <output directory>/.lsp-io.lock when empty
+    std::string lock_file;
+    int verbose = 0;
+};
+
+//! \brief Add the --io-max, --io-slots and --io-lock options of "opt" to a subcommand.
+void add_io_options(CLI::App *sub, ioOptions &opt);
+
+class IoGovernor {
+public:
+    //! \brief Limit the reads of "workers" workers; the default lock file lies in "outputDir".
+    //! Throws LSPException when the lock file cannot be opened.
+    IoGovernor(ioOptions const &opt, int workers, std::string const &outputDir);
+    ~IoGovernor();
+
+    IoGovernor(IoGovernor const &) = delete;
+    IoGovernor &operator=(IoGovernor const &) = delete;
+
+    //! \brief Wait for a read slot; returns the shared slot taken, -1 without shared slots.
+    int begin_read();
+    //! \brief Give back the slot of begin_read, after a read of "bytes" (0 for none, e.g. skipped).
+    void end_read(int sharedSlot, size_t bytes);
+
+    //! \brief Reads currently allowed in flight in this process.
+    int limit() const;
+    //! \brief Read bandwidth of the last finished window in MB/s, 0 before the first one.
+    double bandwidth() const;
+
+    //! \brief A read slot held for the lifetime of the object; a null governor does not limit anything.
+    class Read {
+    public:
+        explicit Read(IoGovernor *governor);
+        ~Read();
+        //! \brief The read is over and moved "bytes", the slot is given back.
+        void done(size_t bytes);
+    private:
+        IoGovernor *governor;
+        int sharedSlot;
+        bool held;
+    };
+
+private:
+    int take_shared_slot();
+    void adapt();
+
+    int maxReads;
+    int sharedSlots;
+    int verbose;
+    std::string lockFileName;
+    int lockFd;
+
+    mutable std::mutex lock;
+    std::condition_variable slotCond;
+    int current;                    // limit, guarded by lock
+    int inFlight;
+    std::vector<bool> heldShared;   // fcntl locks belong to the process, so its threads keep track themselves
+
+    // the window of reads the bandwidth is measured over, counting only the time some read was in flight
+    std::chrono::steady_clock::time_point busyStart;
+    double windowSeconds;
+    size_t windowBytes;
+    int windowReads;
+    double lastBandwidth;
+    int steadyWindows;
+};
+
+#endif //LSP_IOGOVERNOR_H
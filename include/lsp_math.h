@@ -26,7 +26,8 @@ typedef enum
     lspTypeUChar,       // (1) 1-byte unsigned char
     lspTypeShort,       // (2)
     lspTypeUShort,      // (3)
-    lspTypeDouble       // (4)
+    lspTypeDouble,      // (4)
+    lspTypeFloat        // (5) only used for volumes
 } lspType;
 
 /*
@@ -0,0 +1,65 @@
+//! \file nhdrstream.h
+//! \brief Reads the volume of an nhdr file a slab of planes along its last axis at a time, straight from
+//! the data files its header points to, so the volume never has to fit into memory.
+//!
+//! Only the layouts skim writes can be streamed: raw data in the byte order of this machine, either in
+//! one data file (with a byte skip) or as a "SKIPLIST N" of offsets into data files, one per N-dimensional
+//! chunk of the volume. Relative data file names are taken relative to the directory of the header, as
+//! teem does. Anything else, e.g. an attached header or compressed data, is left to nrrdLoad.
+
+#ifndef LSP_NHDRSTREAM_H
+#define LSP_NHDRSTREAM_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <teem/nrrd.h>
+
+class NhdrSlabReader {
+public:
+    //! \brief Read the header "nhdrName" and the data files it lists. Throws LSPException when the header
+    //! cannot be read or a data file cannot be opened.
+    explicit NhdrSlabReader(std::string const &nhdrName);
+    ~NhdrSlabReader();
+
+    NhdrSlabReader(NhdrSlabReader const &) = delete;
+    NhdrSlabReader &operator=(NhdrSlabReader const &) = delete;
+
+    //! \brief Whether read_planes can be used; why_not() says why not otherwise.
+    bool streamable() const { return canStream; }
+    std::string const &why_not() const { return whyNot; }
+
+    //! \brief The volume without data, for its type, sizes and axis and space information.
+    Nrrd const *header() const { return nhdr; }
+    //! \brief Number of planes along the last axis, and bytes of one plane.
+    size_t planes() const;
+    size_t plane_bytes() const { return planeBytes; }
+
+    //! \brief Read the planes [z0, z0 + count) into "buffer", which holds count * plane_bytes() bytes.
+    //! Throws LSPException when the data files are shorter or cannot be read.
+    void read_planes(size_t z0, size_t count, void *buffer);
+
+private:
+    void parse_data_files(std::string const &nhdrName);
+    int open_data_file(std::string const &name);
+
+    // chunk k holds the bytes [k * chunkBytes, (k + 1) * chunkBytes) of the volume
+    struct Chunk {
+        int file;
+        size_t offset;
+    };
+
+    Nrrd *nhdr;
+    airArray *mop;
+    std::string dir;
+    bool canStream;
+    std::string whyNot;
+    size_t planeBytes;
+    size_t chunkBytes;
+    std::vector<Chunk> chunks;
+    std::vector<std::string> fileNames;
+    std::vector<int> fds;
+};
+
+#endif //LSP_NHDRSTREAM_H
@@ -0,0 +1,164 @@
+//! \file pixeltraits.h
+//! \brief Compile-time traits of the pixel types the stages read, and dispatch from the runtime type
+//! tags (CziPixelType, nrrd type, lspType) to code templated on them.
+//!
+//! Loops over pixels are written once as templates on the pixel type T and instantiated for every type
+//! here, so the type is decided once per slice or volume rather than per pixel. A dispatcher calls
+//! f(PixelTag<T>()) with the T of the given tag; C++11 lambdas cannot be generic, so f is a small
+//! functor with a templated operator(). Nested classes can reach the private templates of their class:
+//!
+//!     struct Foo::AddSlice {
+//!         Foo *self; const unsigned char *slice;
+//!         template<typename T> void operator()(PixelTag<T>) const { self->add((const T*)slice); }
+//!     };
+//!     if (!pixel_dispatch_czi(pixelType, AddSlice{this, slice})) throw ...;
+
+#ifndef LSP_PIXELTRAITS_H
+#define LSP_PIXELTRAITS_H
+
+#include "skimczi.h"
+#include "lsp_math.h"
+
+#include <cfloat>
+#include <cstdint>
+
+#include <teem/nrrd.h>
+
+template<typename T>
+struct PixelTraits;
+
+template<>
+struct PixelTraits<uint8_t> {
+    static const CziPixelType cziType = CZIPIXELTYPE_GRAY8;
+    static const int nrrdType = nrrdTypeUChar;
+    static const lspType lsp = lspTypeUChar;
+    static const char *nrrd_name() { return "uchar"; }
+    static double lowest() { return 0; }
+    static double highest() { return 255; }
+    //! \brief Nearest value of this type, clamped to its range.
+    static uint8_t from_double(double v) { return v <= 0 ? 0 : v >= 255 ? 255 : (uint8_t)(v + 0.5); }
+};
+
+template<>
+struct PixelTraits<uint16_t> {
+    static const CziPixelType cziType = CZIPIXELTYPE_GRAY16;
+    static const int nrrdType = nrrdTypeUShort;
+    static const lspType lsp = lspTypeUShort;
+    static const char *nrrd_name() { return "ushort"; }
+    static double lowest() { return 0; }
+    static double highest() { return 65535; }
+    static uint16_t from_double(double v) { return v <= 0 ? 0 : v >= 65535 ? 65535 : (uint16_t)(v + 0.5); }
+};
+
+// resampled volumes may hold negative values, CZI files never do
+template<>
+struct PixelTraits<int16_t> {
+    static const CziPixelType cziType = CZIPIXELTYPE_UNDEFINED;
+    static const int nrrdType = nrrdTypeShort;
+    static const lspType lsp = lspTypeShort;
+    static const char *nrrd_name() { return "short"; }
+    static double lowest() { return -32768; }
+    static double highest() { return 32767; }
+    static int16_t from_double(double v)
+    {
+        return v <= -32768 ? -32768 : v >= 32767 ? 32767 : (int16_t)(v < 0 ? v - 0.5 : v + 0.5);
+    }
+};
+
+template<>
+struct PixelTraits<float> {
+    static const CziPixelType cziType = CZIPIXELTYPE_GRAY32FLOAT;
+    static const int nrrdType = nrrdTypeFloat;
+    static const lspType lsp = lspTypeFloat;
+    static const char *nrrd_name() { return "float"; }
+    static double lowest() { return -FLT_MAX; }
+    static double highest() { return FLT_MAX; }
+    static float from_double(double v) { return (float)v; }
+};
+
+template<>
+struct PixelTraits<double> {
+    static const CziPixelType cziType = CZIPIXELTYPE_UNDEFINED;
+    static const int nrrdType = nrrdTypeDouble;
+    static const lspType lsp = lspTypeDouble;
+    static const char *nrrd_name() { return "double"; }
+    static double lowest() { return -DBL_MAX; }
+    static double highest() { return DBL_MAX; }
+    static double from_double(double v) { return v; }
+};
+
+//! \brief Carries a pixel type to a dispatched functor.
+template<typename T>
+struct PixelTag {
+    typedef T type;
+};
+
+//! \brief f(PixelTag<T>()) for the pixel types skim can read; false for any other type.
+template<typename F>
+bool pixel_dispatch_czi(int cziType, F &&f)
+{
+    switch (cziType)
+    {
+        case CZIPIXELTYPE_GRAY8: f(PixelTag<uint8_t>()); return true;
+        case CZIPIXELTYPE_GRAY16: f(PixelTag<uint16_t>()); return true;
+        case CZIPIXELTYPE_GRAY32FLOAT: f(PixelTag<float>()); return true;
+        default: return false;
+    }
+}
+
+//! \brief f(PixelTag<T>()) for the nrrd types with traits; false for any other type.
+template<typename F>
+bool pixel_dispatch_nrrd(int nrrdType, F &&f)
+{
+    switch (nrrdType)
+    {
+        case nrrdTypeUChar: f(PixelTag<uint8_t>()); return true;
+        case nrrdTypeUShort: f(PixelTag<uint16_t>()); return true;
+        case nrrdTypeShort: f(PixelTag<int16_t>()); return true;
+        case nrrdTypeFloat: f(PixelTag<float>()); return true;
+        case nrrdTypeDouble: f(PixelTag<double>()); return true;
+        default: return false;
+    }
+}
+
+//! \brief f(PixelTag<T>()) for the lspVolume types; false for lspTypeUnknown.
+template<typename F>
+bool pixel_dispatch_lsp(lspType type, F &&f)
+{
+    switch (type)
+    {
+        case lspTypeUChar: f(PixelTag<uint8_t>()); return true;
+        case lspTypeUShort: f(PixelTag<uint16_t>()); return true;
+        case lspTypeShort: f(PixelTag<int16_t>()); return true;
+        case lspTypeFloat: f(PixelTag<float>()); return true;
+        case lspTypeDouble: f(PixelTag<double>()); return true;
+        default: return false;
+    }
+}
+
+//! \brief CZI pixel type with the same values as a nrrd type, CZIPIXELTYPE_UNDEFINED when there is none;
+//! for code that is only instantiated for the types skim reads.
+inline CziPixelType pixel_czi_type(int nrrdType)
+{
+    switch (nrrdType)
+    {
+        case nrrdTypeUChar: return CZIPIXELTYPE_GRAY8;
+        case nrrdTypeUShort: return CZIPIXELTYPE_GRAY16;
+        case nrrdTypeFloat: return CZIPIXELTYPE_GRAY32FLOAT;
+        default: return CZIPIXELTYPE_UNDEFINED;
+    }
+}
+
+//! \brief NRRD "type:" of a CZI pixel type, nullptr for the ones skim cannot read.
+inline const char *pixel_nrrd_name(CziPixelType cziType)
+{
+    switch (cziType)
+    {
+        case CZIPIXELTYPE_GRAY8: return PixelTraits<uint8_t>::nrrd_name();
+        case CZIPIXELTYPE_GRAY16: return PixelTraits<uint16_t>::nrrd_name();
+        case CZIPIXELTYPE_GRAY32FLOAT: return PixelTraits<float>::nrrd_name();
+        default: return nullptr;
+    }
+}
+
+#endif //LSP_PIXELTRAITS_H
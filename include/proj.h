@@ -9,6 +9,10 @@
 #define LSP_PROJ_H
 
 #include "CLI11.hpp"
+#include "iogovernor.h"
+#include "projengine.h"
+
+#include <vector>
 
 struct projOptions {
 	int file_number = 0;
@@ -20,6 +24,21 @@ struct projOptions {
     std::string file_name;
     int number_of_processed = 0;
     int verbose = 0;
+    // read the downsampled level skim --pyramid wrote instead of the full resolution data, 0 for none
+    int level = 0;
+    // number of volumes projected at the same time in directory mode
+    int jobs = 1;
+    // when set, volumes are read a slab of z planes at a time within about this many MB
+    int mem_limit = 0;
+    // comma separated measures stacked along the proj axis of the outputs, e.g. "max,mean,std,min,p95"
+    std::string measures = PROJ_DEFAULT_MEASURES;
+    // when set, also write max projections of this many z planes every slab_stride planes (0: slab) to NNN-slabXY.nrrd
+    int slab = 0;
+    int slab_stride = 0;
+    // reads of input volumes in flight, adapted to the read bandwidth and optionally shared with other processes
+    ioOptions io;
+    // set by the directory loop, null reads without limit
+    IoGovernor *governor = nullptr;
 };
 
 void setup_proj(CLI::App &app);
@@ -32,8 +51,13 @@ public:
 	void main();
 
 private:
-	std::string nhdr_name, proj_common;
+	void project_loaded(Nrrd *nin, Nrrd *nproj_xy, Nrrd *nproj_xz, Nrrd *nproj_yz, Nrrd *nslab);
+	bool project_streamed(std::string const &input_name, Nrrd *nproj_xy, Nrrd *nproj_xz, Nrrd *nproj_yz, Nrrd *nslab);
+	void project_teem(Nrrd *nin, Nrrd *nproj_xy, Nrrd *nproj_xz, Nrrd *nproj_yz);
+
+	std::string nhdr_name, proj_common, slab_name;
 	projOptions opt;
+	std::vector<ProjMeasure> measures;
 	airArray* mop;
 };
 
@@ -0,0 +1,122 @@
+//! \file projengine.h
+//! \brief All the projections lsp proj writes, computed in one pass over an x-y-c-z volume.
+//!
+//! Every slice (c, z) goes through proj_accumulate_slice once, which updates the running XY max and
+//! mean and writes the XZ and YZ rows of that slice straight into their place in the output. Slabs of
+//! slices are split along z over threads; the XY accumulators are per thread, the first thread using
+//! the output itself, and are merged by finish(). The outputs have the layout of the projection files:
+//! x-y-c-proj, x-z-c-proj and y-z-c-proj floats, with one measure after the other along the proj axis,
+//! by default max and mean.
+//!
+//! The other measures are exact for XZ and YZ, which only take the values of one slice. Along z, min
+//! and standard deviation (Welford's running variance) are exact as well, while a percentile is the
+//! P-square estimate of Jain and Chlamtac, 32 bytes per pixel and channel. The argmax measure is the
+//! index of the plane holding the maximum, the first one on ties, which gives depth-coded projections
+//! and height maps: z for XY, y for XZ and x for YZ. These XY measures are kept for rows of pixels
+//! split over the threads rather than per thread, so their slabs have to come in ascending z.
+
+#ifndef LSP_PROJENGINE_H
+#define LSP_PROJENGINE_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <teem/nrrd.h>
+
+//! \brief What a projection takes of the values along its axis.
+enum ProjMeasureKind {
+    PROJ_MEASURE_MAX,
+    PROJ_MEASURE_MEAN,
+    PROJ_MEASURE_SUM,
+    PROJ_MEASURE_MIN,
+    PROJ_MEASURE_STD,
+    PROJ_MEASURE_PERCENTILE,
+    PROJ_MEASURE_ARGMAX
+};
+
+struct ProjMeasure {
+    ProjMeasureKind kind;
+    // of a PROJ_MEASURE_PERCENTILE, between 0 and 100
+    double percentile;
+};
+
+//! \brief Measures of the projection files when none are asked for.
+const char *const PROJ_DEFAULT_MEASURES = "max,mean";
+
+//! \brief Parse a comma separated list like "max,mean,sum,std,min,p95,argmax". Throws LSPException.
+std::vector<ProjMeasure> proj_parse_measures(std::string const &list);
+//! \brief Name of a measure in such a list, e.g. "p95".
+std::string proj_measure_name(ProjMeasure const &measure);
+
+class ProjEngine {
+public:
+    //! \brief Project a volume of the nrrd "type" and the given size into "nxy", "nxz" and "nyz", which are
+    //! allocated here; "threads" 0 uses as many as OpenMP allows. Throws LSPException.
+    ProjEngine(int type, size_t sizeX, size_t sizeY, size_t sizeC, size_t sizeZ,
+               Nrrd *nxy, Nrrd *nxz, Nrrd *nyz, std::vector<ProjMeasure> const &measures, int threads = 0);
+    ~ProjEngine();
+
+    ProjEngine(ProjEngine const &) = delete;
+    ProjEngine &operator=(ProjEngine const &) = delete;
+
+    //! \brief Whether "nin" (possibly a header without data) is an x-y-c-z volume of a type the
+    //! engine can read; others are left to nrrdProject.
+    static bool supports(Nrrd const *nin);
+
+    //! \brief Bytes the outputs and the XY accumulators shared by all threads take, and the bytes every
+    //! further thread adds.
+    static size_t fixed_bytes(size_t sizeX, size_t sizeY, size_t sizeC, size_t sizeZ,
+                              std::vector<ProjMeasure> const &measures);
+    static size_t thread_bytes(size_t sizeX, size_t sizeY, size_t sizeC, std::vector<ProjMeasure> const &measures);
+
+    //! \brief Add the "count" z planes from "z0" on, "slab" holding them as x-y-c-z.
+    void add_slab(const void *slab, size_t z0, size_t count);
+
+    //! \brief Merge the per-thread accumulators once every plane was added, and give the outputs the
+    //! axis and space information of the volume "header".
+    void finish(Nrrd const *header);
+
+private:
+    struct AddSlab;
+    template<typename T>
+    void add_planes(const T *slab, size_t z0, size_t count);
+    template<typename T>
+    void slice_measures(const T *slice, size_t c, size_t z, std::vector<float> &scratch);
+    template<typename T>
+    void xy_measures(const T *slab, size_t count);
+
+    // running XY max and mean of all channels, sizeX*sizeY*sizeC each or null when not asked for
+    struct Partial {
+        float *max;
+        float *mean;
+        bool used;
+        std::vector<float> storage;
+    };
+
+    int type;
+    size_t sizeX, sizeY, sizeC, sizeZ;
+    Nrrd *nxy, *nxz, *nyz;
+    std::vector<ProjMeasure> measures;
+    int threads;
+    std::vector<Partial> partials;
+
+    // index of max, mean and sum along the proj axis, -1 when not asked for
+    int maxIndex, meanIndex, sumIndex;
+    // where the kernel accumulates its running mean: the mean, or the sum (unscaled) when only the sum
+    // is asked for; a sum next to a mean is the mean times the number of values
+    int averageIndex;
+    // whether there are measures other than max, mean and sum
+    bool sliceMeasures;
+    // running XY min goes straight to the output, the variance and percentiles need state of their own
+    size_t planesAdded;
+    std::vector<float> welfordMean, welfordM2;
+    // running XY max behind argmax, whose plane index goes straight to the output like min
+    std::vector<float> argmaxValue;
+    std::vector< std::vector<float> > quantileStates;
+    std::vector< std::vector<float> > scratch;
+
+    airArray *mop;
+};
+
+#endif //LSP_PROJENGINE_H
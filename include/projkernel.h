@@ -0,0 +1,47 @@
+//! \file projkernel.h
+//! \brief Vectorized max/mean projection accumulator for one image slice.
+
+#ifndef LSP_PROJKERNEL_H
+#define LSP_PROJKERNEL_H
+
+#include <cstddef>
+#include <cstdint>
+
+//! \brief Instruction sets the accumulator can run with.
+enum ProjKernelIsa {
+    PROJ_ISA_SCALAR = 0,
+    PROJ_ISA_SSE2
+};
+
+//! \brief Where one sizeX*sizeY slice is accumulated to. Any pointer may be null to skip that output.
+struct ProjSliceTargets {
+    // sizeX*sizeY, running over slices: max, and mean += value*scaleXY
+    float *maxXY = nullptr;
+    float *meanXY = nullptr;
+    // sizeX, overwritten with the profile of this slice over y
+    float *maxXZ = nullptr;
+    float *meanXZ = nullptr;
+    // sizeY, overwritten with the profile of this slice over x
+    float *maxYZ = nullptr;
+    float *meanYZ = nullptr;
+    // reciprocals of the number of values each mean is taken over, usually 1/sizeZ, 1/sizeY and 1/sizeX
+    float scaleXY = 1;
+    float scaleXZ = 1;
+    float scaleYZ = 1;
+};
+
+//! \brief Reset running XY max/mean buffers of n values before the first slice.
+void proj_init_xy(float *maxXY, float *meanXY, size_t n);
+
+//! \brief Accumulate one row-major slice into "targets".
+void proj_accumulate_slice(const unsigned char *slice, size_t sizeX, size_t sizeY, ProjSliceTargets const &targets);
+void proj_accumulate_slice(const uint16_t *slice, size_t sizeX, size_t sizeY, ProjSliceTargets const &targets);
+void proj_accumulate_slice(const float *slice, size_t sizeX, size_t sizeY, ProjSliceTargets const &targets);
+
+//! \brief Instruction set in use, the best one the CPU supports unless changed by proj_kernel_select.
+ProjKernelIsa proj_kernel_isa();
+//! \brief Force an instruction set, returns false (and changes nothing) if the CPU lacks it.
+bool proj_kernel_select(ProjKernelIsa isa);
+const char *proj_kernel_isa_name(ProjKernelIsa isa);
+
+#endif //LSP_PROJKERNEL_H
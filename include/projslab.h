@@ -0,0 +1,67 @@
+//! \file projslab.h
+//! \brief Stack of max projections of thick z slabs, e.g. 20 planes every 10, in one pass over an
+//! x-y-c-z volume.
+//!
+//! Overlapping slabs share their planes in blocks of gcd(thickness, stride) planes: every plane is
+//! maxed into the accumulator of its block once, and a slab is the max of its thickness/gcd blocks
+//! once the last of them is complete. The block accumulators form a ring, so memory does not grow
+//! with the number of planes, and planes between slabs (stride > thickness) are not accumulated;
+//! they are still read for the other projections.
+//! Rows of pixels are split over the threads, so slabs of planes have to come in ascending z.
+
+#ifndef LSP_PROJSLAB_H
+#define LSP_PROJSLAB_H
+
+#include <cstddef>
+#include <vector>
+
+#include <teem/nrrd.h>
+
+class ProjSlabStack {
+public:
+    //! \brief Max projections of the planes [k * stride, k * stride + thickness) of a volume of the nrrd
+    //! "type" and the given size into "nout", x-y-c-slab floats allocated here. A thickness of more
+    //! than sizeZ is one slab of all planes, a stride of 0 is the thickness. Throws LSPException.
+    ProjSlabStack(int type, size_t sizeX, size_t sizeY, size_t sizeC, size_t sizeZ,
+                  size_t thickness, size_t stride, Nrrd *nout, int threads = 0);
+    ~ProjSlabStack();
+
+    ProjSlabStack(ProjSlabStack const &) = delete;
+    ProjSlabStack &operator=(ProjSlabStack const &) = delete;
+
+    //! \brief Bytes of the output and the ring of block accumulators.
+    static size_t bytes(size_t sizeX, size_t sizeY, size_t sizeC, size_t sizeZ, size_t thickness, size_t stride);
+
+    //! \brief Number of slabs along z.
+    size_t slabs() const { return numSlabs; }
+
+    //! \brief Add the "count" z planes from "z0" on, "slab" holding them as x-y-c-z; z0 has to be
+    //! the plane after the last one added.
+    void add_slab(const void *slab, size_t z0, size_t count);
+
+    //! \brief Give the output the x, y and c axis information of the volume "header", and the slab
+    //! geometry as key/value pairs.
+    void finish(Nrrd const *header);
+
+private:
+    struct AddSlab;
+    template<typename T>
+    void add_planes(const T *slab, size_t z0, size_t count);
+    // whether the block "b" is part of any slab
+    bool block_used(size_t b) const;
+
+    int type;
+    size_t sizeX, sizeY, sizeC, sizeZ;
+    size_t thickness, stride, numSlabs;
+    // planes per block, blocks per slab and blocks per stride
+    size_t blockPlanes, slabBlocks, strideBlocks;
+    Nrrd *nout;
+    int threads;
+    size_t planesAdded;
+    // slabBlocks accumulators of sizeX*sizeY*sizeC, block b in slot b % slabBlocks
+    std::vector<float> ring;
+
+    airArray *mop;
+};
+
+#endif //LSP_PROJSLAB_H
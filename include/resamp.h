@@ -8,6 +8,7 @@
 
 #include <vector>
 #include "CLI11.hpp"
+#include "iogovernor.h"
 #include "lsp_math.h"
 #include "image.h"
 #include "volume.h"
@@ -46,6 +47,15 @@ struct resampOptions {
     vector< pair<int, string> > allValidFiles;
 
     uint verbose = 0;
+
+    // take the quantization ranges from the statistics skim --stats wrote next to the nhdr files
+    bool stats = false;
+
+    // resample the downsampled level skim --pyramid wrote instead of the full resolution data, 0 for none
+    int level = 0;
+
+    // reads of input volumes in flight, shared with other processes through a lock file when asked to
+    ioOptions io;
     
     // used for the upper and lower bounds for clamping
     // min percentile for GFP and RFP in quantization
@@ -59,8 +69,9 @@ void setup_resamp(CLI::App &app);
 // function that performs 3D resampling (convolution)
 int nrrdResample3D(lspVolume* newVolume, lspCtx3D* ctx3D);
 
-// evaluate 3D convolution between volume and kernel
-void convoEval3D(lspCtx3D* ctx, double xw, double yw, double zw, airArray* mop);
+// evaluate 3D convolution between volume and kernel, "data" is the data of ctx->volume as its type T
+template<typename T>
+void convoEval3D(lspCtx3D* ctx, const T *data, double xw, double yw, double zw);
 
 class Resamp {
     public:
@@ -4,12 +4,16 @@
 //! \brief rewrite by Jiawei Jiang at 06-28-2018
 #include <tiff.h>
 #include <cstdint>
+#include <functional>
+#include <map>
 #include <string>
+#include <vector>
 
 #include <teem/nrrd.h>
 
 #include "skimczi_util.h"
 #include "CLI11.hpp"
+#include "iogovernor.h"
 
 #ifndef LSP_SKIMCZI_H
 #define LSP_SKIMCZI_H
@@ -145,6 +149,52 @@ typedef struct {
 #pragma pack(pop)
 
 
+// ========================== //
+// SUBBLOCK DIRECTORY SEGMENT //
+// ========================== //
+#pragma pack(push,1)
+typedef struct {
+    int32_t EntryCount;
+    unsigned char Reserved[124];
+} CziSubBlockDirectorySegmentHeader;
+#pragma pack(pop)
+
+
+// ============================ //
+// ATTACHMENT DIRECTORY SEGMENT //
+// ============================ //
+#pragma pack(push,1)
+typedef struct {
+    unsigned char SchemaType[2];  // "A1"
+    unsigned char Reserved[10];
+    int64_t FilePosition;         // File position of the ZISRAWATTACH segment
+    int32_t FilePart;
+    char ContentGuid[16];
+    char ContentFileType[8];      // e.g. "JPG", "CZI", "CZTIMS"
+    char Name[80];                // e.g. "Thumbnail", "Label", "SlidePreview", "TimeStamps"
+} CziAttachmentEntryA1;
+#pragma pack(pop)
+
+
+#pragma pack(push,1)
+typedef struct {
+    int32_t EntryCount;
+    unsigned char Reserved[252];
+} CziAttachmentDirectorySegmentHeader;
+#pragma pack(pop)
+
+
+// the attachment data follows these 256 bytes of the ZISRAWATTACH segment
+#pragma pack(push,1)
+typedef struct {
+    int64_t DataSize;
+    unsigned char Spare[8];
+    CziAttachmentEntryA1 Entry;
+    unsigned char Reserved[112];
+} CziAttachmentSegmentHeader;
+#pragma pack(pop)
+
+
 // Pixel data types - these need to correspond to the values in CZI p.23
 typedef enum {
     CZIPIXELTYPE_UNDEFINED         = -1,
@@ -169,7 +219,9 @@ typedef enum {
     CZICOMPRESSTYPE_RAW        = 0,  //--- Uncompressed
     CZICOMPRESSTYPE_JPGFILE    = 1,  //--- JPEG Compression
     CZICOMPRESSTYPE_LZW        = 2,  //--- Lemple-Ziff-Welch
-    CZICOMPRESSTYPE_JPEGXRFILE = 3   //--- Jpeg-XR aka HDP-file
+    CZICOMPRESSTYPE_JPEGXRFILE = 3,  //--- Jpeg-XR aka HDP-file
+    CZICOMPRESSTYPE_ZSTD0      = 5,  //--- zstd frame
+    CZICOMPRESSTYPE_ZSTD1      = 6   //--- zstd frame behind a small header, optionally hi-lo byte packed
 } CziCompmressionType;
 
 
@@ -187,6 +239,22 @@ typedef struct{
 } ImageDims;
 
 
+// One image subblock of the file, as listed in the SubBlockDirectory
+// (or found by scanning the segments when the directory is unusable)
+typedef struct {
+    CziDirectoryEntryDV entry;  // only the first DimensionCount dimension entries are valid
+    int c;                      // channel start index
+    int z;                      // z slice start index
+    int t;                      // timepoint start index
+    int m;                      // mosaic tile index
+    int x, y;                   // start of the tile in the pixels of the whole mosaic
+    int sizeX, sizeY;           // size of the tile in pixels
+    int storedSizeX, storedSizeY;   // size of the stored pixel data, smaller than sizeX/sizeY for pyramid subblocks
+    int tile;                   // index of the tile among the distinct (m, x, y) of the file
+    size_t dataBegin;           // file offset where the pixel data begins, in the file part entry.FilePart
+} CziSubBlockInfo;
+
+
 struct skimOptions {
     std::string czi_path;
     std::string nhdr_path;
@@ -199,9 +267,51 @@ struct skimOptions {
     std::string file;
     //std::string po;
     int verbose = 0;
+    // when set, the XY/XZ/YZ projections are computed during skim and saved here
+    std::string proj_path;
+    // slices read ahead of the projections by an I/O thread, 0 reads them from a memory mapping instead
+    int prefetch = 4;
+    // number of files skimmed at the same time in directory mode
+    int jobs = 1;
+    // suppress per-file chatter, set when files are skimmed in parallel
+    bool quiet = false;
+    // other parts of a CZI dataset split over several files, FilePart -> file name next to "file"
+    std::map<int, std::string> file_parts;
+    // when set, every timepoint is also copied into a contiguous raw volume in this directory,
+    // and its nhdr reads from there instead of from the CZI file
+    std::string repack_path;
+    // also write the pixel statistics of every timepoint into a sidecar next to its nhdr, see czistats.h
+    bool stats = false;
+    // number of box-downsampled levels (2x, 4x, 8x) written next to every nhdr, see czipyramid.h
+    int pyramid = 0;
+    // keep watching czi_path and skim every .czi file as soon as it is complete
+    bool watch = false;
+    // seconds without any change in czi_path after which watching stops, 0 watches forever
+    int watch_idle = 1800;
+    // seconds the size of a file has to stay the same before it is checked for completeness
+    int watch_settle = 10;
+    // when set, only low resolution projections and a frame of every timepoint are written to this
+    // directory, from the pyramid subblocks of the file when it has them, see czipreview.h
+    std::string preview_path;
+    // reads of .czi files in flight, adapted to the read bandwidth and optionally shared with other processes
+    ioOptions io;
+    // the pixel data of every timepoint is read under a slot of this governor, null for no limit
+    IoGovernor *governor = nullptr;
 };
 
 void setup_skim(CLI::App &app);
+// options to skim every file of files (sequence number and name in opt.czi_path, in ascending order) that is
+// not done yet: parts of split files go with their first file, and the timepoints of every file are numbered
+// past those of the files before it
+std::vector<skimOptions> skim_file_jobs(skimOptions const &opt, std::vector< std::pair<int, std::string> > files);
+// options to skim the single file opt.czi_path of sequence number sequenceNum, numbered and with its parts as in
+// directory mode; none when it is a part of a split file or is done already
+std::vector<skimOptions> skim_single_file_jobs(skimOptions const &opt, int sequenceNum);
+// skim every file in fileOpts on a pool of jobs workers, reporting results in input order
+void run_skim_jobs(std::vector<skimOptions> const &fileOpts, int jobs);
+// skim the .czi files of opt.czi_path as they are completed until it stays unchanged for opt.watch_idle
+// seconds; fileDone is called after every skimmed file so later stages can pick it up right away
+void run_skim_watch(skimOptions const &opt, std::function<void()> const &fileDone);
 
 // Helper function that checks if given string path is of a Directory
 bool checkIfDirectory(std::string filePath);
@@ -224,25 +334,58 @@ private:
     airArray* mop;
 
     void parse_file();
-    void generate_nhdr();
-    void generate_nrrd();
+    void find_subblocks();
+    void scan_subblocks(int fd, int part, std::vector<CziSubBlockInfo> &found);
+    void set_timepoint_names(size_t k, size_t numT);
+    void set_tile_names(std::string const &timepointNhdr, int tile);
+    void set_raw_file_name();
+    void process_slices(size_t first, size_t last);
+    void generate_nhdr(size_t first, size_t last);
+    void generate_nrrd(size_t first, size_t last);
     void generate_proj();
-    void update_projections();
+    void generate_preview(size_t first, size_t last);
+    void write_thumbnail();
+    template<typename T>
+    void update_projections(const T *current);
+    void project_slice(const unsigned char *slice);
+    struct ProjectSlice;
 
     std::string outputPath, cziFileName, projBaseFileName, nhdrFileName, xmlFileName;
+    // set when any subblock is compressed: the decoded slices go to rawFileName instead of a SKIPLIST
+    bool compressed;
+    // set for compressed files and with --repack, the nhdr then points to rawFileName
+    bool writeRaw;
+    std::string rawFileName;
 
     int cziFile, xmlFile;
     FILE *nhdrFile;
 
+    // every part of the dataset by FilePart, part 0 is cziFileName/cziFile; -1 for parts that are not there
+    std::vector<std::string> partFileNames;
+    std::vector<int> partFiles;
+
     SID *currentSID;
+    CziHeaderInfo *headerInfo;
+
+    // metadata XML block, written to the sidecar of every timepoint
+    char *xml;
+    size_t xmlSize;
+
+    // all image subblocks of all parts, sorted by (t, tile, z, c)
+    std::vector<CziSubBlockInfo> subBlocks;
+    // subblocks of the image pyramid ZEN stored next to them, sorted by t, see czipreview.h
+    std::vector<CziSubBlockInfo> pyramidBlocks;
+    // first subblock of every mosaic tile, see czidataset.h; a single one for files that are not mosaics
+    std::vector<CziSubBlockInfo> tiles;
+    // offset of the tile being written in the mosaic, in pixels
+    int tileX, tileY;
 
     Nrrd *nproj_xy, *nproj_xz, *nproj_yz;
 
     ImageDims *dims;    // Image metadata
     int curr_c,         // current channel
         curr_z;         // current z slice
-    float *current_f,   // current slice data
-          *proj_max_xy, *proj_max_xz, *proj_max_yz,     //max projections
+    float *proj_max_xy, *proj_max_xz, *proj_max_yz,     //max projections
           *proj_mean_xy, *proj_mean_xz, *proj_mean_yz;  // mean projections
 
 };
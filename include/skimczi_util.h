@@ -5,6 +5,7 @@
 #define LSP_SKIMCZI_UTIL_H
 
 #include <libxml/tree.h>
+#include <libxml/xmlreader.h>
 #include "skimczi.h"
 
 CziPixelType ConvertStringToPixelType(const char *wszValue);
@@ -12,4 +13,31 @@ CziPixelType ConvertStringToPixelType(const char *wszValue);
 //! \brief Read image info from CZI file.
 void get_image_dims(xmlNode *a_node, ImageDims *dims);
 
+//! \brief Read image info from the CZI metadata XML without building a DOM, with the same result as
+//! get_image_dims: the last occurrence of each field wins. Returns false if the XML could not be parsed.
+bool stream_image_dims(const char *xml, size_t size, ImageDims *dims);
+
+//! \brief Start index of dimension "dim" in a directory entry, 0 if the entry does not have it.
+int czi_dimension_start(const CziDirectoryEntryDV &entry, const char *dim);
+
+//! \brief Size of dimension "dim" in a directory entry, 0 if the entry does not have it.
+int czi_dimension_size(const CziDirectoryEntryDV &entry, const char *dim);
+
+//! \brief Stored size of dimension "dim" in a directory entry, 0 if the entry does not have it.
+int czi_dimension_stored_size(const CziDirectoryEntryDV &entry, const char *dim);
+
+//! \brief Whether the subblock belongs to an image pyramid ZEN stored next to the full resolution data,
+//! downsampled from the area it covers (PyramidType set, or stored smaller than that area).
+bool czi_subblock_is_pyramid(const CziSubBlockInfo &info);
+
+//! \brief File offset where the pixel data of the subblock described by "entry" begins.
+size_t czi_subblock_data_begin(const CziDirectoryEntryDV &entry);
+
+//! \brief Fill "info" (c, z, t, m, the tile position and size, and dataBegin) from its directory entry.
+void czi_subblock_info_set(CziSubBlockInfo &info);
+
+//! \brief Load the SubBlockDirectory segment at "position" of the opened CZI file with one read.
+//! Returns false (and leaves "subBlocks" empty) if the segment is missing or damaged.
+bool read_subblock_directory(int cziFile, uint64_t position, std::vector<CziSubBlockInfo> &subBlocks);
+
 #endif //LSP_SKIMCZI_UTIL_H
@@ -0,0 +1,60 @@
+//! \file sliceprefetch.h
+//! \brief Reads image slices ahead of their use on an I/O thread, through a small ring of buffers.
+
+#ifndef LSP_SLICEPREFETCH_H
+#define LSP_SLICEPREFETCH_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class SlicePrefetcher {
+public:
+    //! \brief Start reading the "sliceBytes" long slices at "offsets" of "fd", at most depth-1 slices ahead of the consumer.
+    SlicePrefetcher(int fd, std::vector<size_t> const &offsets, size_t sliceBytes, size_t depth);
+    //! \brief Same, slice k is read from fds[k], for data spread over several files.
+    SlicePrefetcher(std::vector<int> const &fds, std::vector<size_t> const &offsets, size_t sliceBytes, size_t depth);
+    //! \brief Stops the I/O thread, the file descriptors are left open.
+    ~SlicePrefetcher();
+
+    SlicePrefetcher(SlicePrefetcher const &) = delete;
+    SlicePrefetcher &operator=(SlicePrefetcher const &) = delete;
+
+    //! \brief Next slice in order, valid until the following call; nullptr after the last one. Throws LSPException on read errors.
+    const unsigned char *next();
+
+    //! \brief Seconds next() was blocked waiting for the I/O thread.
+    double io_wait_seconds() const { return waitSeconds; }
+    //! \brief Seconds the consumer spent between next() calls.
+    double compute_seconds() const { return computeSeconds; }
+    //! \brief Seconds the I/O thread spent reading.
+    double read_seconds() const;
+
+private:
+    void run();
+
+    std::vector<int> fds;
+    std::vector<size_t> offsets;
+    size_t sliceBytes;
+    std::vector<std::vector<unsigned char> > ring;
+
+    mutable std::mutex lock;
+    std::condition_variable filledCond, releasedCond;
+    size_t filled;      // slices read so far, guarded by lock
+    size_t released;    // slices the consumer is done with, guarded by lock
+    bool stop;
+    std::string error;
+    double readSeconds;
+
+    bool holding;       // the consumer has a slice it has not released yet
+    double waitSeconds, computeSeconds;
+    std::chrono::steady_clock::time_point lastReturn;
+
+    std::thread io;
+};
+
+#endif //LSP_SLICEPREFETCH_H
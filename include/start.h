@@ -34,6 +34,11 @@ struct startOptions {
     string maxFileNum;
     int verbose = 0;
 
+    // watch czi_path of a running acquisition, see skimOptions
+    bool watch = false;
+    int watch_idle = 1800;
+    int watch_settle = 10;
+
     // from skimOptions
     string nhdr_out_name;
     string xml_out_name;
@@ -0,0 +1,56 @@
+//! \file tproj.h
+//! \brief Projections through time: max, mean and variance over all the timepoints of the projection
+//! files lsp proj writes, and the intensity of every timepoint, in constant memory.
+
+#ifndef LSP_TPROJ_H
+#define LSP_TPROJ_H
+
+#include <teem/nrrd.h>
+#include "CLI11.hpp"
+#include "iogovernor.h"
+
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct tprojOptions {
+    // input NRRD projection files path, as written by lsp proj
+    std::string proj_path;
+    // where tprojXY.nrrd and tprojXY-curve.txt go
+    std::string out_path;
+    // which of the projection files, XY, XZ or YZ
+    std::string plane = "XY";
+    // which measure along the proj axis of the files is followed through time
+    std::string measure = "max";
+    // number of projection files loaded at the same time
+    int jobs = 4;
+    int verbose = 0;
+    // reads of projection files in flight, as for proj
+    ioOptions io;
+};
+
+void setup_tproj(CLI::App &app);
+
+class Tproj{
+public:
+	Tproj(tprojOptions const &opt = tprojOptions());
+	~Tproj();
+
+	void main();
+
+private:
+	void add_timepoint(int timepoint, Nrrd *nin);
+
+	tprojOptions const opt;
+	// timepoint numbers and names of the projection files, in time order
+	std::vector< std::pair<int, std::string> > files;
+	std::string out_name, curve_name;
+	std::ofstream curve;
+	// x-y-c-stat (or x-z-c, y-z-c) max, mean and running sum of squared differences turned into the variance
+	Nrrd *nout;
+	size_t sizeA, sizeB, sizeC, count;
+	airArray* mop;
+};
+
+#endif //LSP_TPROJ_H
@@ -43,8 +43,9 @@ typedef struct
     {
         void *vd;
         unsigned char *uc;
-        //unsigned short *us; we don't want unsigned short as data type, would be converted to signed short
+        unsigned short *us;
         short *s;
+        float *f;
         double *dl;
     } data;
 
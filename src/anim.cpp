@@ -14,6 +14,8 @@
 #include "anim.h"
 #include "util.h"
 #include "skimczi.h"
+#include "cziintegrity.h"
+#include "czistats.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/range/iterator_range.hpp>
@@ -43,6 +45,8 @@ void setup_anim(CLI::App &app)
     sub->add_option("-x, --scalex", opt->scale_x, "Scaling on the x axis. (Default: 1.0)");
     sub->add_option("-z, --scalez", opt->scale_z, "Scaling on the z axis. (Default: 1.0)");
     sub->add_option("-v, --verbose", opt->verbose, "Print processing message or not. (Default: 0(close))");
+    sub->add_flag("-s, --stats", opt->stats, "Take the quantization ranges of the max frames from the NNN.stats files of skim --stats "
+                                            "instead of computing them from every frame; frames without one are computed as before");
 
     sub->set_callback([opt]() 
     { 
@@ -121,6 +125,9 @@ void setup_anim(CLI::App &app)
                 cout << "ERROR: Not all valid files have been recorded" << endl;
             }
 
+            // timepoints skim found damaged are left out, see the integrity manifest
+            nhdrNum -= skip_damaged_timepoints(opt->nhdr_path, opt->allValidFiles);
+
             // if the user restricts the number of files to process
             if (!opt->maxFileNum.empty())
             {
@@ -522,21 +529,52 @@ void Anim::make_max_frame(std::string direction)
                     nrrdSlice(ch1, nin, 2, 1),
                     mop_t, "Error slicing nrrd:\n", "anim.cpp", "Anim::make_max_frame");
 
+        // with --stats the percentiles come from the histogram skim kept of the same max projection,
+        // before the frame was cropped and down-sampled
+        CziStats stats;
+        CziStatsHistogram kind = direction == "z" ? CZISTATS_MAX_XY : CZISTATS_MAX_YZ;
+        bool haveStats = opt.stats
+            && czi_stats_load(czi_stats_file_name(opt.nhdr_path + opt.allValidFiles[i].second + ".nhdr"), stats);
+
         //quantize to 8bit
         auto range0 = nrrdRangeNew(AIR_NAN, AIR_NAN);
         airMopAdd(mop_t, range0, (airMopper)nrrdRangeNix, airMopAlways);
-        nrrd_checker(nrrdRangePercentileFromStringSet(range0, ch0,  "5%", "0.02%", 5000, true) ||
-                    nrrdQuantize(bit0, ch0, range0, 8),
+        if (!haveStats || !stats.range(0, kind, "5%", "0.02%", range0->min, range0->max))
+            nrrd_checker(nrrdRangePercentileFromStringSet(range0, ch0,  "5%", "0.02%", 5000, true),
+                        mop_t, "Error quantizing ch1 nrrd:\n", "anim.cpp", "Anim::make_max_frame");
+        nrrd_checker(nrrdQuantize(bit0, ch0, range0, 8),
                     mop_t, "Error quantizing ch1 nrrd:\n", "anim.cpp", "Anim::make_max_frame");
 
         //set brightness for ch1(and quantize to 8bit)
         auto range1 = nrrdRangeNew(AIR_NAN, AIR_NAN);
         airMopAdd(mop_t, range1, (airMopper)nrrdRangeNix, airMopAlways);
-        nrrd_checker(nrrdArithGamma(ch1, ch1, NULL, 10) ||
-                        nrrdRangePercentileFromStringSet(range1, ch1, "5%", "0.01%", 5000, true) ||
-                        nrrdQuantize(bit1, ch1, range1, 8),
+        // the gamma is monotonic, so the percentiles of ch1 are mapped the same way as its values
+        auto gammaRange = nrrdRangeNewSet(ch1, nrrdBlind8BitRangeState);
+        airMopAdd(mop_t, gammaRange, (airMopper)nrrdRangeNix, airMopAlways);
+        double gammaMin = gammaRange->min, gammaMax = gammaRange->max;
+        auto gamma = [gammaMin, gammaMax](double v)
+        {
+            double u = AIR_AFFINE(gammaMin, v, gammaMax, 0.0, 1.0);
+            u = u > 0 ? pow(u, 1.0/10) : -pow(-u, 1.0/10);
+            return AIR_AFFINE(0.0, u, 1.0, gammaMin, gammaMax);
+        };
+        nrrd_checker(nrrdArithGamma(ch1, ch1, gammaRange, 10),
+                    mop_t, "Error quantizing ch2 nrrd:\n", "anim.cpp", "Anim::make_max_frame");
+        if (haveStats && stats.range(1, kind, "5%", "0.01%", range1->min, range1->max))
+        {
+            range1->min = gamma(range1->min);
+            range1->max = gamma(range1->max);
+        }
+        else
+            nrrd_checker(nrrdRangePercentileFromStringSet(range1, ch1, "5%", "0.01%", 5000, true),
+                        mop_t, "Error quantizing ch2 nrrd:\n", "anim.cpp", "Anim::make_max_frame");
+        nrrd_checker(nrrdQuantize(bit1, ch1, range1, 8),
                     mop_t, "Error quantizing ch2 nrrd:\n", "anim.cpp", "Anim::make_max_frame");
 
+        if (opt.verbose && haveStats)
+            cout << "Ranges from " << opt.allValidFiles[i].second << ".stats: [" << range0->min << ", " << range0->max
+                 << "], [" << range1->min << ", " << range1->max << "]" << endl;
+
         std::cout << "===================== " + opt.allValidFiles[i].second + "/" + std::to_string(opt.tmax-1) + " " + direction + "_max_frames =====================\n";
 
         nrrd_checker(nrrdSave((common_prefix + "-0.ppm").c_str() , bit0, nullptr) ||
@@ -769,6 +807,9 @@ void Anim::main()
     cout << endl << "Building PNGs for both max and average channels" << endl;
     build_png();
 
+    if (opt.skip_video)
+        return;
+
     cout << endl << "Building video for both max and average channels" << endl;
     build_video();
 }
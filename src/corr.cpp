@@ -12,6 +12,7 @@
 #include "corr.h"
 #include "util.h"
 #include "skimczi.h"
+#include "pixeltraits.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/range/iterator_range.hpp>
@@ -36,7 +37,8 @@ struct myclass {
 using namespace std;
 namespace fs = boost::filesystem;
 
-static double crossCorr(const unsigned short *aa, const unsigned short *bb,
+template<typename T>
+static double crossCorr(const T *aa, const T *bb,
                         const unsigned int sza[2], const unsigned int szb[2],
                         const int off[2]) 
 {
@@ -90,7 +92,7 @@ static double crossCorr(const unsigned short *aa, const unsigned short *bb,
     {
         for (xi=lo0; xi<=hi0; xi++) 
         {
-            float a, b;
+            double a, b;
             b = bb[xi + szb0*yi];
             a = aa[(xi+off0) + sza0*(yi+off1)];
             dot += a*b;
@@ -102,6 +104,57 @@ static double crossCorr(const unsigned short *aa, const unsigned short *bb,
     return dot/(sqrt(lena)*sqrt(lenb));
 }
 
+/* the scan over all offsets, instantiated once per pixel type */
+template<typename T>
+static void crossCorrScan(double *cci, int maxIdx[2], const T *aa, const T *bb,
+                          const unsigned int sza[2], const unsigned int szb[2],
+                          int bound, int verbose)
+{
+    char done[13];
+    unsigned int szc = 2*bound + 1;
+    double maxcc = AIR_NEG_INF, cc;
+    int ox, oy;
+
+    for (oy=-bound; oy<=bound; oy++) 
+    {
+        int off[2];
+        if (verbose) 
+        {
+            fprintf(stderr, "%s", airDoneStr(-bound, oy, bound, done)); fflush(stdout);
+        }
+        
+        off[1] = oy;
+        for (ox=-bound; ox<=bound; ox++) 
+        {
+            off[0] = ox;
+            cc = cci[ox+bound + szc*(oy+bound)] = crossCorr(aa, bb, sza, szb, off);
+            /* remember where the max is */
+            if (cc > maxcc) 
+            {
+                maxIdx[0] = ox;
+                maxIdx[1] = oy;
+                maxcc = cc;
+            }
+        }
+    }
+    if (verbose) 
+    {
+        fprintf(stderr, "%s\n", airDoneStr(-bound, oy, bound, done)); fflush(stdout);
+    }
+}
+
+struct CrossCorrScan {
+    double *cci;
+    int *maxIdx;
+    const void *aa, *bb;
+    const unsigned int *sza, *szb;
+    int bound, verbose;
+    template<typename T> void operator()(PixelTag<T>) const
+    {
+        crossCorrScan(cci, maxIdx, (const T*)aa, (const T*)bb, sza, szb, bound, verbose);
+    }
+};
+
 static int crossCorrImg(Nrrd *nout, int maxIdx[2], Nrrd *nin[2],
                         int bound, int verbose,
                         airArray *mop /* passing the mop just for convenience; more
@@ -110,17 +163,16 @@ static int crossCorrImg(Nrrd *nout, int maxIdx[2], Nrrd *nin[2],
                                         more confusing */) 
 {
     static const char me[] = "crossCorrImg";
-    char *err, done[13];
+    char *err;
     unsigned int sza[2], szb[2], ii, szc;
-    unsigned short *aa, *bb;
-    double *cci, maxcc, cc;
-    int ox, oy;
+    double *cci;
 
     for (ii=0; ii<2; ii++) 
     {
-        if (!( 2 == nin[ii]->dim && nrrdTypeUShort == nin[ii]->type )) 
+        if (!( 2 == nin[ii]->dim && pixel_czi_type(nin[ii]->type) != CZIPIXELTYPE_UNDEFINED
+               && nin[0]->type == nin[ii]->type )) 
         {
-            fprintf(stderr, "%s: input %s isn't 2D ushort array "
+            fprintf(stderr, "%s: input %s isn't 2D uchar, ushort or float array of the type of A "
                             "(instead got %u-D %s array)\n", me, !ii ? "A" : "B",
                     nin[ii]->dim, airEnumStr(nrrdType, nin[ii]->type));
             return 1;
@@ -130,8 +182,6 @@ static int crossCorrImg(Nrrd *nout, int maxIdx[2], Nrrd *nin[2],
     sza[1] = nin[0]->axis[1].size;
     szb[0] = nin[1]->axis[0].size;
     szb[1] = nin[1]->axis[1].size;
-    aa = AIR_CAST(unsigned short *, nin[0]->data);
-    bb = AIR_CAST(unsigned short *, nin[1]->data);
 
     szc = 2*bound + 1;
     if (nrrdAlloc_va(nout, nrrdTypeDouble, 2,
@@ -145,38 +195,12 @@ static int crossCorrImg(Nrrd *nout, int maxIdx[2], Nrrd *nin[2],
 
     cci = AIR_CAST(double *, nout->data);
 
-    maxcc = AIR_NEG_INF;
     if (verbose) 
     {
         fprintf(stderr, "%s: computing ...       ", me); fflush(stdout);
     }
-    
-    for (oy=-bound; oy<=bound; oy++) 
-    {
-        int off[2];
-        if (verbose) 
-        {
-            fprintf(stderr, "%s", airDoneStr(-bound, oy, bound, done)); fflush(stdout);
-        }
-        
-        off[1] = oy;
-        for (ox=-bound; ox<=bound; ox++) 
-        {
-            off[0] = ox;
-            cc = cci[ox+bound + szc*(oy+bound)] = crossCorr(aa, bb, sza, szb, off);
-            /* remember where the max is */
-            if (cc > maxcc) 
-            {
-                maxIdx[0] = ox;
-                maxIdx[1] = oy;
-                maxcc = cc;
-            }
-        }
-    }
-    if (verbose) 
-    {
-        fprintf(stderr, "%s\n", airDoneStr(-bound, oy, bound, done)); fflush(stdout);
-    }
+    pixel_dispatch_czi(pixel_czi_type(nin[0]->type),
+                       CrossCorrScan{cci, maxIdx, nin[0]->data, nin[1]->data, sza, szb, bound, verbose});
 
     return 0;
 }
@@ -285,6 +285,15 @@ void setup_corrfind(CLI::App &app)
 }
 
 
+vector< pair<string, int> > corrfind_jobs(vector< pair<int, string> > const &images)
+{
+    vector< pair<string, int> > jobs;
+    for (size_t i = 0; i < images.size(); i++)
+        jobs.push_back(make_pair(GenerateOutName(images[i].first, 3, ".txt"), (int)i - 1));
+    return jobs;
+}
+
+
 Corrfind::Corrfind(corrfindOptions const &opt): opt(opt), mop(airMopNew()) {}
 
 
@@ -303,12 +312,18 @@ void Corrfind::main()
         cout << "Output path " << opt.align_path << " does not exits, but has been created" << endl;
     }
 
+    // the alignment files are named after the timepoints, so later stages pair them with the right nhdr
+    vector< pair<string, int> > jobs = corrfind_jobs(opt.inputImages[0]);
+
     // Process the images by pair can call corrfind
     for (int i = 0; i < opt.inputImages[0].size(); i++)
     {
+        int sequenceNum = opt.inputImages[0][i].first;
+        int previous = jobs[i].second;
+
         // generate opt for corr
         corrOptions opt_corr;
-        opt_corr.output_file = opt.align_path + GenerateOutName(i, 3, ".txt");
+        opt_corr.output_file = opt.align_path + jobs[i].first;
         opt_corr.verbose = opt.verbose;
         opt_corr.kernel = opt.kernel;
         opt_corr.max_offset = opt.bound;
@@ -323,13 +338,21 @@ void Corrfind::main()
 
         // each time stamp only has one output txt file
         ofstream outfile(opt_corr.output_file);
-        // when i == 0, there is no i-1 for correlation
-        if (i == 0)
+        // the first timepoint has none before it for correlation, it is the reference
+        if (previous < 0)
         {
-            outfile << std::vector<double>{0, 0, 0, 0} << std::endl;
+            if (sequenceNum != 0)
+                cout << "WARNING: there are no projections before timepoint " << sequenceNum << ", it becomes the reference" << endl;
+            outfile << std::vector<double>{0, 0, 0, AIR_CAST(double, sequenceNum)} << std::endl;
         }
         else
         {
+            // the shift of a timepoint after a gap is the one from the last timepoint before the gap
+            int previousNum = opt.inputImages[0][previous].first;
+            if (previousNum != sequenceNum - 1)
+                cout << "WARNING: no projections of timepoints " << previousNum + 1 << " to " << sequenceNum - 1
+                     << ", the shift of timepoint " << sequenceNum << " is found against timepoint " << previousNum << endl;
+
             // all the correlation results of current time stamp
             vector< vector<double> > allShifts;
 
@@ -339,7 +362,7 @@ void Corrfind::main()
             for (int j = 0; j < opt.inputImages.size(); j++)
             {
                 vector<string> curInputImages;
-                curInputImages.push_back(opt.image_path + opt.inputImages[j][i-1].second + ".png");
+                curInputImages.push_back(opt.image_path + opt.inputImages[j][previous].second + ".png");
                 curInputImages.push_back(opt.image_path + opt.inputImages[j][i].second + ".png");
                 opt_corr.input_images = curInputImages;
 
@@ -372,7 +395,7 @@ void Corrfind::main()
             cout << "yy = " << yy << endl;
             cout << "zz = " << zz << endl;
 
-            outfile << std::vector<double>{xx, yy, zz, AIR_CAST(double, i)} << std::endl;
+            outfile << std::vector<double>{xx, yy, zz, AIR_CAST(double, sequenceNum)} << std::endl;
             //outfile << std::vector<double>{xx, yy, zz, (double)(i)} << std::endl;
         }
 
@@ -48,9 +48,9 @@ void setup_corrimg(CLI::App &app)
             for (int i = 0; i < files.size(); i++) 
             {
                 string curFile = files[i];
-                // check if input file is a .nrrd file
+                // check if input file is a .nrrd projection file, proj --slab stacks live next to them
                 int proj_suff = curFile.rfind(".nrrd");
-                if ( (proj_suff != string::npos) && (proj_suff == curFile.length() - 5))
+                if ( (proj_suff != string::npos) && (proj_suff == curFile.length() - 5) && curFile.rfind("-proj") != string::npos)
                 {
                     if (opt->verbose)
                         cout << "Current input file " + curFile + " ends with .nrrd, count this file" << endl;
@@ -444,12 +444,8 @@ void Corrnhdr::main()
             std::string line;
             while(getline(ifile, line))
             {
-                if(line.find("type:") != std::string::npos)
-                {
-                    // type should be the same, changed from signed short to ushort
-                    ofile << "type: ushort" << std::endl;
-                }
-                else if(line.find("space origin:") != std::string::npos)
+                // the type is left as it is, resamp keeps the type of its input
+                if(line.find("space origin:") != std::string::npos)
                 {
                     ofile << origin << std::endl;
                 }
@@ -0,0 +1,214 @@
+//! \file czidataset.cpp
+//! \brief CZI datasets that are split over several files, and the mosaic tiles inside them.
+
+#include "czidataset.h"
+#include "cziwatch.h"
+#include "skimczi_util.h"
+#include "util.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <tuple>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+bool czi_read_file_header(string const &path, CziHeaderInfo &header)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    SID sid;
+    bool ok = pread(fd, &sid, sizeof(sid), 0) == sizeof(sid)
+        && strncmp(sid.id, "ZISRAWFILE", sizeof(sid.id)) == 0
+        && pread(fd, &header, sizeof(header), sizeof(sid)) == sizeof(header);
+    close(fd);
+    return ok;
+}
+
+map<string, map<int, string> > czi_group_file_parts(string const &dir, vector< pair<int, string> > &files)
+{
+    // one header read per file, on a network share the latency is what counts
+    vector<CziHeaderInfo> headers(files.size());
+    vector<char> ok(files.size(), 0);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (long i = 0; i < (long)files.size(); i++)
+        ok[i] = czi_read_file_header((fs::path(dir) / files[i].second).string(), headers[i]);
+
+    map<string, string> masters;    // FileGuid -> name
+    for (size_t i = 0; i < files.size(); i++)
+        if (ok[i] && headers[i].FilePart == 0)
+            masters[string(headers[i].FileGuid, sizeof(headers[i].FileGuid))] = files[i].second;
+
+    map<string, map<int, string> > parts;
+    size_t kept = 0;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if (!ok[i] || headers[i].FilePart == 0)
+        {
+            files[kept++] = files[i];
+            continue;
+        }
+
+        auto master = masters.find(string(headers[i].PrimaryFileGuid, sizeof(headers[i].PrimaryFileGuid)));
+        if (master == masters.end())
+            cout << "WARNING: " << files[i].second << " is part " << headers[i].FilePart
+                 << " of a CZI dataset whose first file is not in " << dir << ", skipping it" << endl;
+        else
+            parts[master->second][(int)headers[i].FilePart] = files[i].second;
+    }
+    files.resize(kept);
+
+    return parts;
+}
+
+map<int, string> czi_find_file_parts(string const &dir, string const &master)
+{
+    vector< pair<int, string> > files;
+    for (string const &name : GetDirectoryFiles(dir))
+    {
+        int sequenceNum;
+        if (czi_file_sequence_number(name, sequenceNum))
+            files.push_back(make_pair(sequenceNum, name));
+    }
+
+    map<string, map<int, string> > parts = czi_group_file_parts(dir, files);
+    auto it = parts.find(master);
+    return it == parts.end() ? map<int, string>() : it->second;
+}
+
+bool czi_is_file_part(string const &path)
+{
+    CziHeaderInfo header;
+    return czi_read_file_header(path, header) && header.FilePart > 0;
+}
+
+void czi_directory_extent(string const &path, int &numT, int &numParts)
+{
+    numT = numParts = 1;
+    CziHeaderInfo header;
+    if (!czi_read_file_header(path, header))
+        return;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+
+    // the same directory skim splits the file by, so both agree on the count
+    vector<CziSubBlockInfo> subBlocks;
+    set<int> t;
+    if (read_subblock_directory(fd, header.DirectoryPosition, subBlocks))
+        for (CziSubBlockInfo const &subBlock : subBlocks)
+        {
+            t.insert(subBlock.t);
+            numParts = max(numParts, (int)subBlock.entry.FilePart + 1);
+        }
+    close(fd);
+    numT = max(1, (int)t.size());
+}
+
+int czi_timepoint_count(string const &path)
+{
+    int numT, numParts;
+    czi_directory_extent(path, numT, numParts);
+    return numT;
+}
+
+vector<int> czi_first_timepoints(string const &dir, vector< pair<int, string> > const &files, vector<int> &counts)
+{
+    counts.assign(files.size(), 1);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (long i = 0; i < (long)files.size(); i++)
+        counts[i] = czi_timepoint_count((fs::path(dir) / files[i].second).string());
+
+    // files of one timepoint each keep their sequence numbers
+    vector<int> first(files.size());
+    int extra = 0;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        first[i] = files[i].first + extra;
+        extra += counts[i] - 1;
+    }
+    return first;
+}
+
+string czi_tiles_dir(string const &nhdrFileName)
+{
+    return fs::path(nhdrFileName).replace_extension("").string() + "-tiles/";
+}
+
+string czi_tiles_layout_file_name(string const &nhdrFileName)
+{
+    return czi_tiles_dir(nhdrFileName) + "layout.txt";
+}
+
+vector<CziSubBlockInfo> czi_index_tiles(vector<CziSubBlockInfo> &subBlocks)
+{
+    typedef tuple<int, int, int> TileKey;
+    map<TileKey, int> index;
+    for (CziSubBlockInfo const &subBlock : subBlocks)
+        index[TileKey(subBlock.m, subBlock.x, subBlock.y)] = 0;
+
+    int next = 0;
+    for (auto &tile : index)
+        tile.second = next++;
+
+    int minX = INT_MAX, minY = INT_MAX;
+    for (CziSubBlockInfo const &subBlock : subBlocks)
+    {
+        minX = min(minX, subBlock.x);
+        minY = min(minY, subBlock.y);
+    }
+
+    vector<CziSubBlockInfo> tiles(index.size());
+    vector<bool> seen(index.size(), false);
+    for (CziSubBlockInfo &subBlock : subBlocks)
+    {
+        subBlock.tile = index[TileKey(subBlock.m, subBlock.x, subBlock.y)];
+        subBlock.x -= minX;
+        subBlock.y -= minY;
+        if (!seen[subBlock.tile])
+        {
+            tiles[subBlock.tile] = subBlock;
+            seen[subBlock.tile] = true;
+        }
+    }
+
+    return tiles;
+}
+
+void czi_write_tiles_layout(string const &fileName, vector<CziSubBlockInfo> const &tiles,
+                            vector<string> const &tileNhdrs)
+{
+    int sizeX = 0, sizeY = 0;
+    for (CziSubBlockInfo const &tile : tiles)
+    {
+        sizeX = max(sizeX, tile.x + tile.sizeX);
+        sizeY = max(sizeY, tile.y + tile.sizeY);
+    }
+
+    FILE *file = fopen(fileName.c_str(), "w");
+    if (!file)
+        throw LSPException("Could not open " + fileName + " for writing\n", "czidataset.cpp", "czi_write_tiles_layout");
+
+    fprintf(file, "# tiles of %s, offsets in pixels of the stitched mosaic\n",
+            fs::path(fileName).parent_path().filename().string().c_str());
+    fprintf(file, "# nhdr x y sizeX sizeY m\n");
+    fprintf(file, "mosaic: %d %d\n", sizeX, sizeY);
+    fprintf(file, "tiles: %zu\n", tiles.size());
+    for (size_t i = 0; i < tiles.size() && i < tileNhdrs.size(); i++)
+        fprintf(file, "%s %d %d %d %d %d\n", tileNhdrs[i].c_str(),
+                tiles[i].x, tiles[i].y, tiles[i].sizeX, tiles[i].sizeY, tiles[i].m);
+
+    if (fclose(file) != 0)
+        throw LSPException("Could not write " + fileName + "\n", "czidataset.cpp", "czi_write_tiles_layout");
+}
@@ -0,0 +1,259 @@
+//! \file czidecode.cpp
+//! \brief Decoding of compressed CZI image subblocks (LZW, zstd) into raw slices.
+
+#include "czidecode.h"
+#include "util.h"
+
+#include <cstring>
+#include <string>
+
+#ifdef LSP_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace std;
+
+// TIFF-style LZW: MSB-first codes of 9 to 12 bits, 256 = clear, 257 = end of information,
+// and the code width grows one code early
+static void decode_lzw(const unsigned char *src, size_t srcSize, unsigned char *dst, size_t dstSize)
+{
+    const int clearCode = 256, eoiCode = 257, firstCode = 258, maxCodes = 4096;
+    // every table entry is an earlier entry plus one byte
+    vector<int> prefix(maxCodes), length(maxCodes);
+    vector<unsigned char> suffix(maxCodes), first(maxCodes);
+    for (int i = 0; i < 256; i++)
+    {
+        prefix[i] = -1;
+        length[i] = 1;
+        suffix[i] = first[i] = (unsigned char)i;
+    }
+
+    size_t out = 0;
+    uint64_t bits = 0;
+    int bitCount = 0;
+    size_t in = 0;
+    int width = 9, nextCode = firstCode, old = -1;
+
+    while (true)
+    {
+        while (bitCount < width && in < srcSize)
+        {
+            bits = (bits << 8) | src[in++];
+            bitCount += 8;
+        }
+        if (bitCount < width)
+            break;
+        int code = (int)((bits >> (bitCount - width)) & ((1u << width) - 1));
+        bitCount -= width;
+
+        if (code == eoiCode)
+            break;
+        if (code == clearCode)
+        {
+            width = 9;
+            nextCode = firstCode;
+            old = -1;
+            continue;
+        }
+
+        int entry;
+        if (code < nextCode && (code < 256 || code >= firstCode))
+            entry = code;
+        else if (code == nextCode && old >= 0)
+            entry = old;    // the KwKwK case, the string of "old" plus its own first byte
+        else
+            throw LSPException("Corrupt LZW data, code " + to_string(code) + " is not in the table\n",
+                               "czidecode.cpp", "decode_lzw");
+
+        size_t len = length[entry] + (entry == code ? 0 : 1);
+        if (out + len > dstSize)
+            throw LSPException("LZW data decodes to more than the slice size\n",
+                               "czidecode.cpp", "decode_lzw");
+
+        // write the string back to front by walking the prefixes
+        size_t end = out + length[entry];
+        for (int e = entry; e >= 0; e = prefix[e])
+            dst[--end] = suffix[e];
+        if (entry != code)
+            dst[out + length[entry]] = first[entry];
+
+        if (old >= 0 && nextCode < maxCodes)
+        {
+            prefix[nextCode] = old;
+            suffix[nextCode] = first[entry];
+            first[nextCode] = first[old];
+            length[nextCode] = length[old] + 1;
+            nextCode++;
+            if (nextCode >= (1 << width) - 1 && width < 12)
+                width++;
+        }
+        out += len;
+        old = code;
+    }
+
+    if (out != dstSize)
+        throw LSPException("LZW data decodes to " + to_string(out) + " bytes, expected " + to_string(dstSize) + "\n",
+                           "czidecode.cpp", "decode_lzw");
+}
+
+#ifdef LSP_HAVE_ZSTD
+static void decode_zstd_frame(const unsigned char *src, size_t srcSize, unsigned char *dst, size_t dstSize)
+{
+    size_t size = ZSTD_decompress(dst, dstSize, src, srcSize);
+    if (ZSTD_isError(size))
+        throw LSPException(string("zstd decoding failed: ") + ZSTD_getErrorName(size) + "\n",
+                           "czidecode.cpp", "decode_zstd_frame");
+    if (size != dstSize)
+        throw LSPException("zstd data decodes to " + to_string(size) + " bytes, expected " + to_string(dstSize) + "\n",
+                           "czidecode.cpp", "decode_zstd_frame");
+}
+
+// zstd1 puts a small header in front of the frame; its only chunk says whether 16-bit pixels
+// were split into all low bytes followed by all high bytes before compressing
+static void decode_zstd1(const unsigned char *src, size_t srcSize, unsigned char *dst, size_t dstSize, size_t pixelSize)
+{
+    if (srcSize < 1 || src[0] < 1 || src[0] > srcSize)
+        throw LSPException("Corrupt zstd1 header\n", "czidecode.cpp", "decode_zstd1");
+
+    size_t headerSize = src[0];
+    bool hiLoPacked = false;
+    if (headerSize == 3 && src[1] == 1)
+        hiLoPacked = (src[2] & 1) != 0;
+    else if (headerSize != 1)
+        throw LSPException("Unknown zstd1 header of " + to_string(headerSize) + " bytes\n",
+                           "czidecode.cpp", "decode_zstd1");
+
+    if (!hiLoPacked)
+    {
+        decode_zstd_frame(src + headerSize, srcSize - headerSize, dst, dstSize);
+        return;
+    }
+
+    if (pixelSize != 2 || dstSize % 2)
+        throw LSPException("zstd1 hi-lo byte packing is only defined for 16-bit pixels\n",
+                           "czidecode.cpp", "decode_zstd1");
+    vector<unsigned char> packed(dstSize);
+    decode_zstd_frame(src + headerSize, srcSize - headerSize, packed.data(), dstSize);
+    size_t half = dstSize / 2;
+    for (size_t i = 0; i < half; i++)
+    {
+        dst[2*i] = packed[i];
+        dst[2*i + 1] = packed[half + i];
+    }
+}
+#endif
+
+bool czi_compression_supported(int compression)
+{
+    switch (compression)
+    {
+        case CZICOMPRESSTYPE_RAW:
+        case CZICOMPRESSTYPE_LZW:
+            return true;
+#ifdef LSP_HAVE_ZSTD
+        case CZICOMPRESSTYPE_ZSTD0:
+        case CZICOMPRESSTYPE_ZSTD1:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+void czi_decode_subblock(int compression, const unsigned char *src, size_t srcSize,
+                         unsigned char *dst, size_t dstSize, size_t pixelSize)
+{
+    switch (compression)
+    {
+        case CZICOMPRESSTYPE_RAW:
+            if (srcSize < dstSize)
+                throw LSPException("Raw subblock is smaller than a slice\n",
+                                   "czidecode.cpp", "czi_decode_subblock");
+            memcpy(dst, src, dstSize);
+            return;
+        case CZICOMPRESSTYPE_LZW:
+            decode_lzw(src, srcSize, dst, dstSize);
+            return;
+#ifdef LSP_HAVE_ZSTD
+        case CZICOMPRESSTYPE_ZSTD0:
+            decode_zstd_frame(src, srcSize, dst, dstSize);
+            return;
+        case CZICOMPRESSTYPE_ZSTD1:
+            decode_zstd1(src, srcSize, dst, dstSize, pixelSize);
+            return;
+#else
+        case CZICOMPRESSTYPE_ZSTD0:
+        case CZICOMPRESSTYPE_ZSTD1:
+            throw LSPException("lsp was built without zstd, cannot decode zstd compressed subblocks\n",
+                               "czidecode.cpp", "czi_decode_subblock");
+#endif
+        default:
+            throw LSPException("Unsupported subblock compression type " + to_string(compression) + "\n",
+                               "czidecode.cpp", "czi_decode_subblock");
+    }
+}
+
+CziSliceCache::CziSliceCache(vector<const CziMappedFile*> const &files, vector<CziSubBlockInfo> const &subBlocks,
+                             size_t sliceBytes, size_t pixelSize, size_t capacity)
+: files(files), subBlocks(subBlocks), sliceBytes(sliceBytes), pixelSize(pixelSize),
+  cap(capacity), first(0), count(0), bytesRead(0), buffer(capacity * sliceBytes)
+{
+}
+
+void CziSliceCache::decode(size_t first, size_t count)
+{
+    if (count > cap || first + count > subBlocks.size())
+        throw LSPException("Slice batch does not fit the cache\n", "czidecode.cpp", "CziSliceCache::decode");
+
+    this->first = first;
+    this->count = count;
+
+    // exceptions cannot leave an OpenMP region, so the first error is kept and thrown afterwards
+    string error;
+    size_t batchBytes = 0;
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:batchBytes)
+    for (long i = 0; i < (long)count; i++)
+    {
+        try
+        {
+            const CziSubBlockInfo &subBlock = subBlocks[first + i];
+            int part = subBlock.entry.FilePart;
+            if (part < 0 || part >= (int)files.size() || !files[part])
+                throw LSPException("File part " + to_string(part) + " is missing\n",
+                                   "czidecode.cpp", "CziSliceCache::decode");
+            CziMappedFile const &file = *files[part];
+
+            // DataSize is only in the subblock segment itself, not in its directory entry
+            const CziSubBlockSegment_HeaderOnly *header =
+                file.view<CziSubBlockSegment_HeaderOnly>(subBlock.entry.FilePosition + sizeof(SID), 1);
+            const unsigned char *src = header ? file.view<unsigned char>(subBlock.dataBegin, header->DataSize) : nullptr;
+            if (!src)
+                throw LSPException("Subblock data runs past the end of the file\n",
+                                   "czidecode.cpp", "CziSliceCache::decode");
+
+            czi_decode_subblock(subBlock.entry.Compression, src, header->DataSize,
+                                buffer.data() + i*sliceBytes, sliceBytes, pixelSize);
+            batchBytes += header->DataSize;
+        }
+        // LSPException included, but also std::bad_alloc from a large decode buffer and the like, which
+        // would otherwise terminate the whole process
+        catch (std::exception &e)
+        {
+            #pragma omp critical(czi_slice_cache_error)
+            if (error.empty())
+                error = "subblock " + to_string(first + i) + ": " + e.what();
+        }
+    }
+
+    bytesRead += batchBytes;
+    if (!error.empty())
+        throw LSPException(error, "czidecode.cpp", "CziSliceCache::decode");
+}
+
+const unsigned char *CziSliceCache::slice(size_t i) const
+{
+    if (i < first || i >= first + count)
+        throw LSPException("Slice " + to_string(i) + " is not in the decoded batch\n",
+                           "czidecode.cpp", "CziSliceCache::slice");
+    return buffer.data() + (i - first)*sliceBytes;
+}
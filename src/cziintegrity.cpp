@@ -0,0 +1,177 @@
+//! \file cziintegrity.cpp
+//! \brief Subblock coverage of every skimmed timepoint, kept in a manifest next to the nhdr files.
+
+#include "cziintegrity.h"
+#include "util.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char *manifestName = "integrity.txt";
+
+const char *TimepointIntegrity::status() const
+{
+    if (!missing.empty())
+        return "incomplete";
+    if (!truncated.empty())
+        return "truncated";
+    return "complete";
+}
+
+TimepointIntegrity czi_check_integrity(vector<int> const &partFiles, vector<CziSubBlockInfo> const &subBlocks,
+                                       size_t first, size_t last, ImageDims const &dims)
+{
+    TimepointIntegrity result;
+    result.slices = (size_t)dims.sizeC * dims.sizeZ;
+
+    vector<uint64_t> fileSizes(partFiles.size(), 0);
+    for (size_t p = 0; p < partFiles.size(); p++)
+    {
+        struct stat st;
+        if (partFiles[p] < 0)
+            continue;
+        if (fstat(partFiles[p], &st) != 0)
+            throw LSPException("Could not get the size of the CZI file\n", "cziintegrity.cpp", "czi_check_integrity");
+        fileSizes[p] = (uint64_t)st.st_size;
+    }
+    size_t sliceBytes = (size_t)dims.sizeX * dims.sizeY * dims.pixelSize;
+
+    // 0 for slices without a subblock, 1 for complete ones and 2 for truncated ones
+    vector<unsigned char> state(result.slices, 0);
+    for (size_t i = first; i < last; i++)
+    {
+        const CziSubBlockInfo &subBlock = subBlocks[i];
+        if (subBlock.c < 0 || subBlock.c >= dims.sizeC || subBlock.z < 0 || subBlock.z >= dims.sizeZ)
+            continue;
+        int part = subBlock.entry.FilePart;
+        if (part < 0 || part >= (int)partFiles.size() || partFiles[part] < 0)
+            continue;
+        int cziFile = partFiles[part];
+        uint64_t fileSize = fileSizes[part];
+
+        // the segment has to be all there, and so does its pixel data
+        struct {
+            SID sid;
+            CziSubBlockSegment_HeaderOnly header;
+        } segment;
+        uint64_t position = subBlock.entry.FilePosition;
+        bool intact = pread(cziFile, &segment, sizeof(segment), position) == sizeof(segment)
+            && strncmp(segment.sid.id, "ZISRAWSUBBLOCK", sizeof(segment.sid.id)) == 0
+            && position + sizeof(SID) + segment.sid.usedSize <= fileSize;
+        if (intact)
+        {
+            uint64_t dataSize = subBlock.entry.Compression == CZICOMPRESSTYPE_RAW ? sliceBytes : segment.header.DataSize;
+            intact = subBlock.dataBegin + dataSize <= fileSize;
+        }
+
+        unsigned char &s = state[(size_t)subBlock.c + (size_t)subBlock.z * dims.sizeC];
+        // a duplicate does not make a damaged slice complete
+        if (s == 0)
+            s = intact ? 1 : 2;
+    }
+
+    for (int z = 0; z < dims.sizeZ; z++)
+    {
+        for (int c = 0; c < dims.sizeC; c++)
+        {
+            unsigned char s = state[(size_t)c + (size_t)z * dims.sizeC];
+            if (s == 1)
+                result.complete++;
+            else if (s == 2)
+                result.truncated.push_back(make_pair(c, z));
+            else
+                result.missing.push_back(make_pair(c, z));
+        }
+    }
+
+    return result;
+}
+
+void append_integrity_manifest(string const &nhdrPath, TimepointIntegrity const &entry)
+{
+    ostringstream line;
+    line << entry.name << " " << entry.status() << " " << entry.slices << " " << entry.complete
+         << " " << entry.truncated.size() << " " << entry.missing.size();
+    for (auto const &s : entry.truncated)
+        line << " " << s.first << ":" << s.second << ":t";
+    for (auto const &s : entry.missing)
+        line << " " << s.first << ":" << s.second << ":m";
+    line << "\n";
+    string text = line.str();
+
+    // one append of the whole line, so lines of skim jobs running at the same time do not interleave
+    string fileName = nhdrPath + manifestName;
+    int file = open(fileName.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0666);
+    bool written = file >= 0 && write(file, text.data(), text.size()) == (ssize_t)text.size();
+    if (file >= 0)
+        close(file);
+    if (!written)
+        throw LSPException("Could not write " + fileName + "\n", "cziintegrity.cpp", "append_integrity_manifest");
+}
+
+map<string, TimepointIntegrity> read_integrity_manifest(string const &nhdrPath)
+{
+    map<string, TimepointIntegrity> entries;
+    ifstream file(nhdrPath + manifestName);
+
+    string line;
+    while (getline(file, line))
+    {
+        istringstream in(line);
+        TimepointIntegrity entry;
+        string status;
+        size_t numTruncated, numMissing;
+        if (!(in >> entry.name >> status >> entry.slices >> entry.complete >> numTruncated >> numMissing))
+            continue;
+
+        string slice;
+        while (in >> slice)
+        {
+            int c, z;
+            char kind;
+            if (sscanf(slice.c_str(), "%d:%d:%c", &c, &z, &kind) != 3)
+                continue;
+            if (kind == 't')
+                entry.truncated.push_back(make_pair(c, z));
+            else
+                entry.missing.push_back(make_pair(c, z));
+        }
+        entries[entry.name] = entry;
+    }
+
+    return entries;
+}
+
+size_t skip_damaged_timepoints(string const &nhdrPath, vector< pair<int, string> > &files)
+{
+    map<string, TimepointIntegrity> manifest = read_integrity_manifest(nhdrPath);
+    if (manifest.empty())
+        return 0;
+
+    size_t kept = 0;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        auto it = manifest.find(files[i].second);
+        if (it != manifest.end() && !it->second.ok())
+        {
+            cout << "Skipping " << files[i].second << ", skim found it " << it->second.status() << ": "
+                 << it->second.complete << " of " << it->second.slices << " slices complete, "
+                 << it->second.truncated.size() << " truncated, " << it->second.missing.size() << " missing" << endl;
+            continue;
+        }
+        files[kept++] = files[i];
+    }
+
+    size_t skipped = files.size() - kept;
+    files.resize(kept);
+    return skipped;
+}
@@ -0,0 +1,64 @@
+//! \file czimap.cpp
+//! \brief Read-only memory mapping of a CZI file.
+
+#include "czimap.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+
+CziMappedFile::CziMappedFile(std::string const &fileName)
+: fileName(fileName), fd(-1), length(0), base(nullptr)
+{
+    fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw LSPException("Could not open " + fileName + ": " + strerror(errno) + "\n",
+                           "czimap.cpp", "CziMappedFile::CziMappedFile");
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0)
+    {
+        close(fd);
+        throw LSPException("Could not get the size of " + fileName + "\n",
+                           "czimap.cpp", "CziMappedFile::CziMappedFile");
+    }
+    length = (size_t)st.st_size;
+
+    void *addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        close(fd);
+        throw LSPException("Could not map " + fileName + ": " + strerror(errno) + "\n",
+                           "czimap.cpp", "CziMappedFile::CziMappedFile");
+    }
+    base = (unsigned char*)addr;
+}
+
+CziMappedFile::~CziMappedFile()
+{
+    if (base)
+        munmap(base, length);
+    if (fd >= 0)
+        close(fd);
+}
+
+void CziMappedFile::advise_sequential() const
+{
+    madvise(base, length, MADV_SEQUENTIAL);
+}
+
+void CziMappedFile::will_need(size_t offset, size_t bytes) const
+{
+    if (offset >= length)
+        return;
+    bytes = AIR_MIN(bytes, length - offset);
+
+    // madvise wants a page-aligned start
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = offset - offset % page;
+    madvise(base + start, bytes + (offset - start), MADV_WILLNEED);
+}
@@ -0,0 +1,435 @@
+//! \file czipreview.cpp
+//! \brief Low resolution previews of CZI timepoints, written by skim --preview at a small fraction of
+//! the I/O of reading the full resolution slices.
+
+#include "czipreview.h"
+#include "czidecode.h"
+#include "pixeltraits.h"
+#include "projkernel.h"
+#include "util.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <map>
+#include <set>
+#include <utility>
+
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+// fixed size fields of the file are not null terminated when full
+static string czi_field_string(const char *field, size_t size)
+{
+    return string(field, strnlen(field, size));
+}
+
+bool czi_read_attachment_directory(int cziFile, uint64_t position, vector<CziAttachmentInfo> &attachments)
+{
+    attachments.clear();
+
+    // files that were never finalized, and many that were, have no attachments
+    if (position == 0)
+        return false;
+
+    SID sid;
+    CziAttachmentDirectorySegmentHeader header;
+    if (pread(cziFile, &sid, sizeof(SID), position) != sizeof(SID)
+        || strncmp(sid.id, "ZISRAWATTDIR", sizeof(sid.id)) != 0
+        || pread(cziFile, &header, sizeof(header), position + sizeof(SID)) != sizeof(header)
+        || header.EntryCount < 0
+        || sid.usedSize < sizeof(header) + (uint64_t)header.EntryCount * sizeof(CziAttachmentEntryA1))
+        return false;
+
+    // one read of the whole directory
+    vector<CziAttachmentEntryA1> entries(header.EntryCount);
+    size_t bytes = entries.size() * sizeof(CziAttachmentEntryA1);
+    if (bytes && pread(cziFile, entries.data(), bytes, position + sizeof(SID) + sizeof(header)) != (ssize_t)bytes)
+        return false;
+
+    for (CziAttachmentEntryA1 const &entry : entries)
+    {
+        CziAttachmentInfo info;
+        info.name = czi_field_string(entry.Name, sizeof(entry.Name));
+        info.contentType = czi_field_string(entry.ContentFileType, sizeof(entry.ContentFileType));
+        info.filePart = entry.FilePart;
+        info.filePosition = entry.FilePosition;
+        attachments.push_back(info);
+    }
+    return true;
+}
+
+bool czi_read_attachment(int cziFile, CziAttachmentInfo const &attachment, vector<unsigned char> &data)
+{
+    SID sid;
+    CziAttachmentSegmentHeader header;
+    off_t position = (off_t)attachment.filePosition;
+    if (pread(cziFile, &sid, sizeof(SID), position) != sizeof(SID)
+        || strncmp(sid.id, "ZISRAWATTACH", sizeof(sid.id)) != 0
+        || pread(cziFile, &header, sizeof(header), position + sizeof(SID)) != sizeof(header)
+        || header.DataSize < 0
+        || sid.usedSize < sizeof(header) + (uint64_t)header.DataSize)
+        return false;
+
+    data.resize(header.DataSize);
+    return pread(cziFile, data.data(), data.size(), position + sizeof(SID) + sizeof(header)) == (ssize_t)data.size();
+}
+
+string czi_preview_frame_name(string const &previewPath, string const &nhdrFileName)
+{
+    return (fs::path(previewPath) / fs::path(nhdrFileName).stem()).string() + "-max.png";
+}
+
+CziPreviewBuilder::CziPreviewBuilder(ImageDims const &dims, vector<int> const &partFiles)
+: dims(dims), partFiles(partFiles), mop(airMopNew()),
+  factorXY(1), factorZ(1), fromPyramid(false), bytesRead(0), originX(0), originY(0),
+  canvasX(0), canvasY(0), canvasZ(0)
+{
+    nproj_xy = safe_nrrd_new(mop, (airMopper)nrrdNuke);
+    nproj_xz = safe_nrrd_new(mop, (airMopper)nrrdNuke);
+    nproj_yz = safe_nrrd_new(mop, (airMopper)nrrdNuke);
+}
+
+CziPreviewBuilder::~CziPreviewBuilder()
+{
+    airMopOkay(mop);
+}
+
+// the layer that comes closest to CZIPREVIEW_MIN_WIDTH pixels without going below it, among the
+// ones that have every (c, z) of the timepoint
+bool CziPreviewBuilder::choose_pyramid(vector<CziSubBlockInfo> const &slices, vector<CziSubBlockInfo> const &pyramid,
+                                       vector<CziSubBlockInfo> &layer)
+{
+    set< pair<int, int> > wanted;
+    int extentX = 0;
+    for (CziSubBlockInfo const &slice : slices)
+    {
+        wanted.insert(make_pair(slice.c, slice.z));
+        extentX = max(extentX, slice.x + slice.sizeX);
+    }
+
+    map<int, set< pair<int, int> > > covered;
+    for (CziSubBlockInfo const &block : pyramid)
+    {
+        if (block.storedSizeX <= 0 || block.storedSizeY <= 0)
+            continue;
+        int factor = (block.sizeX + block.storedSizeX / 2) / block.storedSizeX;
+        if (factor > 1)
+            covered[factor].insert(make_pair(block.c, block.z));
+    }
+
+    int chosen = 0;
+    for (auto const &level : covered)
+    {
+        bool complete = includes(level.second.begin(), level.second.end(), wanted.begin(), wanted.end());
+        if (!complete)
+            continue;
+        if (!chosen || extentX / level.first >= CZIPREVIEW_MIN_WIDTH)
+            chosen = level.first;
+    }
+    if (!chosen)
+        return false;
+
+    layer.clear();
+    for (CziSubBlockInfo const &block : pyramid)
+        if (block.storedSizeX > 0 && block.storedSizeY > 0
+            && (block.sizeX + block.storedSizeX / 2) / block.storedSizeX == chosen)
+            layer.push_back(block);
+
+    factorXY = chosen;
+    factorZ = 1;
+    return true;
+}
+
+void CziPreviewBuilder::allocate(int sizeX, int sizeY, int sizeZ)
+{
+    canvasX = sizeX;
+    canvasY = sizeY;
+    canvasZ = sizeZ;
+    canvas.assign((size_t)sizeX * sizeY, 0);
+
+    size_t sizeC = dims.sizeC;
+    nrrd_checker(nrrdAlloc_va(nproj_xy, nrrdTypeFloat, 4, (size_t)sizeX, (size_t)sizeY, sizeC, (size_t)2)
+                 || nrrdAlloc_va(nproj_xz, nrrdTypeFloat, 4, (size_t)sizeX, (size_t)sizeZ, sizeC, (size_t)2)
+                 || nrrdAlloc_va(nproj_yz, nrrdTypeFloat, 4, (size_t)sizeY, (size_t)sizeZ, sizeC, (size_t)2),
+                 mop, "Couldn't allocate preview projections:\n", "czipreview.cpp", "CziPreviewBuilder::allocate");
+    nrrdAxisInfoSet_va(nproj_xy, nrrdAxisInfoLabel, "x", "y", "c", "proj");
+    nrrdAxisInfoSet_va(nproj_xz, nrrdAxisInfoLabel, "x", "z", "c", "proj");
+    nrrdAxisInfoSet_va(nproj_yz, nrrdAxisInfoLabel, "y", "z", "c", "proj");
+
+    // slices that are missing leave their rows of XZ and YZ empty
+    memset(nproj_xz->data, 0, nrrdElementNumber(nproj_xz) * sizeof(float));
+    memset(nproj_yz->data, 0, nrrdElementNumber(nproj_yz) * sizeof(float));
+    size_t planeXY = (size_t)sizeX * sizeY * sizeC;
+    proj_init_xy((float*)nproj_xy->data, (float*)nproj_xy->data + planeXY, planeXY);
+}
+
+// "width" x "height" pixels of "block", decoded when it is compressed
+void CziPreviewBuilder::read_block(CziSubBlockInfo const &block, size_t width, size_t height, vector<unsigned char> &out)
+{
+    int fd = partFiles[block.entry.FilePart];
+    size_t bytes = width * height * dims.pixelSize;
+    out.resize(bytes);
+
+    if (block.entry.Compression == CZICOMPRESSTYPE_RAW)
+    {
+        if (pread(fd, out.data(), bytes, (off_t)block.dataBegin) != (ssize_t)bytes)
+            throw LSPException("Subblock data runs past the end of the file\n",
+                               "czipreview.cpp", "CziPreviewBuilder::read_block");
+        bytesRead += bytes;
+        return;
+    }
+
+    // DataSize is only in the subblock segment itself, not in its directory entry
+    CziSubBlockSegment_HeaderOnly header;
+    if (pread(fd, &header, sizeof(header), block.entry.FilePosition + sizeof(SID)) != sizeof(header))
+        throw LSPException("Could not read subblock header\n", "czipreview.cpp", "CziPreviewBuilder::read_block");
+    compressed.resize(header.DataSize);
+    if (pread(fd, compressed.data(), compressed.size(), (off_t)block.dataBegin) != (ssize_t)compressed.size())
+        throw LSPException("Subblock data runs past the end of the file\n",
+                           "czipreview.cpp", "CziPreviewBuilder::read_block");
+    bytesRead += compressed.size();
+    czi_decode_subblock(block.entry.Compression, compressed.data(), compressed.size(), out.data(), bytes, dims.pixelSize);
+}
+
+template<typename T>
+void CziPreviewBuilder::paste_block(const unsigned char *block, int width, int height, int x0, int y0)
+{
+    const T *in = (const T*)block;
+    for (int y = max(0, -y0); y < height && y0 + y < canvasY; y++)
+        for (int x = max(0, -x0); x < width && x0 + x < canvasX; x++)
+            canvas[(size_t)(y0 + y) * canvasX + x0 + x] = in[(size_t)y * width + x];
+}
+
+struct CziPreviewBuilder::PasteBlock {
+    CziPreviewBuilder *self;
+    const unsigned char *block;
+    int width, height, x0, y0;
+    template<typename T> void operator()(PixelTag<T>) const { self->paste_block<T>(block, width, height, x0, y0); }
+};
+
+// a pyramid subblock is already at the preview resolution, it only has to be put in its place
+void CziPreviewBuilder::add_pyramid_block(CziSubBlockInfo const &block)
+{
+    read_block(block, block.storedSizeX, block.storedSizeY, buffer);
+    pixel_dispatch_czi(dims.pixelType, PasteBlock{this, buffer.data(), block.storedSizeX, block.storedSizeY,
+                                                  (block.x - originX) / factorXY, (block.y - originY) / factorXY});
+}
+
+template<typename T>
+void CziPreviewBuilder::sample_rows(const unsigned char *rows, size_t rowCount, size_t rowStride, int x0, int firstX,
+                                    int y0, int width)
+{
+    for (size_t k = 0; k < rowCount && y0 + (int)k < canvasY; k++)
+    {
+        const T *row = (const T*)(rows + k * rowStride);
+        float *out = canvas.data() + (size_t)(y0 + k) * canvasX;
+        for (int i = x0, x = firstX; x < width && i < canvasX; i++, x += factorXY)
+            out[i] = row[x];
+    }
+}
+
+struct CziPreviewBuilder::SampleRows {
+    CziPreviewBuilder *self;
+    const unsigned char *rows;
+    size_t rowCount, rowStride;
+    int x0, firstX, y0, width;
+    template<typename T> void operator()(PixelTag<T>) const
+    {
+        self->sample_rows<T>(rows, rowCount, rowStride, x0, firstX, y0, width);
+    }
+};
+
+// preview pixel (i, j) is the full resolution pixel (i, j) * factorXY of the mosaic
+void CziPreviewBuilder::add_sampled_tile(CziSubBlockInfo const &tile)
+{
+    int f = factorXY;
+    int tileX = tile.x - originX, tileY = tile.y - originY;
+    int x0 = (tileX + f - 1) / f, y0 = (tileY + f - 1) / f;
+    int firstX = x0 * f - tileX, firstY = y0 * f - tileY;
+    if (firstX >= tile.sizeX || firstY >= tile.sizeY)
+        return;
+    size_t rowCount = (tile.sizeY - firstY + f - 1) / f;
+    size_t rowBytes = (size_t)tile.sizeX * dims.pixelSize;
+
+    if (tile.entry.Compression == CZICOMPRESSTYPE_RAW)
+    {
+        // only the rows that are sampled are read
+        int fd = partFiles[tile.entry.FilePart];
+        buffer.resize(rowCount * rowBytes);
+        for (size_t k = 0; k < rowCount; k++)
+        {
+            off_t offset = (off_t)(tile.dataBegin + (firstY + k * f) * rowBytes);
+            if (pread(fd, buffer.data() + k * rowBytes, rowBytes, offset) != (ssize_t)rowBytes)
+                throw LSPException("Slice data runs past the end of the file\n",
+                                   "czipreview.cpp", "CziPreviewBuilder::add_sampled_tile");
+        }
+        bytesRead += rowCount * rowBytes;
+        pixel_dispatch_czi(dims.pixelType, SampleRows{this, buffer.data(), rowCount, rowBytes, x0, firstX, y0, tile.sizeX});
+    }
+    else
+    {
+        // compressed slices can only be decoded whole
+        read_block(tile, tile.sizeX, tile.sizeY, buffer);
+        pixel_dispatch_czi(dims.pixelType, SampleRows{this, buffer.data() + firstY * rowBytes, rowCount, f * rowBytes,
+                                                      x0, firstX, y0, tile.sizeX});
+    }
+}
+
+void CziPreviewBuilder::project_canvas(int c, int z)
+{
+    size_t sizeX = canvasX, sizeY = canvasY, sizeZ = canvasZ;
+    float *xy = (float*)nproj_xy->data, *xz = (float*)nproj_xz->data, *yz = (float*)nproj_yz->data;
+    size_t off_xy = sizeX * sizeY * c;
+    size_t off_xz = sizeX * (z + sizeZ * c);
+    size_t off_yz = sizeY * (z + sizeZ * c);
+
+    ProjSliceTargets targets;
+    targets.maxXY = xy + off_xy;
+    targets.meanXY = xy + sizeX * sizeY * dims.sizeC + off_xy;
+    targets.maxXZ = xz + off_xz;
+    targets.meanXZ = xz + sizeX * sizeZ * dims.sizeC + off_xz;
+    targets.maxYZ = yz + off_yz;
+    targets.meanYZ = yz + sizeY * sizeZ * dims.sizeC + off_yz;
+    targets.scaleXY = 1.0f / sizeZ;
+    targets.scaleXZ = 1.0f / sizeY;
+    targets.scaleYZ = 1.0f / sizeX;
+    proj_accumulate_slice(canvas.data(), sizeX, sizeY, targets);
+}
+
+void CziPreviewBuilder::build(vector<CziSubBlockInfo> const &slices, vector<CziSubBlockInfo> const &pyramid)
+{
+    bytesRead = 0;
+    vector<CziSubBlockInfo> blocks;
+    fromPyramid = choose_pyramid(slices, pyramid, blocks);
+    if (fromPyramid)
+    {
+        originX = originY = INT_MAX;
+        for (CziSubBlockInfo const &block : blocks)
+        {
+            originX = min(originX, block.x);
+            originY = min(originY, block.y);
+        }
+    }
+    else
+    {
+        factorXY = factorZ = CZIPREVIEW_STRIDE;
+        originX = originY = 0;
+        for (CziSubBlockInfo const &slice : slices)
+            if (slice.z % factorZ == 0)
+                blocks.push_back(slice);
+    }
+
+    int extentX = 0, extentY = 0;
+    for (CziSubBlockInfo const &block : blocks)
+    {
+        if (block.entry.PixelType != dims.pixelType)
+            throw LSPException("ImageSubBlock PixelType field doesn't agree with XML\n",
+                               "czipreview.cpp", "CziPreviewBuilder::build");
+        if (!czi_compression_supported(block.entry.Compression))
+            throw LSPException("ImageSubBlock indicated unsupported compression type\n",
+                               "czipreview.cpp", "CziPreviewBuilder::build");
+        extentX = max(extentX, block.x - originX + block.sizeX);
+        extentY = max(extentY, block.y - originY + block.sizeY);
+    }
+    if (blocks.empty() || extentX <= 0 || extentY <= 0)
+        throw LSPException("Timepoint has no slices to preview\n", "czipreview.cpp", "CziPreviewBuilder::build");
+
+    allocate((extentX + factorXY - 1) / factorXY, (extentY + factorXY - 1) / factorXY,
+             (dims.sizeZ + factorZ - 1) / factorZ);
+
+    // every (c, z) of the preview is assembled from its tiles and projected right away
+    stable_sort(blocks.begin(), blocks.end(),
+                [](const CziSubBlockInfo &a, const CziSubBlockInfo &b)
+                {
+                    if (a.z != b.z) return a.z < b.z;
+                    return a.c < b.c;
+                });
+    for (size_t first = 0, last; first < blocks.size(); first = last)
+    {
+        for (last = first + 1; last < blocks.size() && blocks[last].z == blocks[first].z
+                               && blocks[last].c == blocks[first].c; last++)
+            ;
+        int c = blocks[first].c, z = blocks[first].z / factorZ;
+        if (c < 0 || c >= dims.sizeC || z < 0 || z >= canvasZ)
+            continue;
+
+        fill(canvas.begin(), canvas.end(), 0);
+        for (size_t i = first; i < last; i++)
+        {
+            if (fromPyramid)
+                add_pyramid_block(blocks[i]);
+            else
+                add_sampled_tile(blocks[i]);
+        }
+        project_canvas(c, z);
+    }
+}
+
+void CziPreviewBuilder::save(string const &baseName)
+{
+    // same per-axis meta data as the projections of skim --with-proj, at the preview resolution;
+    // a pyramid pixel is the mean of a box, so it sits in the middle of it
+    double center = fromPyramid ? (factorXY - 1) / 2.0 : 0;
+    double origin[3] = {(originX + center) * dims.scalingX / 1e-7, (originY + center) * dims.scalingY / 1e-7, 0};
+    double none[3] = {AIR_NAN, AIR_NAN, AIR_NAN};
+    double dirX[3] = {factorXY * dims.scalingX / 1e-7, 0, 0};
+    double dirY[3] = {0, factorXY * dims.scalingY / 1e-7, 0};
+    double dirZ[3] = {0, 0, factorZ * dims.scalingZ / 1e-7};
+    Nrrd *nprojs[3] = {nproj_xy, nproj_xz, nproj_yz};
+    for (int i = 0; i < 3; i++)
+    {
+        nrrd_checker(nrrdSpaceSet(nprojs[i], nrrdSpace3DRightHanded)
+                     || nrrdSpaceOriginSet(nprojs[i], origin),
+                     mop, "Couldn't set projection space:\n", "czipreview.cpp", "CziPreviewBuilder::save");
+        for (int j = 0; j < 3; j++)
+            nprojs[i]->spaceUnits[j] = airStrdup("um");
+        nrrdAxisInfoSet_va(nprojs[i], nrrdAxisInfoCenter,
+                           nrrdCenterCell, nrrdCenterCell, nrrdCenterUnknown, nrrdCenterUnknown);
+    }
+    nrrdAxisInfoSet_va(nproj_xy, nrrdAxisInfoSpaceDirection, dirX, dirY, none, none);
+    nrrdAxisInfoSet_va(nproj_xz, nrrdAxisInfoSpaceDirection, dirX, dirZ, none, none);
+    nrrdAxisInfoSet_va(nproj_yz, nrrdAxisInfoSpaceDirection, dirY, dirZ, none, none);
+
+    nrrd_checker(nrrdSave((baseName + "-projXY.nrrd").c_str(), nproj_xy, NULL)
+                 || nrrdSave((baseName + "-projXZ.nrrd").c_str(), nproj_xz, NULL)
+                 || nrrdSave((baseName + "-projYZ.nrrd").c_str(), nproj_yz, NULL),
+                 mop, "Couldn't save preview projections:\n", "czipreview.cpp", "CziPreviewBuilder::save");
+
+    // the frame: max XY, every channel quantized to 8 bits between its 5% and 99.98% percentiles,
+    // channel 0 green and channel 1 magenta as in lsp anim
+    airArray *mop_t = airMopNew();
+    Nrrd *nmax = safe_nrrd_new(mop_t, (airMopper)nrrdNuke);
+    nrrd_checker(nrrdSlice(nmax, nproj_xy, 3, 0), mop_t, "Error slicing preview:\n",
+                 "czipreview.cpp", "CziPreviewBuilder::save");
+
+    int numChannels = min(dims.sizeC, 2);
+    Nrrd *bits[2] = {nullptr, nullptr};
+    for (int c = 0; c < numChannels; c++)
+    {
+        Nrrd *ch = safe_nrrd_new(mop_t, (airMopper)nrrdNuke);
+        bits[c] = safe_nrrd_new(mop_t, (airMopper)nrrdNuke);
+        NrrdRange *range = nrrdRangeNew(AIR_NAN, AIR_NAN);
+        airMopAdd(mop_t, range, (airMopper)nrrdRangeNix, airMopAlways);
+        nrrd_checker(nrrdSlice(ch, nmax, 2, c)
+                     || nrrdRangePercentileFromStringSet(range, ch, "5%", "0.02%", 5000, true)
+                     || nrrdQuantize(bits[c], ch, range, 8),
+                     mop_t, "Error quantizing preview:\n", "czipreview.cpp", "CziPreviewBuilder::save");
+    }
+
+    Nrrd *frame = bits[0];
+    if (numChannels > 1)
+    {
+        frame = safe_nrrd_new(mop_t, (airMopper)nrrdNuke);
+        const Nrrd *rgb[3] = {bits[1], bits[0], bits[1]};
+        nrrd_checker(nrrdJoin(frame, rgb, 3, 0, 1), mop_t, "Error joining preview channels:\n",
+                     "czipreview.cpp", "CziPreviewBuilder::save");
+    }
+    nrrd_checker(nrrdSave((baseName + "-max.png").c_str(), frame, NULL), mop_t, "Error saving preview frame:\n",
+                 "czipreview.cpp", "CziPreviewBuilder::save");
+    airMopOkay(mop_t);
+}
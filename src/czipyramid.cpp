@@ -0,0 +1,254 @@
+//! \file czipyramid.cpp
+//! \brief Box-downsampled levels of every timepoint, written by skim in the same pass that reads its slices.
+//!
+//! Only one z box per level is held in memory. Level 1 sums the full resolution slices, and every
+//! finished box of a level is written out and then added into the next level, so the coarser levels
+//! cost little beyond the first one. The sums are passed on rather than the means, so boxes at the
+//! edges are weighted by the voxels they actually cover.
+
+#include "czipyramid.h"
+#include "pixeltraits.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+string czi_pyramid_file_name(string const &nhdrFileName, int level)
+{
+    return fs::path(nhdrFileName).replace_extension("").string() + "-L" + to_string(level) + ".nrrd";
+}
+
+string czi_pyramid_pick(string const &nhdrFileName, int level)
+{
+    for (int l = min(level, CZIPYRAMID_MAX_LEVELS); l > 0; l--)
+    {
+        string fileName = czi_pyramid_file_name(nhdrFileName, l);
+        if (fs::exists(fileName))
+            return fileName;
+    }
+    return nhdrFileName;
+}
+
+CziPyramidWriter::CziPyramidWriter(ImageDims const &dims, int numLevels, string const &nhdrFileName,
+                                   int originX, int originY)
+: dims(dims), originX(originX), originY(originY)
+{
+    numLevels = min(numLevels, CZIPYRAMID_MAX_LEVELS);
+    for (int l = 1; l <= numLevels; l++)
+    {
+        Level level;
+        level.factor = 1 << l;
+        level.sizeX = (dims.sizeX + level.factor - 1) / level.factor;
+        level.sizeY = (dims.sizeY + level.factor - 1) / level.factor;
+        level.sizeZ = (dims.sizeZ + level.factor - 1) / level.factor;
+        level.fileName = czi_pyramid_file_name(nhdrFileName, l);
+        level.fd = -1;
+        level.dataOffset = 0;
+        level.block = -1;
+        level.sum.assign(level.sizeX * level.sizeY * dims.sizeC, 0);
+        level.slices.assign(dims.sizeC, 0);
+        levels.push_back(level);
+    }
+
+    // headers are written right away, boxes that never get a slice stay zero
+    for (Level &level : levels)
+    {
+        level.fd = open(level.fileName.c_str(), O_TRUNC | O_CREAT | O_WRONLY, 0666);
+        if (level.fd < 0)
+            throw LSPException("Could not open " + level.fileName + " for writing\n",
+                               "czipyramid.cpp", "CziPyramidWriter::CziPyramidWriter");
+        write_header(level);
+    }
+}
+
+CziPyramidWriter::~CziPyramidWriter()
+{
+    for (Level &level : levels)
+        if (level.fd >= 0)
+            close(level.fd);
+}
+
+void CziPyramidWriter::write_header(Level &level)
+{
+    const char *type = pixel_nrrd_name(dims.pixelType);
+    double f = level.factor;
+    char buffer[1024];
+    string header = "NRRD0006\n";
+    header += string("type: ") + type + "\n";
+    if (dims.sizeC < 2)
+    {
+        snprintf(buffer, sizeof(buffer), "dimension: 3\nsizes: %zu %zu %zu\ncenters: cell cell cell\n",
+                 level.sizeX, level.sizeY, level.sizeZ);
+    }
+    else
+    {
+        snprintf(buffer, sizeof(buffer), "dimension: 4\nsizes: %zu %zu %d %zu\ncenters: cell cell none cell\n",
+                 level.sizeX, level.sizeY, dims.sizeC, level.sizeZ);
+    }
+    header += buffer;
+    header += "space: 3D-right-handed\n";
+    // the first voxel is the center of the first box, half a box minus half a voxel away
+    snprintf(buffer, sizeof(buffer), "space origin: (%.12f, %.12f, %.12f)\n",
+             (originX + (f - 1) / 2) * dims.scalingX / 1e-7, (originY + (f - 1) / 2) * dims.scalingY / 1e-7,
+             (f - 1) / 2 * dims.scalingZ / 1e-7);
+    header += buffer;
+    header += "space units: \"um\" \"um\" \"um\"\n";
+    snprintf(buffer, sizeof(buffer), "space directions: (%.12f, 0, 0) (0, %.12f, 0) %s(0, 0, %.12f)\n",
+             f * dims.scalingX / 1e-7, f * dims.scalingY / 1e-7, dims.sizeC < 2 ? "" : "none ", f * dims.scalingZ / 1e-7);
+    header += buffer;
+    header += "endian: little\n";
+    header += "encoding: raw\n";
+    header += "lsp pyramid factor:=" + to_string(level.factor) + "\n";
+    header += "\n";
+
+    level.dataOffset = header.size();
+    size_t dataBytes = level.sizeX * level.sizeY * dims.sizeC * level.sizeZ * dims.pixelSize;
+    if (write(level.fd, header.data(), header.size()) != (ssize_t)header.size()
+        || ftruncate(level.fd, (off_t)(level.dataOffset + dataBytes)) != 0)
+        throw LSPException("Could not write " + level.fileName + "\n",
+                           "czipyramid.cpp", "CziPyramidWriter::write_header");
+}
+
+template<typename T>
+void CziPyramidWriter::accumulate(int c, const T *slice)
+{
+    Level &level = levels[0];
+    size_t sizeX = dims.sizeX, sizeY = dims.sizeY;
+    double *sum = level.sum.data() + (size_t)c * level.sizeX * level.sizeY;
+    for (size_t y = 0; y < sizeY; y++)
+    {
+        const T *in = slice + y * sizeX;
+        double *out = sum + (y / 2) * level.sizeX;
+        size_t x = 0;
+        for (; x + 1 < sizeX; x += 2)
+            out[x / 2] += (double)in[x] + in[x + 1];
+        if (x < sizeX)
+            out[x / 2] += in[x];
+    }
+}
+
+struct CziPyramidWriter::Accumulate {
+    CziPyramidWriter *self;
+    int c;
+    const unsigned char *slice;
+    template<typename T> void operator()(PixelTag<T>) const { self->accumulate(c, (const T*)slice); }
+};
+
+void CziPyramidWriter::add_slice(int c, int z, const unsigned char *slice)
+{
+    if (levels.empty() || c < 0 || c >= dims.sizeC || z < 0 || z >= dims.sizeZ)
+        return;
+
+    start_block(0, z / 2);
+    levels[0].slices[c]++;
+    if (!pixel_dispatch_czi(dims.pixelType, Accumulate{this, c, slice}))
+        throw LSPException("Can't deal with given pixelType\n",
+                           "czipyramid.cpp", "CziPyramidWriter::add_slice");
+}
+
+void CziPyramidWriter::start_block(size_t l, int block)
+{
+    if (levels[l].block == block)
+        return;
+    flush(l);
+    levels[l].block = block;
+}
+
+// mean of every box, over the voxels it covers
+template<typename T>
+void CziPyramidWriter::store_plane(Level const &level, int c)
+{
+    const double *sum = level.sum.data() + (size_t)c * level.sizeX * level.sizeY;
+    T *out = (T*)plane.data();
+    for (size_t y = 0; y < level.sizeY; y++)
+    {
+        double wy = min(level.factor, dims.sizeY - (int)y * level.factor);
+        for (size_t x = 0; x < level.sizeX; x++)
+        {
+            double wx = min(level.factor, dims.sizeX - (int)x * level.factor);
+            size_t i = y * level.sizeX + x;
+            out[i] = PixelTraits<T>::from_double(sum[i] / (wx * wy * level.slices[c]));
+        }
+    }
+}
+
+struct CziPyramidWriter::StorePlane {
+    CziPyramidWriter *self;
+    Level const &level;
+    int c;
+    template<typename T> void operator()(PixelTag<T>) const { self->store_plane<T>(level, c); }
+};
+
+void CziPyramidWriter::flush(size_t l)
+{
+    Level &level = levels[l];
+    if (level.block < 0)
+        return;
+
+    size_t planePixels = level.sizeX * level.sizeY;
+    size_t planeBytes = planePixels * dims.pixelSize;
+    plane.resize(planeBytes);
+    for (int c = 0; c < dims.sizeC; c++)
+    {
+        if (!level.slices[c])
+            continue;
+
+        pixel_dispatch_czi(dims.pixelType, StorePlane{this, level, c});
+
+        // axes go X Y C Z
+        size_t offset = level.dataOffset + ((size_t)level.block * dims.sizeC + c) * planeBytes;
+        if (pwrite(level.fd, plane.data(), planeBytes, (off_t)offset) != (ssize_t)planeBytes)
+            throw LSPException("Could not write " + level.fileName + "\n",
+                               "czipyramid.cpp", "CziPyramidWriter::flush");
+    }
+
+    // the sums of this box go into the box of the next level that contains it
+    if (l + 1 < levels.size())
+    {
+        start_block(l + 1, level.block / 2);
+        Level &next = levels[l + 1];
+        for (int c = 0; c < dims.sizeC; c++)
+        {
+            if (!level.slices[c])
+                continue;
+            const double *sum = level.sum.data() + (size_t)c * planePixels;
+            double *nextSum = next.sum.data() + (size_t)c * next.sizeX * next.sizeY;
+            for (size_t y = 0; y < level.sizeY; y++)
+                for (size_t x = 0; x < level.sizeX; x++)
+                    nextSum[(y / 2) * next.sizeX + x / 2] += sum[y * level.sizeX + x];
+            next.slices[c] += level.slices[c];
+        }
+    }
+
+    fill(level.sum.begin(), level.sum.end(), 0);
+    fill(level.slices.begin(), level.slices.end(), 0);
+    level.block = -1;
+}
+
+void CziPyramidWriter::finish()
+{
+    // finer levels first, each one passes its last box on to the next
+    for (size_t l = 0; l < levels.size(); l++)
+        flush(l);
+
+    for (Level &level : levels)
+    {
+        int fd = level.fd;
+        level.fd = -1;
+        if (close(fd) != 0)
+            throw LSPException("Could not write " + level.fileName + "\n",
+                               "czipyramid.cpp", "CziPyramidWriter::finish");
+    }
+}
@@ -0,0 +1,265 @@
+//! \file czistats.cpp
+//! \brief Pixel statistics of every timepoint, kept in a binary sidecar next to the nhdr file.
+
+#include "czistats.h"
+#include "pixeltraits.h"
+#include "util.h"
+
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+static const char statsMagic[8] = {'L', 'S', 'P', 'S', 'T', 'A', 'T', 'S'};
+static const uint32_t statsVersion = 1;
+
+CziSliceStats CziStats::channel(int c) const
+{
+    CziSliceStats merged;
+    merged.count = 0;
+    merged.min = merged.max = merged.mean = AIR_NAN;
+    double sum = 0;
+    for (int z = 0; z < header.sizeZ; z++)
+    {
+        CziSliceStats const &s = slices[(size_t)c + (size_t)z * header.sizeC];
+        if (!s.count)
+            continue;
+        merged.min = merged.count ? min(merged.min, s.min) : s.min;
+        merged.max = merged.count ? max(merged.max, s.max) : s.max;
+        merged.count += s.count;
+        sum += s.mean * s.count;
+    }
+    if (merged.count)
+        merged.mean = sum / merged.count;
+    return merged;
+}
+
+const uint64_t *CziStats::histogram(int c, CziStatsHistogram kind) const
+{
+    return histograms.data() + ((size_t)c * CZISTATS_NUM_HISTOGRAMS + kind) * header.bins;
+}
+
+double CziStats::percentile(int c, CziStatsHistogram kind, double fraction) const
+{
+    const uint64_t *counts = histogram(c, kind);
+    uint64_t total = 0;
+    for (uint32_t b = 0; b < header.bins; b++)
+        total += counts[b];
+    if (!total)
+        return AIR_NAN;
+
+    double width = (header.histMax - header.histMin) / header.bins;
+    double target = min(max(fraction, 0.0), 1.0) * total;
+    uint64_t below = 0;
+    for (uint32_t b = 0; b < header.bins; b++)
+    {
+        if (counts[b] && below + counts[b] >= target)
+            return header.histMin + (b + (target - below) / counts[b]) * width;
+        below += counts[b];
+    }
+    return header.histMax;
+}
+
+bool CziStats::range(int c, CziStatsHistogram kind, string const &minStr, string const &maxStr,
+                     double &min, double &max) const
+{
+    if (!header.bins || c < 0 || c >= header.sizeC)
+        return false;
+
+    const string *strs[2] = {&minStr, &maxStr};
+    double *values[2] = {&min, &max};
+    for (int i = 0; i < 2; i++)
+    {
+        string const &str = *strs[i];
+        if (!str.empty() && str.back() == '%')
+        {
+            double fraction = atof(str.c_str()) / 100;
+            // the max percentile counts from the top
+            *values[i] = percentile(c, kind, i ? 1 - fraction : fraction);
+            if (std::isnan(*values[i]))
+                return false;
+        }
+        else
+        {
+            *values[i] = atof(str.c_str());
+        }
+    }
+    return true;
+}
+
+string czi_stats_file_name(string const &nhdrFileName)
+{
+    return boost::filesystem::path(nhdrFileName).replace_extension(".stats").string();
+}
+
+bool czi_stats_load(string const &fileName, CziStats &stats)
+{
+    FILE *file = fopen(fileName.c_str(), "rb");
+    if (!file)
+        return false;
+
+    bool ok = fread(&stats.header, sizeof(stats.header), 1, file) == 1
+        && memcmp(stats.header.magic, statsMagic, sizeof(statsMagic)) == 0
+        && stats.header.version == statsVersion
+        && stats.header.sizeC > 0 && stats.header.sizeZ > 0;
+    if (ok)
+    {
+        stats.slices.resize((size_t)stats.header.sizeC * stats.header.sizeZ);
+        stats.histograms.resize((size_t)stats.header.sizeC * CZISTATS_NUM_HISTOGRAMS * stats.header.bins);
+        ok = fread(stats.slices.data(), sizeof(CziSliceStats), stats.slices.size(), file) == stats.slices.size()
+            && fread(stats.histograms.data(), sizeof(uint64_t), stats.histograms.size(), file) == stats.histograms.size();
+    }
+
+    fclose(file);
+    return ok;
+}
+
+CziStatsAccumulator::CziStatsAccumulator(ImageDims const &dims)
+{
+    CziStatsHeader &header = result.header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, statsMagic, sizeof(statsMagic));
+    header.version = statsVersion;
+    header.pixelType = dims.pixelType;
+    header.sizeX = dims.sizeX;
+    header.sizeY = dims.sizeY;
+    header.sizeC = dims.sizeC;
+    header.sizeZ = dims.sizeZ;
+
+    // integer data is binned over its whole range, 16 values per bin for 16-bit data
+    if (dims.pixelType == CZIPIXELTYPE_GRAY8)
+    {
+        header.bins = 256;
+        header.histMax = 256;
+    }
+    else if (dims.pixelType == CZIPIXELTYPE_GRAY16)
+    {
+        header.bins = 4096;
+        header.histMax = 65536;
+    }
+    binScale = header.bins ? header.bins / (header.histMax - header.histMin) : 0;
+
+    CziSliceStats empty;
+    empty.count = 0;
+    empty.min = empty.max = empty.mean = 0;
+    result.slices.assign((size_t)dims.sizeC * dims.sizeZ, empty);
+    result.histograms.assign((size_t)dims.sizeC * CZISTATS_NUM_HISTOGRAMS * header.bins, 0);
+
+    maxXY.assign((size_t)dims.sizeX * dims.sizeY * dims.sizeC, -FLT_MAX);
+    maxYZ.assign((size_t)dims.sizeY * dims.sizeZ * dims.sizeC, -FLT_MAX);
+}
+
+size_t CziStatsAccumulator::bin(double value) const
+{
+    double b = (value - result.header.histMin) * binScale;
+    return b <= 0 ? 0 : min((size_t)b, (size_t)result.header.bins - 1);
+}
+
+template<typename T>
+void CziStatsAccumulator::add(int c, int z, const T *slice)
+{
+    CziStatsHeader const &header = result.header;
+    size_t sizeX = header.sizeX, sizeY = header.sizeY;
+    float *xy = maxXY.data() + (size_t)c * sizeX * sizeY;
+    float *yz = maxYZ.data() + ((size_t)c * header.sizeZ + z) * sizeY;
+    uint64_t *counts = header.bins ? result.histograms.data() + (size_t)c * CZISTATS_NUM_HISTOGRAMS * header.bins : nullptr;
+
+    T lo = slice[0], hi = slice[0];
+    double sum = 0;
+    for (size_t y = 0; y < sizeY; y++)
+    {
+        const T *row = slice + y * sizeX;
+        T rowMax = row[0];
+        double rowSum = 0;
+        for (size_t x = 0; x < sizeX; x++)
+        {
+            T v = row[x];
+            rowMax = max(rowMax, v);
+            lo = min(lo, v);
+            rowSum += v;
+            xy[y * sizeX + x] = max(xy[y * sizeX + x], (float)v);
+            if (counts)
+                counts[bin(v)]++;
+        }
+        hi = max(hi, rowMax);
+        sum += rowSum;
+        yz[y] = max(yz[y], (float)rowMax);
+    }
+
+    // a duplicate subblock of the same slice is merged into it
+    CziSliceStats &s = result.slices[(size_t)c + (size_t)z * header.sizeC];
+    uint64_t n = sizeX * sizeY;
+    s.min = s.count ? min(s.min, (double)lo) : lo;
+    s.max = s.count ? max(s.max, (double)hi) : hi;
+    s.mean = (s.mean * s.count + sum) / (s.count + n);
+    s.count += n;
+}
+
+struct CziStatsAccumulator::AddSlice {
+    CziStatsAccumulator *self;
+    int c, z;
+    const unsigned char *slice;
+    template<typename T> void operator()(PixelTag<T>) const { self->add(c, z, (const T*)slice); }
+};
+
+void CziStatsAccumulator::add_slice(int c, int z, const unsigned char *slice)
+{
+    if (c < 0 || c >= result.header.sizeC || z < 0 || z >= result.header.sizeZ)
+        return;
+
+    if (!pixel_dispatch_czi(result.header.pixelType, AddSlice{this, c, z, slice}))
+        throw LSPException("Can't deal with given pixelType\n",
+                           "czistats.cpp", "CziStatsAccumulator::add_slice");
+}
+
+void CziStatsAccumulator::save(string const &fileName)
+{
+    CziStatsHeader const &header = result.header;
+    size_t sizeX = header.sizeX, sizeY = header.sizeY, sizeZ = header.sizeZ;
+
+    // pixels of a projection that no slice reached are left out
+    for (int c = 0; header.bins && c < header.sizeC; c++)
+    {
+        uint64_t *counts = result.histograms.data() + (size_t)c * CZISTATS_NUM_HISTOGRAMS * header.bins;
+        uint64_t *countsXY = counts + CZISTATS_MAX_XY * header.bins;
+        uint64_t *countsCenter = counts + CZISTATS_MAX_XY_CENTER * header.bins;
+        uint64_t *countsYZ = counts + CZISTATS_MAX_YZ * header.bins;
+
+        const float *xy = maxXY.data() + (size_t)c * sizeX * sizeY;
+        for (size_t y = 0; y < sizeY; y++)
+        {
+            bool centerY = 4 * y >= sizeY && 4 * y < 3 * sizeY;
+            for (size_t x = 0; x < sizeX; x++)
+            {
+                float v = xy[y * sizeX + x];
+                if (v == -FLT_MAX)
+                    continue;
+                countsXY[bin(v)]++;
+                if (centerY && 4 * x >= sizeX && 4 * x < 3 * sizeX)
+                    countsCenter[bin(v)]++;
+            }
+        }
+
+        const float *yz = maxYZ.data() + (size_t)c * sizeY * sizeZ;
+        for (size_t i = 0; i < sizeY * sizeZ; i++)
+            if (yz[i] != -FLT_MAX)
+                countsYZ[bin(yz[i])]++;
+    }
+
+    FILE *file = fopen(fileName.c_str(), "wb");
+    if (!file)
+        throw LSPException("Could not open " + fileName + " for writing\n",
+                           "czistats.cpp", "CziStatsAccumulator::save");
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(result.slices.data(), sizeof(CziSliceStats), result.slices.size(), file) == result.slices.size()
+        && fwrite(result.histograms.data(), sizeof(uint64_t), result.histograms.size(), file) == result.histograms.size();
+    if (fclose(file) != 0 || !written)
+        throw LSPException("Could not write " + fileName + "\n",
+                           "czistats.cpp", "CziStatsAccumulator::save");
+}
@@ -0,0 +1,241 @@
+//! \file cziwatch.cpp
+//! \brief Watches a live acquisition directory and hands out each CZI file once it has been written completely.
+//!
+//! inotify tells us about new and closed files right away. Acquisition PCs often write to a
+//! network share where no inotify events arrive for remote writes, so the directory is also
+//! listed again every settle period. Sizes are polled rather than followed through IN_MODIFY,
+//! which would wake us up for every write of the microscope.
+
+#include "cziwatch.h"
+#include "skimczi.h"
+#include "skimczi_util.h"
+#include "util.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+bool czi_file_complete(string const &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    bool complete = false;
+    SID sid;
+    CziHeaderInfo header;
+    struct stat st;
+    if (fstat(fd, &st) == 0
+        && pread(fd, &sid, sizeof(sid), 0) == sizeof(sid)
+        && strncmp(sid.id, "ZISRAWFILE", sizeof(sid.id)) == 0
+        && pread(fd, &header, sizeof(header), sizeof(sid)) == sizeof(header)
+        && header.UpdatePending == 0)
+    {
+        // the metadata segment is written last by some writers, so it has to be there as well
+        SID metadata;
+        bool metadataOk = header.MetadataPosition > 0
+            && header.MetadataPosition + sizeof(SID) <= (uint64_t)st.st_size
+            && pread(fd, &metadata, sizeof(metadata), header.MetadataPosition) == sizeof(metadata)
+            && strncmp(metadata.id, "ZISRAWMETADATA", sizeof(metadata.id)) == 0
+            && header.MetadataPosition + sizeof(SID) + metadata.usedSize <= (uint64_t)st.st_size;
+
+        vector<CziSubBlockInfo> subBlocks;
+        complete = metadataOk
+            && read_subblock_directory(fd, header.DirectoryPosition, subBlocks)
+            && !subBlocks.empty();
+    }
+
+    close(fd);
+    return complete;
+}
+
+bool czi_file_sequence_number(string const &name, int &sequenceNum)
+{
+    // same rules as the directory listing of skim: .czi files without "test" in their name
+    size_t suff = name.rfind(".czi");
+    if (suff == string::npos || suff != name.length() - 4 || name.rfind("test") != string::npos)
+        return false;
+
+    size_t start = name.rfind("(");
+    size_t end = name.rfind(")");
+    // the first time stamp does not come with a sequence number
+    if (start == string::npos || end == string::npos)
+    {
+        sequenceNum = 0;
+        return true;
+    }
+    if (end < start)
+        return false;
+
+    string sequenceNumString = name.substr(start + 1, end - start - 1);
+    if (!is_number(sequenceNumString))
+        return false;
+    sequenceNum = stoi(sequenceNumString);
+    return true;
+}
+
+CziDirectoryWatcher::CziDirectoryWatcher(string const &dir, int settleSeconds)
+: dir(dir), settleSeconds(settleSeconds), fd(-1), wd(-1)
+{
+    if (!this->dir.empty() && this->dir.back() != '/')
+        this->dir += "/";
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+        throw LSPException(string("Could not initialize inotify: ") + strerror(errno) + "\n",
+                           "cziwatch.cpp", "CziDirectoryWatcher::CziDirectoryWatcher");
+    wd = inotify_add_watch(fd, this->dir.c_str(), IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd < 0)
+    {
+        string error = strerror(errno);
+        close(fd);
+        throw LSPException("Could not watch " + this->dir + ": " + error + "\n",
+                           "cziwatch.cpp", "CziDirectoryWatcher::CziDirectoryWatcher");
+    }
+
+    lastActivity = Clock::now();
+    rescan();
+
+    // files that were there before we started are treated as closed, if they are not
+    // complete yet they simply wait for their size to settle
+    for (auto &p : pending)
+        p.second.closed = true;
+}
+
+CziDirectoryWatcher::~CziDirectoryWatcher()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+void CziDirectoryWatcher::rescan()
+{
+    for (string const &name : GetDirectoryFiles(dir))
+        add_pending(name, false);
+    lastRescan = Clock::now();
+}
+
+void CziDirectoryWatcher::read_events(int timeoutMs)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeoutMs) <= 0)
+        return;
+
+    // room for at least one event with the longest possible name
+    alignas(struct inotify_event) char buffer[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+    while (true)
+    {
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length <= 0)
+            break;
+
+        for (char *p = buffer; p < buffer + length; )
+        {
+            const struct inotify_event *event = (const struct inotify_event*)p;
+            if (event->len > 0)
+                add_pending(event->name, (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) != 0);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+void CziDirectoryWatcher::add_pending(string const &name, bool closed)
+{
+    int sequenceNum;
+    if (handedOut.count(name) || !czi_file_sequence_number(name, sequenceNum))
+        return;
+
+    auto it = pending.find(name);
+    if (it == pending.end())
+    {
+        Pending p;
+        p.size = -1;
+        p.changed = Clock::now();
+        p.closed = closed;
+        pending[name] = p;
+        lastActivity = Clock::now();
+    }
+    else if (closed)
+    {
+        it->second.closed = true;
+    }
+}
+
+bool CziDirectoryWatcher::take_ready(string &name)
+{
+    Clock::time_point now = Clock::now();
+    int bestSequenceNum = INT_MAX;
+    string best;
+
+    for (auto it = pending.begin(); it != pending.end(); )
+    {
+        struct stat st;
+        if (stat((dir + it->first).c_str(), &st) != 0)
+        {
+            // removed or renamed away before it was complete
+            it = pending.erase(it);
+            continue;
+        }
+
+        Pending &p = it->second;
+        if (st.st_size != p.size)
+        {
+            p.size = st.st_size;
+            p.changed = now;
+            lastActivity = now;
+        }
+
+        bool settled = now - p.changed >= chrono::seconds(settleSeconds);
+        int sequenceNum;
+        czi_file_sequence_number(it->first, sequenceNum);
+        if ((p.closed || settled) && sequenceNum < bestSequenceNum)
+        {
+            if (czi_file_complete(dir + it->first))
+            {
+                bestSequenceNum = sequenceNum;
+                best = it->first;
+            }
+            else
+            {
+                // still being written, check again after another settle period
+                p.closed = false;
+                p.changed = now;
+            }
+        }
+        ++it;
+    }
+
+    if (best.empty())
+        return false;
+
+    pending.erase(best);
+    handedOut.insert(best);
+    lastActivity = now;
+    name = best;
+    return true;
+}
+
+bool CziDirectoryWatcher::next(string &name, int idleSeconds)
+{
+    while (true)
+    {
+        if (Clock::now() - lastRescan >= chrono::seconds(settleSeconds))
+            rescan();
+        if (take_ready(name))
+            return true;
+        if (idleSeconds > 0 && Clock::now() - lastActivity >= chrono::seconds(idleSeconds))
+            return false;
+        read_events(1000);
+    }
+}
@@ -0,0 +1,217 @@
+//! \file iogovernor.cpp
+//! \brief Adaptive, optionally lock file shared, limit on the reads in flight.
+
+#include "iogovernor.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+using namespace std;
+
+// a window needs this long before its bandwidth is compared, shorter ones mostly measure the page cache
+static const double IOGOVERNOR_WINDOW_SECONDS = 1.0;
+// steady windows before probing one more read
+static const int IOGOVERNOR_PROBE_WINDOWS = 4;
+
+void add_io_options(CLI::App *sub, ioOptions &opt)
+{
+    sub->add_option("--io-max", opt.max_reads, "Most input files read at the same time by this process; the "
+                    "limit adapts to the measured read bandwidth up to this many (Default: the number of jobs)");
+    sub->add_option("--io-slots", opt.shared_slots, "Input files read at the same time by all the processes "
+                    "sharing the lock file, e.g. the jobs of an array on several nodes (Default: 0, no limit)");
+    sub->add_option("--io-lock", opt.lock_file, "Lock file of --io-slots, on a file system all the processes see "
+                    "(Default: .lsp-io.lock in the output directory)");
+}
+
+IoGovernor::IoGovernor(ioOptions const &opt, int workers, string const &outputDir)
+: maxReads(opt.max_reads > 0 ? opt.max_reads : max(1, workers)),
+  sharedSlots(max(0, opt.shared_slots)), verbose(opt.verbose), lockFd(-1),
+  current(min(2, maxReads)), inFlight(0), heldShared(sharedSlots, false),
+  windowSeconds(0), windowBytes(0), windowReads(0), lastBandwidth(0), steadyWindows(0)
+{
+    if (!sharedSlots)
+        return;
+
+    lockFileName = opt.lock_file;
+    if (lockFileName.empty())
+    {
+        // the output directory may be created by the first worker only
+        mkdir(outputDir.c_str(), 0777);
+        lockFileName = outputDir + "/.lsp-io.lock";
+    }
+    lockFd = open(lockFileName.c_str(), O_RDWR | O_CREAT, 0666);
+    if (lockFd < 0)
+        throw LSPException("Could not open the I/O lock file " + lockFileName + ": " + strerror(errno) + "\n",
+                           "iogovernor.cpp", "IoGovernor::IoGovernor");
+}
+
+IoGovernor::~IoGovernor()
+{
+    // closing the file drops every lock the process holds on it
+    if (lockFd >= 0)
+        close(lockFd);
+}
+
+int IoGovernor::begin_read()
+{
+    bool shared;
+    {
+        unique_lock<mutex> guard(lock);
+        slotCond.wait(guard, [this]() { return inFlight < current; });
+        if (!inFlight)
+            busyStart = chrono::steady_clock::now();
+        inFlight++;
+        // another worker may have given up the shared slots meanwhile
+        shared = sharedSlots > 0;
+    }
+    return shared ? take_shared_slot() : -1;
+}
+
+int IoGovernor::take_shared_slot()
+{
+    int wait_ms = 50;
+    for (;;)
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            if (!sharedSlots)
+                return -1;
+            for (int s = 0; s < sharedSlots; s++)
+            {
+                if (heldShared[s])
+                    continue;
+                struct flock fl;
+                memset(&fl, 0, sizeof(fl));
+                fl.l_type = F_WRLCK;
+                fl.l_whence = SEEK_SET;
+                fl.l_start = s;
+                fl.l_len = 1;
+                if (fcntl(lockFd, F_SETLK, &fl) == 0)
+                {
+                    heldShared[s] = true;
+                    return s;
+                }
+                if (errno != EACCES && errno != EAGAIN)
+                {
+                    // e.g. a file system without POSIX locks; coordinating is a courtesy, reading is the job
+                    cerr << "I/O lock on " << lockFileName << " failed: " << strerror(errno)
+                         << ", reading without shared slots" << endl;
+                    sharedSlots = 0;
+                    return -1;
+                }
+            }
+        }
+        this_thread::sleep_for(chrono::milliseconds(wait_ms));
+        wait_ms = min(2 * wait_ms, 1000);
+    }
+}
+
+void IoGovernor::end_read(int sharedSlot, size_t bytes)
+{
+    lock_guard<mutex> guard(lock);
+    if (sharedSlot >= 0 && sharedSlot < (int)heldShared.size() && heldShared[sharedSlot])
+    {
+        struct flock fl;
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = F_UNLCK;
+        fl.l_whence = SEEK_SET;
+        fl.l_start = sharedSlot;
+        fl.l_len = 1;
+        fcntl(lockFd, F_SETLK, &fl);
+        heldShared[sharedSlot] = false;
+    }
+
+    inFlight--;
+    if (!inFlight)
+        windowSeconds += chrono::duration<double>(chrono::steady_clock::now() - busyStart).count();
+    // skipped inputs say nothing about the storage
+    if (bytes)
+    {
+        windowBytes += bytes;
+        windowReads++;
+        adapt();
+    }
+    slotCond.notify_all();
+}
+
+void IoGovernor::adapt()
+{
+    // called with the lock held
+    auto now = chrono::steady_clock::now();
+    double seconds = windowSeconds;
+    if (inFlight)
+        seconds += chrono::duration<double>(now - busyStart).count();
+    if (windowReads < max(current, 2) || seconds < IOGOVERNOR_WINDOW_SECONDS)
+        return;
+
+    double bandwidth = windowBytes / seconds / (1024 * 1024);
+    int previous = current;
+    if (lastBandwidth <= 0 || bandwidth >= 1.1 * lastBandwidth)
+    {
+        // more reads still paid off (or this is the first window): keep adding them
+        current = min(current + 1, maxReads);
+        steadyWindows = 0;
+    }
+    else if (bandwidth <= 0.75 * lastBandwidth)
+    {
+        // the storage is saturated, by us or by others
+        current = max(current / 2, 1);
+        steadyWindows = 0;
+    }
+    else if (++steadyWindows >= IOGOVERNOR_PROBE_WINDOWS)
+    {
+        current = min(current + 1, maxReads);
+        steadyWindows = 0;
+    }
+
+    if (verbose && current != previous)
+        cout << "I/O: " << bandwidth << " MB/s with " << previous << " reads in flight, allowing " << current << endl;
+
+    lastBandwidth = bandwidth;
+    windowSeconds = 0;
+    windowBytes = 0;
+    windowReads = 0;
+    if (inFlight)
+        busyStart = now;
+}
+
+int IoGovernor::limit() const
+{
+    lock_guard<mutex> guard(lock);
+    return current;
+}
+
+double IoGovernor::bandwidth() const
+{
+    lock_guard<mutex> guard(lock);
+    return lastBandwidth;
+}
+
+IoGovernor::Read::Read(IoGovernor *governor)
+: governor(governor), sharedSlot(-1), held(governor != nullptr)
+{
+    if (governor)
+        sharedSlot = governor->begin_read();
+}
+
+IoGovernor::Read::~Read()
+{
+    // an exception left the read unfinished
+    if (held)
+        governor->end_read(sharedSlot, 0);
+}
+
+void IoGovernor::Read::done(size_t bytes)
+{
+    if (!held)
+        return;
+    held = false;
+    governor->end_read(sharedSlot, bytes);
+}
@@ -20,6 +20,7 @@
 #include "start.h"
 #include "start_with_corr.h"
 #include "resamp.h"
+#include "tproj.h"
 
 
 int main(int argc, char** argv) {
@@ -37,6 +38,8 @@ int main(int argc, char** argv) {
     setup_proj(app);
     // Create animations from projection files
     setup_anim(app);
+    // Max, mean and variance of the projection files over time
+    setup_tproj(app);
     
     // Creates line graph summary of nhdr files
     setup_nhdr_check(app);
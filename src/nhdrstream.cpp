@@ -0,0 +1,217 @@
+//! \file nhdrstream.cpp
+//! \brief Reads the volume of an nhdr file a slab of planes at a time, straight from its data files.
+
+#include "nhdrstream.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+// value of the header line "line" if it is the field "name" (or its spelling without spaces)
+static bool nhdr_field(string const &line, string const &name, string &value)
+{
+    string squeezed = name;
+    squeezed.erase(remove(squeezed.begin(), squeezed.end(), ' '), squeezed.end());
+    for (string const &n : {name, squeezed})
+        if (line.compare(0, n.size() + 1, n + ":") == 0)
+        {
+            size_t start = line.find_first_not_of(" \t", n.size() + 1);
+            value = start == string::npos ? string() : line.substr(start);
+            return true;
+        }
+    return false;
+}
+
+NhdrSlabReader::NhdrSlabReader(string const &nhdrName)
+: nhdr(nullptr), mop(airMopNew()), canStream(false), planeBytes(0), chunkBytes(0)
+{
+    // everything but the data, which teem would read whole
+    nhdr = safe_nrrd_new(mop, (airMopper)nrrdNuke);
+    NrrdIoState *nio = nrrdIoStateNew();
+    airMopAdd(mop, nio, (airMopper)nrrdIoStateNix, airMopAlways);
+    nio->skipData = AIR_TRUE;
+    nrrd_checker(nrrdLoad(nhdr, nhdrName.c_str(), nio), mop, "Error reading header:\n",
+                 "nhdrstream.cpp", "NhdrSlabReader::NhdrSlabReader");
+
+    planeBytes = nrrdElementSize(nhdr);
+    for (unsigned int i = 0; i + 1 < nhdr->dim; i++)
+        planeBytes *= nhdr->axis[i].size;
+
+    fs::path nhdrPath(nhdrName);
+    dir = nhdrPath.has_parent_path() ? nhdrPath.parent_path().string() : ".";
+    parse_data_files(nhdrName);
+}
+
+NhdrSlabReader::~NhdrSlabReader()
+{
+    for (int fd : fds)
+        close(fd);
+    airMopOkay(mop);
+}
+
+size_t NhdrSlabReader::planes() const
+{
+    return nhdr->dim ? nhdr->axis[nhdr->dim - 1].size : 0;
+}
+
+void NhdrSlabReader::parse_data_files(string const &nhdrName)
+{
+    ifstream in(nhdrName);
+    if (!in)
+        throw LSPException("Could not open " + nhdrName + "\n", "nhdrstream.cpp", "NhdrSlabReader::parse_data_files");
+
+    size_t volumeBytes = planeBytes * planes();
+    uint16_t one = 1;
+    bool littleHost = *(const unsigned char*)&one == 1;
+    long byteSkip = 0;
+    string line, value, dataFile;
+    while (getline(in, line))
+    {
+        if (line.empty())
+        {
+            whyNot = "the data is attached to the header";
+            return;
+        }
+        if (nhdr_field(line, "encoding", value) && value != "raw")
+        {
+            whyNot = "the data is " + value + " encoded";
+            return;
+        }
+        if (nhdr_field(line, "endian", value) && nrrdElementSize(nhdr) > 1 && (value == "little") != littleHost)
+        {
+            whyNot = "the data is " + value + " endian";
+            return;
+        }
+        if (nhdr_field(line, "line skip", value) && atol(value.c_str()) != 0)
+        {
+            whyNot = "the data file has a line skip";
+            return;
+        }
+        if (nhdr_field(line, "byte skip", value))
+            byteSkip = atol(value.c_str());
+        // it is the last field, lists of data files follow it
+        if (nhdr_field(line, "data file", dataFile))
+            break;
+    }
+    if (dataFile.empty())
+    {
+        whyNot = "the header has no data file";
+        return;
+    }
+
+    istringstream field(dataFile);
+    string kind;
+    field >> kind;
+    if (kind == "SKIPLIST")
+    {
+        unsigned int subdim = 0;
+        field >> subdim;
+        if (!subdim || subdim > nhdr->dim)
+            throw LSPException("Bad SKIPLIST dimension in " + nhdrName + "\n", "nhdrstream.cpp", "NhdrSlabReader::parse_data_files");
+        chunkBytes = nrrdElementSize(nhdr);
+        for (unsigned int i = 0; i < subdim; i++)
+            chunkBytes *= nhdr->axis[i].size;
+        while (getline(in, line))
+        {
+            if (line.empty())
+                continue;
+            istringstream entry(line);
+            long skip;
+            string name;
+            if (!(entry >> skip) || skip < 0 || !getline(entry >> ws, name) || name.empty())
+                throw LSPException("Bad SKIPLIST line \"" + line + "\" in " + nhdrName + "\n",
+                                   "nhdrstream.cpp", "NhdrSlabReader::parse_data_files");
+            chunks.push_back(Chunk{open_data_file(name), (size_t)skip});
+        }
+        if (chunks.size() * chunkBytes != volumeBytes)
+            throw LSPException("SKIPLIST of " + nhdrName + " lists " + to_string(chunks.size()) + " pieces instead of "
+                               + to_string(chunkBytes ? volumeBytes / chunkBytes : 0) + "\n",
+                               "nhdrstream.cpp", "NhdrSlabReader::parse_data_files");
+    }
+    else if (kind == "LIST" || dataFile.find('%') != string::npos)
+    {
+        whyNot = "the data is listed as separate files";
+        return;
+    }
+    else
+    {
+        // one file holding the whole volume, a byte skip of -1 puts it at the end
+        int file = open_data_file(dataFile);
+        size_t offset = (size_t)byteSkip;
+        if (byteSkip < 0)
+        {
+            off_t size = lseek(fds[file], 0, SEEK_END);
+            if (byteSkip != -1 || size < (off_t)volumeBytes)
+                throw LSPException("Bad byte skip in " + nhdrName + "\n", "nhdrstream.cpp", "NhdrSlabReader::parse_data_files");
+            offset = (size_t)size - volumeBytes;
+        }
+        chunkBytes = volumeBytes;
+        chunks.push_back(Chunk{file, offset});
+    }
+    canStream = chunkBytes > 0;
+}
+
+// index of the data file "name" in fds, opened when it is new
+int NhdrSlabReader::open_data_file(string const &name)
+{
+    for (size_t i = 0; i < fileNames.size(); i++)
+        if (fileNames[i] == name)
+            return (int)i;
+
+    fs::path path(name);
+    if (path.is_relative())
+        path = fs::path(dir) / path;
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd < 0)
+        throw LSPException("Could not open data file " + path.string() + ": " + strerror(errno) + "\n",
+                           "nhdrstream.cpp", "NhdrSlabReader::open_data_file");
+    // the planes are read front to back
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    fileNames.push_back(name);
+    fds.push_back(fd);
+    return (int)fds.size() - 1;
+}
+
+void NhdrSlabReader::read_planes(size_t z0, size_t count, void *buffer)
+{
+    if (!canStream)
+        throw LSPException("The volume cannot be streamed: " + whyNot + "\n", "nhdrstream.cpp", "NhdrSlabReader::read_planes");
+    if (z0 + count > planes())
+        throw LSPException("Planes " + to_string(z0) + " to " + to_string(z0 + count) + " are outside the volume\n",
+                           "nhdrstream.cpp", "NhdrSlabReader::read_planes");
+
+    size_t begin = z0 * planeBytes, end = (z0 + count) * planeBytes;
+    unsigned char *out = (unsigned char*)buffer;
+    for (size_t k = begin / chunkBytes; begin < end; k++)
+    {
+        // the part of chunk k in [begin, end)
+        size_t inChunk = begin - k * chunkBytes;
+        size_t length = min(end, (k + 1) * chunkBytes) - begin;
+        int fd = fds[chunks[k].file];
+        size_t done = 0;
+        while (done < length)
+        {
+            ssize_t got = pread(fd, out + done, length - done, (off_t)(chunks[k].offset + inChunk + done));
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                throw LSPException("Could not read " + fileNames[chunks[k].file] + ": "
+                                   + (got < 0 ? string(strerror(errno)) : string("file too short")) + "\n",
+                                   "nhdrstream.cpp", "NhdrSlabReader::read_planes");
+            done += got;
+        }
+        out += length;
+        begin += length;
+    }
+}
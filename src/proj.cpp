@@ -4,16 +4,24 @@
 #include "proj.h"
 #include "util.h"
 #include "skimczi.h"
+#include "cziintegrity.h"
+#include "czipyramid.h"
+#include "projengine.h"
+#include "projslab.h"
+#include "nhdrstream.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/range/iterator_range.hpp>
 
 // these are used while iterating filesystem
 #include <dirent.h>
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <vector>
 #include <memory>
+#include <future>
+#include <omp.h>
 
 #include <chrono> 
 
@@ -32,9 +40,37 @@ void setup_proj(CLI::App &app)
     sub->add_option("-i, --nhdr_path", opt->nhdr_path, "Input nhdr file path")->required();
     sub->add_option("-o, --proj_path", opt->proj_path, "Where to output projection files")->required();
     sub->add_option("-v, --verbose", opt->verbose, "Turn on (1) or off (0) debug messages, by default turned off");
+    sub->add_option("-l, --level", opt->level, "Project the 2^level times downsampled volumes of skim --pyramid, or the finest level "
+                                              "below it that exists, instead of the full resolution data (Default: 0)");
+    sub->add_option("-m, --mem-limit", opt->mem_limit, "Read the volumes a slab of z planes at a time, using about this many MB "
+                                                     "however large they are, instead of loading them whole (Default: 0, load them)");
+    sub->add_option("--measures", opt->measures, "Comma separated projections stacked along the proj axis of every output: "
+                                                "max, mean, sum, min, std, percentiles like p95 and argmax, the plane index of the max (Default: max,mean)");
+    sub->add_option("--slab", opt->slab, "Also write NNN-slabXY.nrrd, the stack of max projections of this many z planes "
+                                        "(Default: 0, none)");
+    sub->add_option("--stride", opt->slab_stride, "Planes from one --slab projection to the next, less than --slab for "
+                                                "overlapping slabs (Default: --slab)");
+    sub->add_option("-j, --jobs", opt->jobs, "Number of volumes projected in parallel in directory mode (Default: 1)");
+    add_io_options(sub, opt->io);
 
     sub->set_callback([opt]() 
     {
+        opt->io.verbose = opt->verbose;
+        if (opt->slab < 0 || opt->slab_stride < 0)
+        {
+            cout << "ERROR: --slab and --stride can't be negative" << endl;
+            return;
+        }
+        // a typo in the measures should stop us before the first volume, not fail every one of them
+        try
+        {
+            proj_parse_measures(opt->measures);
+        }
+        catch(LSPException &e)
+        {
+            std::cerr << "Exception thrown by " << e.get_func() << "() in " << e.get_file() << ": " << e.what() << std::endl;
+            return;
+        }
         // vector of pairs which stores each nhdr file's name and its extracted serial number
         vector< pair<int, string> > allValidFiles;
 
@@ -112,11 +148,25 @@ void setup_proj(CLI::App &app)
                 cout << "ERROR: Not all valid files have been recorded" << endl;
             }
 
+            // timepoints skim found damaged are left out, see the integrity manifest
+            nhdrNum -= skip_damaged_timepoints(opt->nhdr_path, allValidFiles);
+
             // update file number
             opt->file_number = nhdrNum;
             cout << "Starting second loop for processing" << endl << endl;
 
-            // another loop to process files
+            // another loop to process files, on a pool of workers when asked to
+            if (!checkIfDirectory(opt->proj_path))
+            {
+                cout << opt->proj_path << " does not exist, but has been created" << endl;
+                boost::filesystem::create_directory(opt->proj_path);
+            }
+            int jobs = max(1, min(opt->jobs, (int)allValidFiles.size()));
+            IoGovernor governor(opt->io, jobs, opt->proj_path);
+            if (jobs > 1)
+                cout << "Projecting with " << jobs << " workers" << endl << endl;
+
+            #pragma omp parallel for schedule(dynamic, 1) num_threads(jobs)
             for (int i = 0; i < allValidFiles.size(); i++)
             {   
                 string proj_common = opt->proj_path + allValidFiles[i].second + "-proj";
@@ -129,32 +179,48 @@ void setup_proj(CLI::App &app)
                 fs::path projPath_2(proj_name_2);
                 fs::path projPath_3(proj_name_3);
 
+                // the slab stack, when asked for, has to be there as well
+                string slab_name = opt->proj_path + allValidFiles[i].second + "-slabXY.nrrd";
+                bool slabDone = !opt->slab || fs::exists(slab_name);
+
                 // when all three exists, skip this file
-                if (fs::exists(projPath_1) && fs::exists(projPath_2) && fs::exists(proj_name_3))
+                if (fs::exists(projPath_1) && fs::exists(projPath_2) && fs::exists(proj_name_3) && slabDone)
                 {
-                    cout << "All " << proj_name_1 << ", " << proj_name_2 << ", " << proj_name_3 << " exist, continue to next." << endl;
-                    opt->number_of_processed++;
-                    cout << opt->number_of_processed << " out of " << opt->file_number << " files have been processed" << endl << endl;
+                    #pragma omp critical(proj_progress)
+                    {
+                        cout << "All " << proj_name_1 << ", " << proj_name_2 << ", " << proj_name_3 << " exist, continue to next." << endl;
+                        opt->number_of_processed++;
+                        cout << opt->number_of_processed << " out of " << opt->file_number << " files have been processed" << endl << endl;
+                    }
                     continue;
                 }
 
-                // note that file name from allValidFiles does not include nhdr path
-                opt->file_name = allValidFiles[i].second + ".nhdr";
+                // every worker gets its own copy of the options, note that file name from allValidFiles does not include nhdr path
+                projOptions fileOpt = *opt;
+                fileOpt.file_name = allValidFiles[i].second + ".nhdr";
+                fileOpt.governor = &governor;
                 try
                 {
                     auto start = chrono::high_resolution_clock::now();
-                    Proj(*opt).main();
+                    Proj(fileOpt).main();
                     auto stop = chrono::high_resolution_clock::now(); 
                     auto duration = chrono::duration_cast<chrono::seconds>(stop - start); 
-                    opt->number_of_processed++;
-                    cout << opt->number_of_processed << " out of " << opt->file_number << " files have been processed" << endl;
-                    cout << "Processing " << opt->file_name << " took " << duration.count() << " seconds" << endl << endl; 
+                    #pragma omp critical(proj_progress)
+                    {
+                        opt->number_of_processed++;
+                        cout << opt->number_of_processed << " out of " << opt->file_number << " files have been processed" << endl;
+                        cout << "Processing " << fileOpt.file_name << " took " << duration.count() << " seconds" << endl << endl; 
+                    }
                 }
                 catch(LSPException &e)
                 {
+                    #pragma omp critical(proj_progress)
                     std::cerr << "Exception thrown by " << e.get_func() << "() in " << e.get_file() << ": " << e.what() << std::endl;
                 }
             }
+            if (jobs > 1 && opt->verbose)
+                cout << "Read bandwidth " << governor.bandwidth() << " MB/s with up to " << governor.limit()
+                     << " volumes read at the same time" << endl;
         }
         // single file case
         else
@@ -182,7 +248,10 @@ void setup_proj(CLI::App &app)
                 try 
                 {
                     auto start = chrono::high_resolution_clock::now();
+                    IoGovernor governor(opt->io, 1, opt->proj_path);
+                    opt->governor = &governor;
                     Proj(*opt).main();
+                    opt->governor = nullptr;
                     auto stop = chrono::high_resolution_clock::now(); 
                     auto duration = chrono::duration_cast<chrono::seconds>(stop - start); 
                     cout << "Processing " << opt->file_name << " took " << duration.count() << " seconds" << endl; 
@@ -198,7 +267,7 @@ void setup_proj(CLI::App &app)
 }
 
 
-Proj::Proj(projOptions const &opt): opt(opt), mop(airMopNew()) 
+Proj::Proj(projOptions const &opt): opt(opt), measures(proj_parse_measures(opt.measures)), mop(airMopNew()) 
 {
     if (!checkIfDirectory(opt.proj_path))
     {
@@ -206,8 +275,9 @@ Proj::Proj(projOptions const &opt): opt(opt), mop(airMopNew())
         boost::filesystem::create_directory(opt.proj_path);
     }
 
-    // if the number of file is 1 (single file since count starts at 1), use absolute name
-    if (opt.file_number == 1)
+    // a single nhdr file is projected by its own name; the number of files is no guide, since a directory
+    // may be down to one timepoint once the damaged ones are skipped
+    if (!checkIfDirectory(opt.nhdr_path))
     {
         nhdr_name = opt.nhdr_path;
         // in this case we keep the proj file name same as nhdr base name
@@ -233,6 +303,8 @@ Proj::Proj(projOptions const &opt): opt(opt), mop(airMopNew())
         string sequenceNumString = curFile.substr(start, length);
         proj_common = opt.proj_path + sequenceNumString + "-proj";
     }
+    // NNN-slabXY.nrrd next to NNN-projXY.nrrd
+    slab_name = proj_common.substr(0, proj_common.size() - 5) + "-slabXY.nrrd";
 }
 
 
@@ -248,20 +320,38 @@ void Proj::main(){
     if (verbose)
         cout << "Start Proj::main()" << endl;
 
-    // load input nhdr header file
-    Nrrd* nin = safe_nrrd_load(mop, nhdr_name);
+    // load input nhdr header file, or one of its downsampled levels
+    string input_name = czi_pyramid_pick(nhdr_name, opt.level);
+    if (input_name != nhdr_name)
+        cout << "Projecting " << input_name << " instead of " << nhdr_name << endl;
 
-    //xy proj
     Nrrd* nproj_xy = safe_nrrd_new(mop, (airMopper)nrrdNuke);
-    Nrrd* nproj_xy_t[2] = {safe_nrrd_new(mop, (airMopper)nrrdNuke),
-                            safe_nrrd_new(mop, (airMopper)nrrdNuke)};
-        
-    std::string xy = proj_common + "XY.nrrd";
+    Nrrd* nproj_xz = safe_nrrd_new(mop, (airMopper)nrrdNuke);
+    Nrrd* nproj_yz = safe_nrrd_new(mop, (airMopper)nrrdNuke);
+    Nrrd* nslab = opt.slab > 0 ? safe_nrrd_new(mop, (airMopper)nrrdNuke) : nullptr;
+    // with a memory limit the volume is read slab by slab, if its data files allow it
+    bool streamed = opt.mem_limit > 0 && project_streamed(input_name, nproj_xy, nproj_xz, nproj_yz, nslab);
+    if (!streamed)
+    {
+        IoGovernor::Read read(opt.governor);
+        Nrrd* nin = safe_nrrd_load(mop, input_name);
+        read.done(nrrdElementNumber(nin) * nrrdElementSize(nin));
+        project_loaded(nin, nproj_xy, nproj_xz, nproj_yz, nslab);
+    }
 
-    nrrd_checker(nrrdProject(nproj_xy_t[0], nin, 3, nrrdMeasureMax, nrrdTypeFloat) ||
-                    nrrdProject(nproj_xy_t[1], nin, 3, nrrdMeasureMean, nrrdTypeFloat) ||
-                    nrrdJoin(nproj_xy, nproj_xy_t, 2, 3, 1), mop, "Error building XY projection:\n", "proj.cpp", "Proj::main");
+    // the measures along the proj axis are only spelled out when they are not the usual max and mean
+    if (opt.measures != PROJ_DEFAULT_MEASURES)
+    {
+        string names;
+        for (ProjMeasure const &m : measures)
+            names += (names.empty() ? "" : ",") + proj_measure_name(m);
+        for (Nrrd *nproj : {nproj_xy, nproj_xz, nproj_yz})
+            nrrd_checker(nrrdKeyValueAdd(nproj, "measures", names.c_str()),
+                         mop, "Error adding measures to projection:\n", "proj.cpp", "Proj::main");
+    }
 
+    //xy proj
+    std::string xy = proj_common + "XY.nrrd";
     nrrdAxisInfoSet_va(nproj_xy, nrrdAxisInfoLabel, "x", "y", "c", "proj");
     // save
     nrrd_checker(nrrdSave(xy.c_str(), nproj_xy, nullptr),
@@ -271,16 +361,7 @@ void Proj::main(){
     cout << "X-Y Projection file has been saved to " << xy << endl;
 
     //xz proj
-    unsigned int permute[4] = {0, 2, 1, 3}; //same permute array for xz and yz coincidently
     std::string xz = proj_common + "XZ.nrrd";
-    Nrrd* nproj_xz = safe_nrrd_new(mop, (airMopper)nrrdNuke);
-    Nrrd* nproj_xz_t[2] = {safe_nrrd_new(mop, (airMopper)nrrdNuke),
-                            safe_nrrd_new(mop, (airMopper)nrrdNuke)};
-    nrrd_checker(nrrdProject(nproj_xz_t[0], nin, 1, nrrdMeasureMax, nrrdTypeFloat) ||
-                    nrrdProject(nproj_xz_t[1], nin, 1, nrrdMeasureMean, nrrdTypeFloat) ||
-                    nrrdJoin(nproj_xz, nproj_xz_t, 2, 3, 1) ||
-                    nrrdAxesPermute(nproj_xz, nproj_xz, permute), mop, "Error building XZ projection:\n", "proj.cpp", "Proj::main");
-
     nrrdAxisInfoSet_va(nproj_xz, nrrdAxisInfoLabel, "x", "z", "c", "proj");
     // save
     nrrd_checker(nrrdSave(xz.c_str(), nproj_xz, nullptr),
@@ -289,16 +370,7 @@ void Proj::main(){
     cout << "X-Z Projection file has been saved to " << xz << endl;
 
     //yz proj
-    Nrrd* nproj_yz = safe_nrrd_new(mop, (airMopper)nrrdNuke);
-    Nrrd* nproj_yz_t[2] = {safe_nrrd_new(mop, (airMopper)nrrdNuke),
-                            safe_nrrd_new(mop, (airMopper)nrrdNuke)};
     std::string yz = proj_common + "YZ.nrrd";
-    nrrd_checker(nrrdProject(nproj_yz_t[0], nin, 0, nrrdMeasureMax, nrrdTypeFloat) ||
-                    nrrdProject(nproj_yz_t[1], nin, 0, nrrdMeasureMean, nrrdTypeFloat) ||
-                    nrrdJoin(nproj_yz, nproj_yz_t, 2, 3, 1) ||
-                    nrrdAxesPermute(nproj_yz, nproj_yz, permute),
-                mop, "Error building YZ projection:\n", "proj.cpp", "Proj::main");
-
     nrrdAxisInfoSet_va(nproj_yz, nrrdAxisInfoLabel, "y", "z", "c", "proj");
 
     // save
@@ -308,4 +380,156 @@ void Proj::main(){
 
     cout << "Y-Z Projection file has been saved to " << yz << endl;
 
+    //xy slab stack
+    if (nslab)
+    {
+        nrrdAxisInfoSet_va(nslab, nrrdAxisInfoLabel, "x", "y", "c", "slab");
+        nrrd_checker(nrrdSave(slab_name.c_str(), nslab, nullptr),
+                    mop, "Error saving XY slab projections:\n", "proj.cpp", "Proj::main");
+
+        cout << "X-Y slab projection file has been saved to " << slab_name << endl;
+    }
+}
+
+
+// the projections of the loaded volume "nin"
+void Proj::project_loaded(Nrrd *nin, Nrrd *nproj_xy, Nrrd *nproj_xz, Nrrd *nproj_yz, Nrrd *nslab)
+{
+    if (ProjEngine::supports(nin))
+    {
+        // all six projections in one pass over the volume
+        ProjEngine engine(nin->type, nin->axis[0].size, nin->axis[1].size, nin->axis[2].size, nin->axis[3].size,
+                          nproj_xy, nproj_xz, nproj_yz, measures);
+        engine.add_slab(nin->data, 0, nin->axis[3].size);
+        engine.finish(nin);
+        if (nslab)
+        {
+            ProjSlabStack stack(nin->type, nin->axis[0].size, nin->axis[1].size, nin->axis[2].size, nin->axis[3].size,
+                                opt.slab, opt.slab_stride, nslab);
+            stack.add_slab(nin->data, 0, nin->axis[3].size);
+            stack.finish(nin);
+        }
+    }
+    else
+    {
+        if (nslab)
+            throw LSPException("Slab projections need an x-y-c-z volume of 8-bit, 16-bit or float values\n",
+                               "proj.cpp", "Proj::project_loaded");
+        project_teem(nin, nproj_xy, nproj_xz, nproj_yz);
+    }
+}
+
+
+// the projections of "input_name" read a slab of z planes at a time within opt.mem_limit MB, while the
+// next slab is read the current one is projected; false when the volume has to be loaded instead
+bool Proj::project_streamed(string const &input_name, Nrrd *nproj_xy, Nrrd *nproj_xz, Nrrd *nproj_yz, Nrrd *nslab)
+{
+    NhdrSlabReader reader(input_name);
+    Nrrd const *header = reader.header();
+    if (!reader.streamable() || !ProjEngine::supports(header))
+    {
+        cout << "Can't stream " << input_name << " (" << (reader.streamable() ? "not an x-y-c-z volume of 8-bit, 16-bit or float"
+             : reader.why_not()) << "), loading it whole" << endl;
+        return false;
+    }
+
+    size_t sizeX = header->axis[0].size, sizeY = header->axis[1].size;
+    size_t sizeC = header->axis[2].size, sizeZ = header->axis[3].size;
+    size_t planeBytes = reader.plane_bytes();
+
+    // the outputs with the accumulators of the first thread, the accumulators of every further thread,
+    // and two slab buffers
+    size_t budget = (size_t)opt.mem_limit << 20;
+    size_t fixedBytes = ProjEngine::fixed_bytes(sizeX, sizeY, sizeC, sizeZ, measures);
+    if (nslab)
+        fixedBytes += ProjSlabStack::bytes(sizeX, sizeY, sizeC, sizeZ, opt.slab, opt.slab_stride);
+    size_t threadBytes = ProjEngine::thread_bytes(sizeX, sizeY, sizeC, measures);
+    int threads = omp_in_parallel() ? 1 : omp_get_max_threads();
+    if (budget < fixedBytes + 2 * planeBytes)
+    {
+        cout << "WARNING: projecting " << input_name << " needs at least "
+             << ((fixedBytes + 2 * planeBytes) >> 20) + 1 << " MB, more than --mem-limit" << endl;
+        threads = 1;
+    }
+    else
+        threads = max(1, min(threads, (int)((budget - fixedBytes + threadBytes) / (threadBytes + 2 * planeBytes))));
+    size_t left = budget > fixedBytes + (threads - 1) * threadBytes ? budget - fixedBytes - (threads - 1) * threadBytes : 0;
+    size_t slabPlanes = min(sizeZ, max((size_t)threads, left / (2 * planeBytes)));
+    if (opt.verbose)
+        cout << "Streaming " << input_name << " in slabs of " << slabPlanes << " of " << sizeZ << " planes on "
+             << threads << " threads" << endl;
+
+    ProjEngine engine(header->type, sizeX, sizeY, sizeC, sizeZ, nproj_xy, nproj_xz, nproj_yz, measures, threads);
+    unique_ptr<ProjSlabStack> stack;
+    if (nslab)
+        stack.reset(new ProjSlabStack(header->type, sizeX, sizeY, sizeC, sizeZ, opt.slab, opt.slab_stride, nslab, threads));
+    vector<unsigned char> slabs[2] = {vector<unsigned char>(slabPlanes * planeBytes),
+                                      vector<unsigned char>(slabPlanes * planeBytes)};
+    IoGovernor *governor = opt.governor;
+    auto readSlab = [&reader, &slabs, governor, planeBytes](int b, size_t z0, size_t count)
+    {
+        IoGovernor::Read read(governor);
+        reader.read_planes(z0, count, slabs[b].data());
+        read.done(count * planeBytes);
+    };
+
+    future<void> pending = async(launch::async, readSlab, 0, (size_t)0, min(slabPlanes, sizeZ));
+    int b = 0;
+    for (size_t z0 = 0; z0 < sizeZ; z0 += slabPlanes, b ^= 1)
+    {
+        size_t count = min(slabPlanes, sizeZ - z0);
+        pending.get();
+        if (z0 + count < sizeZ)
+            pending = async(launch::async, readSlab, b ^ 1, z0 + count, min(slabPlanes, sizeZ - z0 - count));
+        engine.add_slab(slabs[b].data(), z0, count);
+        if (stack)
+            stack->add_slab(slabs[b].data(), z0, count);
+    }
+    engine.finish(header);
+    if (stack)
+        stack->finish(header);
+    return true;
+}
+
+
+// the measures along every axis with nrrdProject, for volumes the projection engine cannot read
+void Proj::project_teem(Nrrd *nin, Nrrd *nproj_xy, Nrrd *nproj_xz, Nrrd *nproj_yz)
+{
+    vector<int> teemMeasures;
+    for (ProjMeasure const &m : measures)
+        switch (m.kind)
+        {
+            case PROJ_MEASURE_MAX: teemMeasures.push_back(nrrdMeasureMax); break;
+            case PROJ_MEASURE_MEAN: teemMeasures.push_back(nrrdMeasureMean); break;
+            case PROJ_MEASURE_SUM: teemMeasures.push_back(nrrdMeasureSum); break;
+            case PROJ_MEASURE_MIN: teemMeasures.push_back(nrrdMeasureMin); break;
+            case PROJ_MEASURE_STD: teemMeasures.push_back(nrrdMeasureSD); break;
+            default:
+                throw LSPException("Percentile and argmax projections need an x-y-c-z volume of 8-bit, 16-bit or float values\n",
+                                   "proj.cpp", "Proj::project_teem");
+        }
+
+    // one projection per measure along "axis", stacked along a new last axis
+    size_t count = teemMeasures.size();
+    auto project = [this, nin, &teemMeasures, count](Nrrd *nout, unsigned int axis) -> int
+    {
+        vector<Nrrd*> parts(count);
+        for (size_t m = 0; m < count; m++)
+        {
+            parts[m] = safe_nrrd_new(mop, (airMopper)nrrdNuke);
+            if (nrrdProject(parts[m], nin, axis, teemMeasures[m], nrrdTypeFloat))
+                return 1;
+        }
+        return nrrdJoin(nout, parts.data(), count, 3, 1);
+    };
+
+    nrrd_checker(project(nproj_xy, 3), mop, "Error building XY projection:\n", "proj.cpp", "Proj::project_teem");
+
+    unsigned int permute[4] = {0, 2, 1, 3}; //same permute array for xz and yz coincidently
+    nrrd_checker(project(nproj_xz, 1) ||
+                    nrrdAxesPermute(nproj_xz, nproj_xz, permute), mop, "Error building XZ projection:\n", "proj.cpp", "Proj::project_teem");
+
+    nrrd_checker(project(nproj_yz, 0) ||
+                    nrrdAxesPermute(nproj_yz, nproj_yz, permute),
+                mop, "Error building YZ projection:\n", "proj.cpp", "Proj::project_teem");
 }
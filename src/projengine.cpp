@@ -0,0 +1,594 @@
+//! \file projengine.cpp
+//! \brief All the projections lsp proj writes, computed in one pass over an x-y-c-z volume.
+
+#include "projengine.h"
+#include "projkernel.h"
+#include "pixeltraits.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+#include <omp.h>
+
+using namespace std;
+
+// floats of the P-square state of one pixel: the heights of the five markers, then the positions of
+// the inner three (the outer ones are always at the first and the last value)
+static const size_t PROJ_QUANTILE_STATE = 8;
+
+vector<ProjMeasure> proj_parse_measures(string const &list)
+{
+    vector<ProjMeasure> measures;
+    istringstream in(list);
+    string name;
+    while (getline(in, name, ','))
+    {
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t") + 1);
+        ProjMeasure m;
+        m.percentile = 0;
+        if (name == "max")
+            m.kind = PROJ_MEASURE_MAX;
+        else if (name == "mean")
+            m.kind = PROJ_MEASURE_MEAN;
+        else if (name == "sum")
+            m.kind = PROJ_MEASURE_SUM;
+        else if (name == "min")
+            m.kind = PROJ_MEASURE_MIN;
+        else if (name == "std")
+            m.kind = PROJ_MEASURE_STD;
+        else if (name == "argmax")
+            m.kind = PROJ_MEASURE_ARGMAX;
+        else
+        {
+            char *end = nullptr;
+            if (name.size() > 1 && name[0] == 'p')
+                m.percentile = strtod(name.c_str() + 1, &end);
+            if (!end || *end != '\0' || !(m.percentile > 0 && m.percentile < 100))
+                throw LSPException("Unknown projection measure \"" + name + "\", expected max, mean, sum, min, std, "
+                                   "argmax or pNN with 0 < NN < 100\n", "projengine.cpp", "proj_parse_measures");
+            m.kind = PROJ_MEASURE_PERCENTILE;
+        }
+        for (ProjMeasure const &other : measures)
+            if (other.kind == m.kind && other.percentile == m.percentile)
+                throw LSPException("Projection measure \"" + name + "\" is listed twice\n",
+                                   "projengine.cpp", "proj_parse_measures");
+        measures.push_back(m);
+    }
+    if (measures.empty())
+        throw LSPException("No projection measures given\n", "projengine.cpp", "proj_parse_measures");
+    return measures;
+}
+
+string proj_measure_name(ProjMeasure const &measure)
+{
+    switch (measure.kind)
+    {
+        case PROJ_MEASURE_MAX: return "max";
+        case PROJ_MEASURE_MEAN: return "mean";
+        case PROJ_MEASURE_SUM: return "sum";
+        case PROJ_MEASURE_MIN: return "min";
+        case PROJ_MEASURE_STD: return "std";
+        case PROJ_MEASURE_ARGMAX: return "argmax";
+        default:
+        {
+            ostringstream name;
+            name << "p" << measure.percentile;
+            return name.str();
+        }
+    }
+}
+
+// the "frac" quantile of the n values in "v", interpolated between the two closest ones; reorders "v"
+static float exact_quantile(float *v, size_t n, double frac)
+{
+    double pos = frac * (n - 1);
+    size_t lo = (size_t)pos;
+    nth_element(v, v + lo, v + n);
+    float below = v[lo];
+    if (lo + 1 >= n || pos == lo)
+        return below;
+    float above = *min_element(v + lo + 1, v + n);
+    return (float)(below + (pos - lo) * (above - below));
+}
+
+// add "v", the count-th value along z, to the P-square state "s" of the quantile "frac"; the first
+// five values are only collected
+static inline void quantile_add(float *s, float v, size_t count, float frac)
+{
+    if (count <= 5)
+    {
+        s[count - 1] = v;
+        if (count == 5)
+        {
+            sort(s, s + 5);
+            s[5] = 1;
+            s[6] = 2;
+            s[7] = 3;
+        }
+        return;
+    }
+
+    float *q = s;
+    float n[5] = {0, s[5], s[6], s[7], (float)(count - 2)};
+    int k;
+    if (v < q[0])
+    {
+        q[0] = v;
+        k = 0;
+    }
+    else if (v < q[1])
+        k = 0;
+    else if (v < q[2])
+        k = 1;
+    else if (v < q[3])
+        k = 2;
+    else
+    {
+        q[4] = max(q[4], v);
+        k = 3;
+    }
+    for (int i = k + 1; i < 5; i++)
+        n[i] += 1;
+
+    // move the inner markers towards where they should be by now, along the parabola through their
+    // neighbours if that keeps the heights in order, otherwise linearly
+    float last = (float)(count - 1);
+    float wanted[4] = {0, last * frac / 2, last * frac, last * (1 + frac) / 2};
+    for (int i = 1; i <= 3; i++)
+    {
+        float d = wanted[i] - n[i];
+        if ((d >= 1 && n[i + 1] - n[i] > 1) || (d <= -1 && n[i - 1] - n[i] < -1))
+        {
+            int step = d > 0 ? 1 : -1;
+            float parabolic = q[i] + step / (n[i + 1] - n[i - 1])
+                                     * ((n[i] - n[i - 1] + step) * (q[i + 1] - q[i]) / (n[i + 1] - n[i])
+                                        + (n[i + 1] - n[i] - step) * (q[i] - q[i - 1]) / (n[i] - n[i - 1]));
+            if (q[i - 1] < parabolic && parabolic < q[i + 1])
+                q[i] = parabolic;
+            else
+                q[i] += step * (q[i + step] - q[i]) / (n[i + step] - n[i]);
+            n[i] += step;
+        }
+    }
+    s[5] = n[1];
+    s[6] = n[2];
+    s[7] = n[3];
+}
+
+// the quantile "frac" of the P-square state "s" after "count" values: exact while the state still
+// holds every value, the middle marker once P-square has moved it
+static float quantile_value(float *s, size_t count, float frac)
+{
+    if (count > 5)
+        return s[2];
+    float values[5];
+    copy(s, s + count, values);
+    return count ? exact_quantile(values, count, frac) : 0;
+}
+
+ProjEngine::ProjEngine(int type, size_t sizeX, size_t sizeY, size_t sizeC, size_t sizeZ,
+                       Nrrd *nxy, Nrrd *nxz, Nrrd *nyz, vector<ProjMeasure> const &measures, int threads)
+: type(type), sizeX(sizeX), sizeY(sizeY), sizeC(sizeC), sizeZ(sizeZ),
+  nxy(nxy), nxz(nxz), nyz(nyz), measures(measures), threads(threads > 0 ? threads : omp_get_max_threads()),
+  maxIndex(-1), meanIndex(-1), sumIndex(-1), averageIndex(-1), sliceMeasures(false), planesAdded(0), mop(airMopNew())
+{
+    if (pixel_czi_type(type) == CZIPIXELTYPE_UNDEFINED)
+        throw LSPException("Can't project volumes of type " + string(airEnumStr(nrrdType, type)) + "\n",
+                           "projengine.cpp", "ProjEngine::ProjEngine");
+    if (measures.empty())
+        throw LSPException("No projection measures given\n", "projengine.cpp", "ProjEngine::ProjEngine");
+
+    size_t sizeP = measures.size();
+    nrrd_checker(nrrdAlloc_va(nxy, nrrdTypeFloat, 4, sizeX, sizeY, sizeC, sizeP)
+                 || nrrdAlloc_va(nxz, nrrdTypeFloat, 4, sizeX, sizeZ, sizeC, sizeP)
+                 || nrrdAlloc_va(nyz, nrrdTypeFloat, 4, sizeY, sizeZ, sizeC, sizeP),
+                 mop, "Couldn't allocate projections:\n", "projengine.cpp", "ProjEngine::ProjEngine");
+
+    size_t sizeXYC = sizeX * sizeY * sizeC;
+    float *outXY = (float*)nxy->data;
+    for (size_t m = 0; m < sizeP; m++)
+        switch (measures[m].kind)
+        {
+            case PROJ_MEASURE_MAX:
+                maxIndex = (int)m;
+                break;
+            case PROJ_MEASURE_MEAN:
+                meanIndex = (int)m;
+                break;
+            case PROJ_MEASURE_SUM:
+                sumIndex = (int)m;
+                break;
+            case PROJ_MEASURE_MIN:
+                fill(outXY + sizeXYC * m, outXY + sizeXYC * (m + 1), FLT_MAX);
+                sliceMeasures = true;
+                break;
+            case PROJ_MEASURE_STD:
+                if (welfordMean.empty())
+                {
+                    welfordMean.assign(sizeXYC, 0.0f);
+                    welfordM2.assign(sizeXYC, 0.0f);
+                }
+                sliceMeasures = true;
+                break;
+            case PROJ_MEASURE_PERCENTILE:
+                quantileStates.push_back(vector<float>(PROJ_QUANTILE_STATE * sizeXYC));
+                sliceMeasures = true;
+                break;
+            case PROJ_MEASURE_ARGMAX:
+                fill(outXY + sizeXYC * m, outXY + sizeXYC * (m + 1), 0.0f);
+                argmaxValue.assign(sizeXYC, -FLT_MAX);
+                sliceMeasures = true;
+                break;
+        }
+
+    averageIndex = meanIndex >= 0 ? meanIndex : sumIndex;
+
+    // the first thread accumulates in the output itself, the others get their own buffers when they
+    // first have planes to add
+    partials.resize(this->threads);
+    for (Partial &p : partials)
+    {
+        p.max = p.mean = nullptr;
+        p.used = false;
+    }
+    if (maxIndex >= 0)
+    {
+        partials[0].max = outXY + sizeXYC * maxIndex;
+        fill(partials[0].max, partials[0].max + sizeXYC, -FLT_MAX);
+    }
+    if (averageIndex >= 0)
+    {
+        partials[0].mean = outXY + sizeXYC * averageIndex;
+        fill(partials[0].mean, partials[0].mean + sizeXYC, 0.0f);
+    }
+    partials[0].used = true;
+    scratch.resize(this->threads);
+}
+
+ProjEngine::~ProjEngine()
+{
+    airMopOkay(mop);
+}
+
+bool ProjEngine::supports(Nrrd const *nin)
+{
+    return nin->dim == 4 && pixel_czi_type(nin->type) != CZIPIXELTYPE_UNDEFINED;
+}
+
+size_t ProjEngine::fixed_bytes(size_t sizeX, size_t sizeY, size_t sizeC, size_t sizeZ, vector<ProjMeasure> const &measures)
+{
+    size_t sizeXYC = sizeX * sizeY * sizeC;
+    size_t bytes = sizeof(float) * measures.size() * sizeC * (sizeX * sizeY + sizeX * sizeZ + sizeY * sizeZ);
+    bool hasStd = false, hasArgmax = false;
+    for (ProjMeasure const &m : measures)
+    {
+        if (m.kind == PROJ_MEASURE_STD)
+            hasStd = true;
+        if (m.kind == PROJ_MEASURE_ARGMAX)
+            hasArgmax = true;
+        if (m.kind == PROJ_MEASURE_PERCENTILE)
+            bytes += sizeof(float) * PROJ_QUANTILE_STATE * sizeXYC;
+    }
+    if (hasStd)
+        bytes += 2 * sizeof(float) * sizeXYC;
+    if (hasArgmax)
+        bytes += sizeof(float) * sizeXYC;
+    return bytes;
+}
+
+size_t ProjEngine::thread_bytes(size_t sizeX, size_t sizeY, size_t sizeC, vector<ProjMeasure> const &measures)
+{
+    size_t bytes = 0;
+    bool slice = false, percentile = false, average = false;
+    for (ProjMeasure const &m : measures)
+    {
+        // mean and sum share one accumulator
+        if (m.kind == PROJ_MEASURE_MAX || ((m.kind == PROJ_MEASURE_MEAN || m.kind == PROJ_MEASURE_SUM) && !average))
+            bytes += sizeof(float) * sizeX * sizeY * sizeC;
+        if (m.kind == PROJ_MEASURE_MEAN || m.kind == PROJ_MEASURE_SUM)
+            average = true;
+        else if (m.kind != PROJ_MEASURE_MAX)
+            slice = true;
+        if (m.kind == PROJ_MEASURE_PERCENTILE)
+            percentile = true;
+    }
+    if (slice)
+        bytes += sizeof(float) * (6 * sizeX + (percentile ? sizeX * sizeY : 0));
+    return bytes;
+}
+
+struct ProjEngine::AddSlab {
+    ProjEngine *self;
+    const void *slab;
+    size_t z0, count;
+    template<typename T> void operator()(PixelTag<T>) const { self->add_planes((const T*)slab, z0, count); }
+};
+
+void ProjEngine::add_slab(const void *slab, size_t z0, size_t count)
+{
+    if (z0 + count > sizeZ)
+        throw LSPException("Planes " + to_string(z0) + " to " + to_string(z0 + count) + " are outside the volume of "
+                           + to_string(sizeZ) + " planes\n", "projengine.cpp", "ProjEngine::add_slab");
+    if (sliceMeasures && z0 != planesAdded)
+        throw LSPException("Planes have to be added in order for measures other than max, mean and sum, got plane "
+                           + to_string(z0) + " instead of " + to_string(planesAdded) + "\n",
+                           "projengine.cpp", "ProjEngine::add_slab");
+    pixel_dispatch_czi(pixel_czi_type(type), AddSlab{this, slab, z0, count});
+}
+
+template<typename T>
+void ProjEngine::add_planes(const T *slab, size_t z0, size_t count)
+{
+    size_t sizeXY = sizeX * sizeY;
+    size_t planeXZ = sizeX * sizeZ * sizeC, planeYZ = sizeY * sizeZ * sizeC;
+    float *outXZ = (float*)nxz->data, *outYZ = (float*)nyz->data;
+    bool maxMean = maxIndex >= 0 || averageIndex >= 0;
+    bool meanAndSum = meanIndex >= 0 && sumIndex >= 0;
+
+    int n = (int)min((size_t)threads, max(count, (size_t)1));
+    #pragma omp parallel num_threads(n)
+    {
+        // a contiguous run of planes per thread, so its slices are read in file order
+        size_t t = omp_get_thread_num(), numThreads = omp_get_num_threads();
+        size_t zBegin = count * t / numThreads, zEnd = count * (t + 1) / numThreads;
+        Partial &p = partials[t];
+        if (maxMean && zBegin < zEnd && !p.used)
+        {
+            size_t sizeXYC = sizeXY * sizeC;
+            p.storage.resize(((maxIndex >= 0) + (averageIndex >= 0)) * sizeXYC);
+            float *next = p.storage.data();
+            if (maxIndex >= 0)
+            {
+                p.max = next;
+                fill(p.max, p.max + sizeXYC, -FLT_MAX);
+                next += sizeXYC;
+            }
+            if (averageIndex >= 0)
+            {
+                p.mean = next;
+                fill(p.mean, p.mean + sizeXYC, 0.0f);
+            }
+            p.used = true;
+        }
+
+        // a sum on its own is a mean that is not divided
+        bool average = meanIndex >= 0;
+        ProjSliceTargets targets;
+        targets.scaleXY = average ? 1.0f / sizeZ : 1.0f;
+        targets.scaleXZ = average ? 1.0f / sizeY : 1.0f;
+        targets.scaleYZ = average ? 1.0f / sizeX : 1.0f;
+        for (size_t z = zBegin; z < zEnd; z++)
+            for (size_t c = 0; c < sizeC; c++)
+            {
+                const T *slice = slab + sizeXY * (c + sizeC * z);
+                size_t zc = z0 + z + sizeZ * c;
+                if (maxMean)
+                {
+                    targets.maxXY = p.max ? p.max + sizeXY * c : nullptr;
+                    targets.meanXY = p.mean ? p.mean + sizeXY * c : nullptr;
+                    targets.maxXZ = maxIndex >= 0 ? outXZ + planeXZ * maxIndex + sizeX * zc : nullptr;
+                    targets.meanXZ = averageIndex >= 0 ? outXZ + planeXZ * averageIndex + sizeX * zc : nullptr;
+                    targets.maxYZ = maxIndex >= 0 ? outYZ + planeYZ * maxIndex + sizeY * zc : nullptr;
+                    targets.meanYZ = averageIndex >= 0 ? outYZ + planeYZ * averageIndex + sizeY * zc : nullptr;
+                    proj_accumulate_slice(slice, sizeX, sizeY, targets);
+                }
+                if (meanAndSum)
+                {
+                    float *sumXZ = outXZ + planeXZ * sumIndex + sizeX * zc;
+                    float *sumYZ = outYZ + planeYZ * sumIndex + sizeY * zc;
+                    for (size_t x = 0; x < sizeX; x++)
+                        sumXZ[x] = targets.meanXZ[x] * sizeY;
+                    for (size_t y = 0; y < sizeY; y++)
+                        sumYZ[y] = targets.meanYZ[y] * sizeX;
+                }
+                if (sliceMeasures)
+                    slice_measures(slice, c, z0 + z, scratch[t]);
+            }
+    }
+
+    if (sliceMeasures)
+        xy_measures(slab, count);
+}
+
+// the measures other than max, mean and sum of the slice (c, z) over y and over x, i.e. its XZ and YZ rows
+template<typename T>
+void ProjEngine::slice_measures(const T *slice, size_t c, size_t z, vector<float> &buffer)
+{
+    bool percentiles = !quantileStates.empty();
+    buffer.resize(6 * sizeX + (percentiles ? sizeX * sizeY : 0));
+    float *colMin = buffer.data(), *colMean = colMin + sizeX, *colM2 = colMean + sizeX;
+    float *colMax = colM2 + sizeX, *colArgmax = colMax + sizeX;
+    float *row = colArgmax + sizeX, *cols = row + sizeX;
+    fill(colMin, colMin + sizeX, FLT_MAX);
+    fill(colMean, colMean + 2 * sizeX, 0.0f);
+    fill(colMax, colMax + sizeX, -FLT_MAX);
+    fill(colArgmax, colArgmax + sizeX, 0.0f);
+
+    size_t zc = z + sizeZ * c;
+    size_t planeXZ = sizeX * sizeZ * sizeC, planeYZ = sizeY * sizeZ * sizeC;
+    float *outXZ = (float*)nxz->data + sizeX * zc, *outYZ = (float*)nyz->data + sizeY * zc;
+    for (size_t y = 0; y < sizeY; y++)
+    {
+        const T *in = slice + sizeX * y;
+        float rowMin = FLT_MAX, rowMax = -FLT_MAX;
+        size_t rowArgmax = 0;
+        double rowSum = 0;
+        for (size_t x = 0; x < sizeX; x++)
+        {
+            float v = (float)in[x];
+            row[x] = v;
+            rowMin = min(rowMin, v);
+            rowSum += v;
+            if (v > rowMax)
+            {
+                rowMax = v;
+                rowArgmax = x;
+            }
+            colMin[x] = min(colMin[x], v);
+            if (v > colMax[x])
+            {
+                colMax[x] = v;
+                colArgmax[x] = (float)y;
+            }
+            float d = v - colMean[x];
+            colMean[x] += d / (y + 1);
+            colM2[x] += d * (v - colMean[x]);
+            if (percentiles)
+                cols[sizeY * x + y] = v;
+        }
+        // the row is still in cache, so its variance takes a second pass over it
+        double rowMean = rowSum / sizeX, rowSS = 0;
+        for (size_t x = 0; x < sizeX; x++)
+            rowSS += (row[x] - rowMean) * (row[x] - rowMean);
+
+        for (size_t m = 0; m < measures.size(); m++)
+        {
+            float *out = outYZ + planeYZ * m + y;
+            if (measures[m].kind == PROJ_MEASURE_MIN)
+                *out = rowMin;
+            else if (measures[m].kind == PROJ_MEASURE_STD)
+                *out = (float)sqrt(rowSS / sizeX);
+            else if (measures[m].kind == PROJ_MEASURE_ARGMAX)
+                *out = (float)rowArgmax;
+            else if (measures[m].kind == PROJ_MEASURE_PERCENTILE)
+                *out = exact_quantile(row, sizeX, measures[m].percentile / 100);
+        }
+    }
+
+    for (size_t m = 0; m < measures.size(); m++)
+    {
+        float *out = outXZ + planeXZ * m;
+        if (measures[m].kind == PROJ_MEASURE_MIN)
+            copy(colMin, colMin + sizeX, out);
+        else if (measures[m].kind == PROJ_MEASURE_ARGMAX)
+            copy(colArgmax, colArgmax + sizeX, out);
+        else if (measures[m].kind == PROJ_MEASURE_STD)
+            for (size_t x = 0; x < sizeX; x++)
+                out[x] = sqrt(colM2[x] / sizeY);
+        else if (measures[m].kind == PROJ_MEASURE_PERCENTILE)
+            for (size_t x = 0; x < sizeX; x++)
+                out[x] = exact_quantile(cols + sizeY * x, sizeY, measures[m].percentile / 100);
+    }
+}
+
+// the running XY measures other than max, mean and sum over the next "count" planes; rows of pixels are
+// split over the threads, so every pixel still sees its values in z order
+template<typename T>
+void ProjEngine::xy_measures(const T *slab, size_t count)
+{
+    size_t sizeXY = sizeX * sizeY, sizeXYC = sizeXY * sizeC;
+    float *minXY = nullptr, *argmaxXY = nullptr;
+    vector<float> fracs;
+    for (size_t m = 0; m < measures.size(); m++)
+    {
+        if (measures[m].kind == PROJ_MEASURE_MIN)
+            minXY = (float*)nxy->data + sizeXYC * m;
+        if (measures[m].kind == PROJ_MEASURE_ARGMAX)
+            argmaxXY = (float*)nxy->data + sizeXYC * m;
+        if (measures[m].kind == PROJ_MEASURE_PERCENTILE)
+            fracs.push_back((float)(measures[m].percentile / 100));
+    }
+    float *wMean = welfordMean.empty() ? nullptr : welfordMean.data();
+    float *wM2 = welfordM2.empty() ? nullptr : welfordM2.data();
+    float *maxXY = argmaxValue.empty() ? nullptr : argmaxValue.data();
+
+    #pragma omp parallel for schedule(static) num_threads(threads)
+    for (size_t y = 0; y < sizeY; y++)
+        for (size_t z = 0; z < count; z++)
+        {
+            size_t n = planesAdded + z + 1;
+            for (size_t c = 0; c < sizeC; c++)
+            {
+                const T *in = slab + sizeX * y + sizeXY * (c + sizeC * z);
+                size_t i0 = sizeX * y + sizeXY * c;
+                for (size_t x = 0; x < sizeX; x++)
+                {
+                    float v = (float)in[x];
+                    size_t i = i0 + x;
+                    if (minXY)
+                        minXY[i] = min(minXY[i], v);
+                    if (argmaxXY && v > maxXY[i])
+                    {
+                        maxXY[i] = v;
+                        argmaxXY[i] = (float)(n - 1);
+                    }
+                    if (wMean)
+                    {
+                        float d = v - wMean[i];
+                        wMean[i] += d / n;
+                        wM2[i] += d * (v - wMean[i]);
+                    }
+                    for (size_t q = 0; q < fracs.size(); q++)
+                        quantile_add(quantileStates[q].data() + PROJ_QUANTILE_STATE * i, v, n, fracs[q]);
+                }
+            }
+        }
+    planesAdded += count;
+}
+
+void ProjEngine::finish(Nrrd const *header)
+{
+    size_t sizeXYC = sizeX * sizeY * sizeC;
+    float *maxXY = partials[0].max, *meanXY = partials[0].mean;
+    for (size_t t = 1; t < partials.size(); t++)
+    {
+        if (!partials[t].used)
+            continue;
+        const float *partMax = partials[t].max, *partMean = partials[t].mean;
+        #pragma omp parallel for num_threads(threads)
+        for (size_t i = 0; i < sizeXYC; i++)
+        {
+            if (maxXY)
+                maxXY[i] = max(maxXY[i], partMax[i]);
+            if (meanXY)
+                meanXY[i] += partMean[i];
+        }
+        vector<float>().swap(partials[t].storage);
+        partials[t].used = false;
+    }
+
+    size_t q = 0;
+    for (size_t m = 0; m < measures.size(); m++)
+    {
+        float *out = (float*)nxy->data + sizeXYC * m;
+        if (measures[m].kind == PROJ_MEASURE_SUM && meanIndex >= 0)
+        {
+            #pragma omp parallel for num_threads(threads)
+            for (size_t i = 0; i < sizeXYC; i++)
+                out[i] = meanXY[i] * sizeZ;
+        }
+        else if (measures[m].kind == PROJ_MEASURE_STD)
+        {
+            #pragma omp parallel for num_threads(threads)
+            for (size_t i = 0; i < sizeXYC; i++)
+                out[i] = planesAdded ? sqrt(welfordM2[i] / planesAdded) : 0;
+        }
+        else if (measures[m].kind == PROJ_MEASURE_PERCENTILE)
+        {
+            float *states = quantileStates[q++].data();
+            float frac = (float)(measures[m].percentile / 100);
+            #pragma omp parallel for num_threads(threads)
+            for (size_t i = 0; i < sizeXYC; i++)
+                out[i] = quantile_value(states + PROJ_QUANTILE_STATE * i, planesAdded, frac);
+        }
+    }
+
+    // what nrrdProject and nrrdAxesPermute would keep of the volume: x-y-c, x-z-c and y-z-c
+    int axmapXY[4] = {0, 1, 2, -1};
+    int axmapXZ[4] = {0, 3, 2, -1};
+    int axmapYZ[4] = {1, 3, 2, -1};
+    int basicExclude = NRRD_BASIC_INFO_DATA_BIT | NRRD_BASIC_INFO_TYPE_BIT | NRRD_BASIC_INFO_BLOCKSIZE_BIT
+                       | NRRD_BASIC_INFO_DIMENSION_BIT | NRRD_BASIC_INFO_CONTENT_BIT | NRRD_BASIC_INFO_COMMENTS_BIT
+                       | NRRD_BASIC_INFO_KEYVALUEPAIRS_BIT;
+    nrrd_checker(nrrdAxisInfoCopy(nxy, header, axmapXY, NRRD_AXIS_INFO_SIZE_BIT)
+                 || nrrdAxisInfoCopy(nxz, header, axmapXZ, NRRD_AXIS_INFO_SIZE_BIT)
+                 || nrrdAxisInfoCopy(nyz, header, axmapYZ, NRRD_AXIS_INFO_SIZE_BIT)
+                 || nrrdBasicInfoCopy(nxy, header, basicExclude)
+                 || nrrdBasicInfoCopy(nxz, header, basicExclude)
+                 || nrrdBasicInfoCopy(nyz, header, basicExclude),
+                 mop, "Couldn't copy the volume information to the projections:\n", "projengine.cpp", "ProjEngine::finish");
+}
@@ -0,0 +1,226 @@
+//! \file projkernel.cpp
+//! \brief Vectorized max/mean projection accumulator for one image slice.
+//!
+//! Every slice updates the running XY max/mean and produces one XZ row (over y) and
+//! one YZ row (over x). The SSE2 path does the XY and XZ updates four x at a time
+//! with branchless max and a multiply by the precomputed reciprocal, and keeps the YZ
+//! row max/sum in vector registers that are reduced once per row; the columns left
+//! over at the end of a row go through the scalar code after the vector loop. Wider
+//! vectors do not pay off here: the accumulator is bound by the memory traffic of the
+//! XY buffers, and AVX2 measured no faster than SSE2 with projbench.
+
+#include "projkernel.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LSP_PROJ_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+// pointers of one row into the targets, XZ means hold sums until the whole slice is done
+struct ProjRow {
+    float *maxXY;
+    float *meanXY;
+    float scaleXY;
+    float *maxXZ;
+    float *sumXZ;
+};
+
+// scalar code for the columns [x0, sizeX) that do not fill a whole vector
+template<typename T>
+void row_scalar(const T *row, size_t x0, size_t sizeX, ProjRow const &r, float &rowMax, float &rowSum)
+{
+    for (size_t x = x0; x < sizeX; x++)
+    {
+        float v = (float)row[x];
+        if (r.maxXY)
+            r.maxXY[x] = max(r.maxXY[x], v);
+        if (r.meanXY)
+            r.meanXY[x] += v * r.scaleXY;
+        if (r.maxXZ)
+            r.maxXZ[x] = max(r.maxXZ[x], v);
+        if (r.sumXZ)
+            r.sumXZ[x] += v;
+        rowMax = max(rowMax, v);
+        rowSum += v;
+    }
+}
+
+#ifdef LSP_PROJ_X86
+
+//=========//
+//  SSE2   //
+//=========//
+
+__attribute__((target("sse2"))) inline __m128 load4_sse2(const unsigned char *p)
+{
+    int32_t bytes;
+    memcpy(&bytes, p, sizeof(bytes));
+    __m128i zero = _mm_setzero_si128();
+    __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+}
+
+__attribute__((target("sse2"))) inline __m128 load4_sse2(const uint16_t *p)
+{
+    __m128i v = _mm_loadl_epi64((const __m128i*)p);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, _mm_setzero_si128()));
+}
+
+__attribute__((target("sse2"))) inline __m128 load4_sse2(const float *p)
+{
+    return _mm_loadu_ps(p);
+}
+
+__attribute__((target("sse2"))) inline float hmax_sse2(__m128 v)
+{
+    v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(v);
+}
+
+__attribute__((target("sse2"))) inline float hsum_sse2(__m128 v)
+{
+    v = _mm_add_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(v);
+}
+
+template<typename T>
+__attribute__((target("sse2"))) size_t row_sse2(const T *row, size_t sizeX, ProjRow const &r, float &rowMax, float &rowSum)
+{
+    __m128 scaleXY = _mm_set1_ps(r.scaleXY);
+    __m128 vmax = _mm_set1_ps(-FLT_MAX);
+    __m128 vsum = _mm_setzero_ps();
+    size_t end = sizeX & ~(size_t)3;
+    for (size_t x = 0; x < end; x += 4)
+    {
+        __m128 v = load4_sse2(row + x);
+        if (r.maxXY)
+            _mm_storeu_ps(r.maxXY + x, _mm_max_ps(_mm_loadu_ps(r.maxXY + x), v));
+        if (r.meanXY)
+            _mm_storeu_ps(r.meanXY + x, _mm_add_ps(_mm_loadu_ps(r.meanXY + x), _mm_mul_ps(v, scaleXY)));
+        if (r.maxXZ)
+            _mm_storeu_ps(r.maxXZ + x, _mm_max_ps(_mm_loadu_ps(r.maxXZ + x), v));
+        if (r.sumXZ)
+            _mm_storeu_ps(r.sumXZ + x, _mm_add_ps(_mm_loadu_ps(r.sumXZ + x), v));
+        vmax = _mm_max_ps(vmax, v);
+        vsum = _mm_add_ps(vsum, v);
+    }
+    rowMax = max(rowMax, hmax_sse2(vmax));
+    rowSum += hsum_sse2(vsum);
+    return end;
+}
+
+#endif // LSP_PROJ_X86
+
+ProjKernelIsa best_isa()
+{
+#ifdef LSP_PROJ_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        return PROJ_ISA_SSE2;
+#endif
+    return PROJ_ISA_SCALAR;
+}
+
+ProjKernelIsa &active_isa()
+{
+    static ProjKernelIsa isa = best_isa();
+    return isa;
+}
+
+template<typename T>
+void accumulate_slice(const T *slice, size_t sizeX, size_t sizeY, ProjSliceTargets const &t)
+{
+    ProjKernelIsa isa = active_isa();
+
+    // the XZ row of this slice is built up over y, as a max and a sum
+    if (t.maxXZ)
+        fill(t.maxXZ, t.maxXZ + sizeX, -FLT_MAX);
+    if (t.meanXZ)
+        fill(t.meanXZ, t.meanXZ + sizeX, 0.0f);
+
+    ProjRow r;
+    r.scaleXY = t.scaleXY;
+    r.maxXZ = t.maxXZ;
+    r.sumXZ = t.meanXZ;
+    for (size_t y = 0; y < sizeY; y++)
+    {
+        const T *row = slice + y*sizeX;
+        r.maxXY = t.maxXY ? t.maxXY + y*sizeX : nullptr;
+        r.meanXY = t.meanXY ? t.meanXY + y*sizeX : nullptr;
+
+        float rowMax = -FLT_MAX;
+        float rowSum = 0;
+        size_t x = 0;
+#ifdef LSP_PROJ_X86
+        if (isa == PROJ_ISA_SSE2)
+            x = row_sse2(row, sizeX, r, rowMax, rowSum);
+#endif
+        row_scalar(row, x, sizeX, r, rowMax, rowSum);
+
+        if (t.maxYZ)
+            t.maxYZ[y] = rowMax;
+        if (t.meanYZ)
+            t.meanYZ[y] = rowSum * t.scaleYZ;
+    }
+
+    if (t.meanXZ)
+    {
+        for (size_t x = 0; x < sizeX; x++)
+            t.meanXZ[x] *= t.scaleXZ;
+    }
+}
+
+} // namespace
+
+void proj_init_xy(float *maxXY, float *meanXY, size_t n)
+{
+    fill(maxXY, maxXY + n, -FLT_MAX);
+    fill(meanXY, meanXY + n, 0.0f);
+}
+
+void proj_accumulate_slice(const unsigned char *slice, size_t sizeX, size_t sizeY, ProjSliceTargets const &targets)
+{
+    accumulate_slice(slice, sizeX, sizeY, targets);
+}
+
+void proj_accumulate_slice(const uint16_t *slice, size_t sizeX, size_t sizeY, ProjSliceTargets const &targets)
+{
+    accumulate_slice(slice, sizeX, sizeY, targets);
+}
+
+void proj_accumulate_slice(const float *slice, size_t sizeX, size_t sizeY, ProjSliceTargets const &targets)
+{
+    accumulate_slice(slice, sizeX, sizeY, targets);
+}
+
+ProjKernelIsa proj_kernel_isa()
+{
+    return active_isa();
+}
+
+bool proj_kernel_select(ProjKernelIsa isa)
+{
+    if (isa > best_isa())
+        return false;
+    active_isa() = isa;
+    return true;
+}
+
+const char *proj_kernel_isa_name(ProjKernelIsa isa)
+{
+    switch (isa)
+    {
+        case PROJ_ISA_SSE2: return "sse2";
+        default: return "scalar";
+    }
+}
@@ -0,0 +1,153 @@
+//! \file projslab.cpp
+//! \brief Stack of max projections of thick z slabs, in one pass over an x-y-c-z volume.
+
+#include "projslab.h"
+#include "pixeltraits.h"
+#include "util.h"
+
+#include <algorithm>
+#include <omp.h>
+
+using namespace std;
+
+static size_t slab_gcd(size_t a, size_t b)
+{
+    while (b)
+    {
+        size_t r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+ProjSlabStack::ProjSlabStack(int type, size_t sizeX, size_t sizeY, size_t sizeC, size_t sizeZ,
+                             size_t thickness, size_t stride, Nrrd *nout, int threads)
+: type(type), sizeX(sizeX), sizeY(sizeY), sizeC(sizeC), sizeZ(sizeZ),
+  thickness(min(thickness, sizeZ)), stride(stride ? stride : min(thickness, sizeZ)), nout(nout),
+  threads(threads > 0 ? threads : omp_get_max_threads()), planesAdded(0), mop(airMopNew())
+{
+    if (pixel_czi_type(type) == CZIPIXELTYPE_UNDEFINED)
+        throw LSPException("Can't project slabs of volumes of type " + string(airEnumStr(nrrdType, type)) + "\n",
+                           "projslab.cpp", "ProjSlabStack::ProjSlabStack");
+    if (!this->thickness)
+        throw LSPException("Slabs need at least one plane\n", "projslab.cpp", "ProjSlabStack::ProjSlabStack");
+
+    numSlabs = (sizeZ - this->thickness) / this->stride + 1;
+    blockPlanes = slab_gcd(this->thickness, this->stride);
+    slabBlocks = this->thickness / blockPlanes;
+    strideBlocks = this->stride / blockPlanes;
+
+    nrrd_checker(nrrdAlloc_va(nout, nrrdTypeFloat, 4, sizeX, sizeY, sizeC, numSlabs),
+                 mop, "Couldn't allocate slab projections:\n", "projslab.cpp", "ProjSlabStack::ProjSlabStack");
+    ring.resize(slabBlocks * sizeX * sizeY * sizeC);
+}
+
+ProjSlabStack::~ProjSlabStack()
+{
+    airMopOkay(mop);
+}
+
+size_t ProjSlabStack::bytes(size_t sizeX, size_t sizeY, size_t sizeC, size_t sizeZ, size_t thickness, size_t stride)
+{
+    thickness = min(thickness, sizeZ);
+    stride = stride ? stride : thickness;
+    if (!thickness)
+        return 0;
+    size_t numSlabs = (sizeZ - thickness) / stride + 1;
+    size_t slabBlocks = thickness / slab_gcd(thickness, stride);
+    return sizeof(float) * sizeX * sizeY * sizeC * (numSlabs + slabBlocks);
+}
+
+bool ProjSlabStack::block_used(size_t b) const
+{
+    // the last slab starting at or before b
+    size_t k = min(b / strideBlocks, numSlabs - 1);
+    return b < k * strideBlocks + slabBlocks;
+}
+
+struct ProjSlabStack::AddSlab {
+    ProjSlabStack *self;
+    const void *slab;
+    size_t z0, count;
+    template<typename T> void operator()(PixelTag<T>) const { self->add_planes((const T*)slab, z0, count); }
+};
+
+void ProjSlabStack::add_slab(const void *slab, size_t z0, size_t count)
+{
+    if (z0 != planesAdded || z0 + count > sizeZ)
+        throw LSPException("Slab projections need the planes in order, got " + to_string(z0) + " to " + to_string(z0 + count)
+                           + " after " + to_string(planesAdded) + " of " + to_string(sizeZ) + "\n",
+                           "projslab.cpp", "ProjSlabStack::add_slab");
+    pixel_dispatch_czi(pixel_czi_type(type), AddSlab{this, slab, z0, count});
+    planesAdded += count;
+}
+
+template<typename T>
+void ProjSlabStack::add_planes(const T *slab, size_t z0, size_t count)
+{
+    size_t sizeXY = sizeX * sizeY, sizeXYC = sizeXY * sizeC;
+    float *out = (float*)nout->data;
+
+    #pragma omp parallel for schedule(static) num_threads(threads)
+    for (size_t y = 0; y < sizeY; y++)
+        for (size_t z = 0; z < count; z++)
+        {
+            size_t plane = z0 + z, b = plane / blockPlanes;
+            if (!block_used(b))
+                continue;
+            // the first plane of a block takes over the slot of the block slabBlocks before it
+            bool first = plane % blockPlanes == 0;
+            bool last = plane % blockPlanes == blockPlanes - 1;
+            float *acc = ring.data() + sizeXYC * (b % slabBlocks) + sizeX * y;
+            for (size_t c = 0; c < sizeC; c++)
+            {
+                const T *in = slab + sizeX * y + sizeXY * (c + sizeC * z);
+                float *a = acc + sizeXY * c;
+                if (first)
+                    for (size_t x = 0; x < sizeX; x++)
+                        a[x] = (float)in[x];
+                else
+                    for (size_t x = 0; x < sizeX; x++)
+                        a[x] = max(a[x], (float)in[x]);
+            }
+
+            // the slab whose last block this was is complete
+            if (!last || b + 1 < slabBlocks || (b + 1 - slabBlocks) % strideBlocks)
+                continue;
+            size_t k = (b + 1 - slabBlocks) / strideBlocks;
+            if (k >= numSlabs)
+                continue;
+            for (size_t c = 0; c < sizeC; c++)
+            {
+                float *o = out + sizeXYC * k + sizeXY * c + sizeX * y;
+                const float *a = ring.data() + sizeXYC * (b % slabBlocks) + sizeXY * c + sizeX * y;
+                copy(a, a + sizeX, o);
+                for (size_t i = 1; i < slabBlocks; i++)
+                {
+                    a = ring.data() + sizeXYC * ((b - i) % slabBlocks) + sizeXY * c + sizeX * y;
+                    for (size_t x = 0; x < sizeX; x++)
+                        o[x] = max(o[x], a[x]);
+                }
+            }
+        }
+}
+
+void ProjSlabStack::finish(Nrrd const *header)
+{
+    size_t needed = (numSlabs - 1) * stride + thickness;
+    if (planesAdded < needed)
+        throw LSPException("Slab projections got " + to_string(planesAdded) + " of the " + to_string(needed) + " planes they need\n",
+                           "projslab.cpp", "ProjSlabStack::finish");
+    vector<float>().swap(ring);
+
+    int axmap[4] = {0, 1, 2, -1};
+    int basicExclude = NRRD_BASIC_INFO_DATA_BIT | NRRD_BASIC_INFO_TYPE_BIT | NRRD_BASIC_INFO_BLOCKSIZE_BIT
+                       | NRRD_BASIC_INFO_DIMENSION_BIT | NRRD_BASIC_INFO_CONTENT_BIT | NRRD_BASIC_INFO_COMMENTS_BIT
+                       | NRRD_BASIC_INFO_KEYVALUEPAIRS_BIT;
+    nrrd_checker(nrrdAxisInfoCopy(nout, header, axmap, NRRD_AXIS_INFO_SIZE_BIT)
+                 || nrrdBasicInfoCopy(nout, header, basicExclude)
+                 || nrrdKeyValueAdd(nout, "slab thickness", to_string(thickness).c_str())
+                 || nrrdKeyValueAdd(nout, "slab stride", to_string(stride).c_str()),
+                 mop, "Couldn't copy the volume information to the slab projections:\n", "projslab.cpp", "ProjSlabStack::finish");
+}
@@ -18,6 +18,10 @@
 #include "skimczi.h"
 #include "resamp.h"
 #include "lsp_math.h"
+#include "projkernel.h"
+#include "czistats.h"
+#include "czipyramid.h"
+#include "pixeltraits.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/range/iterator_range.hpp>
@@ -40,9 +44,15 @@ void setup_resamp(CLI::App &app)
     sub->add_option("-n, --max_file_number", opt->maxFileNum, "The max number of files that we want to process");
     sub->add_option("-f, --fps", opt->fps, "Frame per second (fps) of the generated .avi video. (Default: 10)");
     sub->add_option("-v, --verbose", opt->verbose, "Print processing message or not. (Default: 0(close))");
+    sub->add_option("-l, --level", opt->level, "Resample the 2^level times downsampled volumes of skim --pyramid, or the finest level "
+                                              "below it that exists, instead of the full resolution data (Default: 0)");
+    sub->add_flag("-s, --stats", opt->stats, "Take the quantization ranges from the NNN.stats files of skim --stats instead of "
+                                            "computing them from every resampled volume; files without one are computed as before");
+    add_io_options(sub, opt->io);
 
     sub->set_callback([opt]() 
     {
+        opt->io.verbose = opt->verbose;
         // first determine if input nhdr_path is valid
         if (checkIfDirectory(opt->nhdr_path))
         {
@@ -237,10 +247,13 @@ static int isEven (uint x)
 }
 
 // helper function that does all the processing, created as helper function since there are two modes
-static void processData(Nrrd* nrrd_new, string nhdr_name, string grid_path, string kernel_name, string volumeOutPath, airArray* mop, int verbose)
+static void processData(Nrrd* nrrd_new, string nhdr_name, string grid_path, string kernel_name, string volumeOutPath, airArray* mop, int verbose,
+                        IoGovernor *governor)
 {
-    // load the nhdr header
+    // load the nhdr header, in turn with the other processes sharing the I/O budget
+    IoGovernor::Read read(governor);
     Nrrd* nin = safe_nrrd_load(mop, nhdr_name);
+    read.done(nrrdElementNumber(nin) * nrrdElementSize(nin));
     if (verbose)
     {
         cout << "Finish loading Nrrd data located at " << nhdr_name << endl;
@@ -379,6 +392,18 @@ static void cropDataSet(Nrrd* nin_cropped, Nrrd* nin, double startPercent_x, dou
     nrrdCrop(nin_cropped, nin, min, max);
 }
 
+// max projection of the whole (c, x, y) slices z0..z1 of "data"
+struct ProjectZRange {
+    const void *data;
+    size_t sliceSize, z0, z1;
+    const ProjSliceTargets *targets;
+    template<typename T> void operator()(PixelTag<T>) const
+    {
+        for (size_t z = z0; z <= z1; z++)
+            proj_accumulate_slice((const T*)data + z*sliceSize, sliceSize, 1, *targets);
+    }
+};
+
 // function that project the "percent" of the loaded volume alone a specific axis
 static void projectData(Nrrd* projNrrd, Nrrd* nin, string axis, double startPercent, double endPercent, int verbose, airArray* mop)
 {
@@ -428,6 +453,49 @@ static void projectData(Nrrd* projNrrd, Nrrd* nin, string axis, double startPerc
     // cout << "min is (" << min[0] << ", " << min[1] << ", " << min[2] << ", " << min[3] << ")" << endl;
     // cout << "max is (" << max[0] << ", " << max[1] << ", " << max[2] << ", " << max[3] << ")" << endl;
 
+    // along z the kept range is a contiguous run of whole (c, x, y) slices, so they are fed
+    // to the projection accumulator in place instead of cropping a copy for nrrdProject
+    if (axisNum == 3 && pixel_czi_type(nin->type) != CZIPIXELTYPE_UNDEFINED)
+    {
+        size_t sliceSize = nin->axis[0].size * nin->axis[1].size * nin->axis[2].size;
+        Nrrd* maxNrrd = safe_nrrd_new(mop, (airMopper)nrrdNuke);
+        int axmap[3] = {0, 1, 2};
+        if (nrrdAlloc_va(maxNrrd, nrrdTypeFloat, 3, nin->axis[0].size, nin->axis[1].size, nin->axis[2].size)
+            || nrrdAxisInfoCopy(maxNrrd, nin, axmap, NRRD_AXIS_INFO_SIZE_BIT))
+        {
+            if (verbose)
+            {
+                printf("%s: trouble allocating MIP alone z-axis\n", __func__);
+            }
+            airMopError(mop);
+            return;
+        }
+
+        float* maxData = (float*)maxNrrd->data;
+        fill(maxData, maxData + sliceSize, -numeric_limits<float>::max());
+        ProjSliceTargets targets;
+        targets.maxXY = maxData;
+        // one slice is a single row of sliceSize values for the accumulator
+        pixel_dispatch_czi(pixel_czi_type(nin->type), ProjectZRange{nin->data, sliceSize, min[3], max[3], &targets});
+
+        // downstream code expects the same double result nrrdProject made
+        if (nrrdConvert(projNrrd, maxNrrd, nrrdTypeDouble))
+        {
+            if (verbose)
+            {
+                printf("%s: trouble converting MIP alone z-axis\n", __func__);
+            }
+            airMopError(mop);
+            return;
+        }
+        airMopSingleOkay(mop, maxNrrd);
+        if (verbose)
+        {
+            cout << "Finished projecting Nrrd data alone z-axis" << endl;
+        }
+        return;
+    }
+
     // cropping takes place at the projected axis
     Nrrd* nin_cropped = safe_nrrd_new(mop, (airMopper)nrrdNuke);
     nrrdCrop(nin_cropped, nin, min, max);
@@ -667,7 +735,8 @@ static void stitchImages(string imageOutPath_x_left, string imageOutPath_z, stri
 
 // ********************** end of static helper functions *********************
 
-void convoEval3D(lspCtx3D *ctx3D, double xw, double yw, double zw)
+template<typename T>
+void convoEval3D(lspCtx3D *ctx3D, const T *data, double xw, double yw, double zw)
 {
     // initialize output
     ctx3D->wpos[0] = xw;
@@ -780,21 +849,7 @@ void convoEval3D(lspCtx3D *ctx3D, double xw, double yw, double zw)
                         uint data_index = c + channel * ( (n1+i1) + sizeX * ( (n2+i2) + sizeY * (n3+i3) ) );
                         // cout << "current data_index is " << data_index << endl;
 
-                        // we do have different types of inputs
-                        // we converted unsigned short to short
-                        if (ctx3D->volume->dtype == lspTypeShort || ctx3D->volume->dtype == lspTypeUShort)
-                        {
-                            sum[c] = sum[c] + ctx3D->volume->data.s[data_index] * k1[i1-lower] * k2[i2-lower] * k3[i3-lower];
-                        }
-                        else if (ctx3D->volume->dtype == lspTypeDouble)
-                        {
-                            sum[c] = sum[c] + ctx3D->volume->data.dl[data_index] * k1[i1-lower] * k2[i2-lower] * k3[i3-lower];
-                        }
-                        else
-                        {
-                            cout << "ConvoEval3D: unknown data type" << endl;
-                            return;
-                        }
+                        sum[c] = sum[c] + (double)data[data_index] * k1[i1-lower] * k2[i2-lower] * k3[i3-lower];
                     }
                 }
             }
@@ -811,14 +866,17 @@ void convoEval3D(lspCtx3D *ctx3D, double xw, double yw, double zw)
 
 }
 
-// function that performs 3D resampling (convolution)
-int nrrdResample3D(lspVolume* newVolume, lspCtx3D* ctx3D)
-{   
+// 3D resampling of a volume of type T, the new volume has the same type
+template<typename T>
+static void resample3D(lspVolume* newVolume, lspCtx3D* ctx3D)
+{
     // sizes in x, y and z directions
     uint channel = ctx3D->volume->channel;
     uint sizeX = ctx3D->boundaries[0];
     uint sizeY = ctx3D->boundaries[1];
     uint sizeZ = ctx3D->boundaries[2];
+    const T *data = (const T*)ctx3D->volume->data.vd;
+    T *newData = (T*)newVolume->data.vd;
 
     // evaluate at each new volume index-space position
     for (uint zi = 0; zi < sizeZ; zi++)
@@ -836,29 +894,34 @@ int nrrdResample3D(lspVolume* newVolume, lspCtx3D* ctx3D)
                 double wpos[4];
                 MV4_MUL(wpos, ctx3D->NewItoW, new_ipos);
 
-                convoEval3D(ctx3D, wpos[0], wpos[1], wpos[2]);
+                convoEval3D(ctx3D, data, wpos[0], wpos[1], wpos[2]);
 
+                // rounded and clamped to the range of T, kernels with negative lobes overshoot it
                 for (int c = 0; c < ctx3D->volume->channel; c++)
                 {
                     uint data_index = c + channel * ( xi + sizeX * ( yi + sizeY * zi ) );
-
-                    if (ctx3D->volume->dtype == lspTypeShort || ctx3D->volume->dtype == lspTypeUShort)
-                    {
-                        newVolume->data.s[data_index] = ctx3D->value[c];
-                    }
-                    else if (ctx3D->volume->dtype == lspTypeDouble)
-                    {
-                        newVolume->data.dl[data_index] = ctx3D->value[c];
-                    }
-                    else
-                    {
-                        cout << "nrrdResample3D: error assigning convolution result to the new volume, unknown data type" << endl;
-                        return 1;
-                    }
+                    newData[data_index] = PixelTraits<T>::from_double(ctx3D->value[c]);
                 }
             }
         }
     }
+}
+
+struct Resample3D {
+    lspVolume* newVolume;
+    lspCtx3D* ctx3D;
+    template<typename T> void operator()(PixelTag<T>) const { resample3D<T>(newVolume, ctx3D); }
+};
+
+// function that performs 3D resampling (convolution)
+int nrrdResample3D(lspVolume* newVolume, lspCtx3D* ctx3D)
+{   
+    // the type is dispatched once for the whole volume, not per voxel
+    if (!pixel_dispatch_lsp(ctx3D->volume->dtype, Resample3D{newVolume, ctx3D}))
+    {
+        cout << "nrrdResample3D: error assigning convolution result to the new volume, unknown data type" << endl;
+        return 1;
+    }
 
     return 0;
 }
@@ -869,6 +932,7 @@ void Resamp::main()
     // loop over all the current files
     // in single file mode, numFiles = 1, the for loop just runs once
     int nhdrNum = opt.numFiles;
+    IoGovernor governor(opt.io, 1, opt.out_path);
     for (int i = 0; i < nhdrNum; i++)
     {
         auto start = chrono::high_resolution_clock::now();
@@ -926,7 +990,7 @@ void Resamp::main()
             nin = safe_nrrd_new(mop, (airMopper)nrrdNuke);
             // we will save this volume as nrrd
             volumeOutPath = common_prefix + ".nhdr";
-            processData(nin, nhdr_name, opt.grid_path, opt.kernel_name, volumeOutPath, mop, opt.verbose);
+            processData(nin, czi_pyramid_pick(nhdr_name, opt.level), opt.grid_path, opt.kernel_name, volumeOutPath, mop, opt.verbose, &governor);
         }
         // video only mode
         else
@@ -940,38 +1004,55 @@ void Resamp::main()
                 continue;
             }
 
-            nin = safe_nrrd_load(mop, nhdr_name);
+            IoGovernor::Read read(&governor);
+            nin = safe_nrrd_load(mop, czi_pyramid_pick(nhdr_name, opt.level));
+            read.done(nrrdElementNumber(nin) * nrrdElementSize(nin));
             if (opt.verbose)
             {
-                cout << "Finish loading Nrrd data located at " << nhdr_name << endl;
+                cout << "Finish loading Nrrd data located at " << czi_pyramid_pick(nhdr_name, opt.level) << endl;
             }
         }
 
-        // we want to get the RFP data range from the middle part of the data set, so that the
-        // pioneers which have low brightness would not be influenced by the
-        // so we take the center part of the data first
-        Nrrd* nin_cropped = safe_nrrd_new(mop, (airMopper)nrrdNuke);
-        // range of cropping along each axis
-        double startPercent_x = 0.25;
-        double endPercent_x = 0.75;
-        double startPercent_y = 0.25;
-        double endPercent_y = 0.75;
-        double startPercent_z = 0.0;
-        double endPercent_z = 1.0;
-        cropDataSet(nin_cropped, nin, startPercent_x, endPercent_x, startPercent_y, endPercent_y, startPercent_z, endPercent_z);
-        if (opt.verbose)
-        {
-            cout << "Finish cropping input Nrrd data" << endl;
-        }
-
-        // generate range based on cropped data
+        // ranges used to quantize both channels
         NrrdRange* range_GFP = nrrdRangeNew(lspNan(0), lspNan(0));
         NrrdRange* range_RFP = nrrdRangeNew(lspNan(0), lspNan(0));
         airMopAdd(mop, range_GFP, (airMopper)nrrdRangeNix, airMopAlways);
         airMopAdd(mop, range_RFP, (airMopper)nrrdRangeNix, airMopAlways);
 
-        // generate range
-        generateRange(nin_cropped, range_GFP, range_RFP, opt.rangeMinPercentile, opt.rangeMaxPercentile, opt.verbose, mop);
+        // generate range, with --stats from the histogram skim kept of the central part of the max projection
+        // along z, which is the same measure taken before resampling
+        CziStats stats;
+        if (opt.stats && czi_stats_load(czi_stats_file_name(nhdr_name), stats)
+            && stats.range(0, CZISTATS_MAX_XY_CENTER, opt.rangeMinPercentile[0], opt.rangeMaxPercentile[0], range_GFP->min, range_GFP->max)
+            && stats.range(1, CZISTATS_MAX_XY_CENTER, opt.rangeMinPercentile[1], opt.rangeMaxPercentile[1], range_RFP->min, range_RFP->max))
+        {
+            if (opt.verbose)
+            {
+                cout << "GFP min is " << range_GFP->min << ", GFP max is " << range_GFP->max << " (from " << czi_stats_file_name(nhdr_name) << ")" << endl;
+                cout << "RFP min is " << range_RFP->min << ", RFP max is " << range_RFP->max << " (from " << czi_stats_file_name(nhdr_name) << ")" << endl;
+            }
+        }
+        else
+        {
+            // we want to get the RFP data range from the middle part of the data set, so that the
+            // pioneers which have low brightness would not be influenced by the
+            // so we take the center part of the data first
+            Nrrd* nin_cropped = safe_nrrd_new(mop, (airMopper)nrrdNuke);
+            // range of cropping along each axis
+            double startPercent_x = 0.25;
+            double endPercent_x = 0.75;
+            double startPercent_y = 0.25;
+            double endPercent_y = 0.75;
+            double startPercent_z = 0.0;
+            double endPercent_z = 1.0;
+            cropDataSet(nin_cropped, nin, startPercent_x, endPercent_x, startPercent_y, endPercent_y, startPercent_z, endPercent_z);
+            if (opt.verbose)
+            {
+                cout << "Finish cropping input Nrrd data" << endl;
+            }
+
+            generateRange(nin_cropped, range_GFP, range_RFP, opt.rangeMinPercentile, opt.rangeMaxPercentile, opt.verbose, mop);
+        }
 
         // *********************** alone z-axis ******************************
         makeProjImage(nin, "z", 0.0, 1.0, imageOutPath_z, range_GFP, range_RFP, opt.verbose, mop);
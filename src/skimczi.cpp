@@ -8,6 +8,7 @@
 #include <cinttypes>
 #include <sys/types.h>
 #include <cfloat>
+#include <climits>
 #include <cstring>
 #include <unistd.h>
 #include <fcntl.h>
@@ -26,6 +27,17 @@
 #include "skimczi.h"
 #include "util.h"
 #include "skimczi_util.h"
+#include "czimap.h"
+#include "czidecode.h"
+#include "sliceprefetch.h"
+#include "projkernel.h"
+#include "cziwatch.h"
+#include "cziintegrity.h"
+#include "czistats.h"
+#include "czipyramid.h"
+#include "czidataset.h"
+#include "czipreview.h"
+#include "pixeltraits.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/range/iterator_range.hpp>
@@ -36,8 +48,10 @@
 #include <iostream>
 #include <vector>
 #include <memory>
+#include <algorithm>
 
 #include <chrono> 
+#include <omp.h>
 
 using namespace std;
 namespace fs = boost::filesystem;
@@ -133,6 +147,401 @@ string GenerateOutName(const int num, const int digit, const string type)
     return outName;
 }
 
+// with --with-proj, a file is only done once its three projection files exist as well
+bool skim_projections_exist(string const &projPath, int sequenceNum)
+{
+    if (projPath.empty())
+        return true;
+
+    string projCommon = projPath + GenerateOutName(sequenceNum, 3, "-proj");
+    return fs::exists(projCommon + "XY.nrrd")
+        && fs::exists(projCommon + "XZ.nrrd")
+        && fs::exists(projCommon + "YZ.nrrd");
+}
+
+// with --repack, a file is only done once its raw volume exists as well
+bool skim_repack_exists(string const &repackPath, int sequenceNum)
+{
+    if (repackPath.empty())
+        return true;
+
+    return fs::exists(fs::path(repackPath) / GenerateOutName(sequenceNum, 3, ".raw"));
+}
+
+// with --stats, a file is only done once its statistics sidecar exists as well
+bool skim_stats_exist(string const &nhdrPath, int sequenceNum, bool stats)
+{
+    return !stats || fs::exists(nhdrPath + GenerateOutName(sequenceNum, 3, ".stats"));
+}
+
+// with --pyramid, a file is only done once its coarsest level exists as well
+bool skim_pyramid_exists(string const &nhdrPath, int sequenceNum, int levels)
+{
+    return levels <= 0
+        || fs::exists(czi_pyramid_file_name(nhdrPath + GenerateOutName(sequenceNum, 3, ".nhdr"), min(levels, CZIPYRAMID_MAX_LEVELS)));
+}
+
+// a file is done once its nhdr and xml and every output asked for exist,
+// a mosaic once the layout of its tiles does, which is written after all of them;
+// with --preview, once its xml and preview frame do. A file of "numT" timepoints starting at
+// "firstNum" is written in order, so it is done once its last timepoint is
+bool skim_outputs_exist(skimOptions const &opt, int firstNum, int numT = 1)
+{
+    int sequenceNum = firstNum + max(numT, 1) - 1;
+    string nhdrFileName = opt.nhdr_path + GenerateOutName(sequenceNum, 3, ".nhdr");
+    string xmlFileName = opt.nhdr_path + GenerateOutName(sequenceNum, 3, ".xml");
+    if (!fs::exists(xmlFileName))
+        return false;
+    if (!opt.preview_path.empty())
+        return fs::exists(czi_preview_frame_name(opt.preview_path, nhdrFileName));
+    if (fs::exists(czi_tiles_layout_file_name(nhdrFileName)))
+        return true;
+    return fs::exists(nhdrFileName)
+        && skim_projections_exist(opt.proj_path, sequenceNum)
+        && skim_repack_exists(opt.repack_path, sequenceNum)
+        && skim_stats_exist(opt.nhdr_path, sequenceNum, opt.stats)
+        && skim_pyramid_exists(opt.nhdr_path, sequenceNum, opt.pyramid);
+}
+
+// number of the first nhdr of the .czi file "name" of "dir" and its number of timepoints "numT", as
+// directory mode numbers them
+static int skim_first_timepoint(string const &dir, string const &name, int sequenceNum, int &numT)
+{
+    vector< pair<int, string> > files;
+    for (string const &curFile : GetDirectoryFiles(dir))
+    {
+        int curNum;
+        if (czi_file_sequence_number(curFile, curNum))
+            files.push_back(make_pair(curNum, curFile));
+    }
+    sort(files.begin(), files.end());
+    czi_group_file_parts(dir, files);
+
+    // only the files before it move its number
+    size_t kept = 0;
+    while (kept < files.size() && (files[kept].first < sequenceNum || files[kept].second == name))
+        kept++;
+    files.resize(kept);
+    vector<int> counts;
+    vector<int> first = czi_first_timepoints(dir, files, counts);
+    for (size_t i = 0; i < files.size(); i++)
+        if (files[i].second == name)
+        {
+            numT = counts[i];
+            return first[i];
+        }
+    numT = 1;
+    return sequenceNum;
+}
+
+// skim "opt" with the pixel reads of its timepoints under "governor", null for no limit
+static void skim_governed(skimOptions const &opt, IoGovernor *governor)
+{
+    skimOptions fileOpt = opt;
+    fileOpt.governor = governor;
+    Skim(fileOpt).main();
+}
+
+vector<skimOptions> skim_file_jobs(skimOptions const &opt, vector< pair<int, string> > files)
+{
+    // parts of split datasets are no timepoints of their own, they go with their first file
+    map<string, map<int, string> > fileParts = czi_group_file_parts(opt.czi_path, files);
+    if (!fileParts.empty())
+    {
+        size_t numParts = 0;
+        for (auto const &parts : fileParts)
+            numParts += parts.second.size();
+        cout << numParts << " of them are further parts of " << fileParts.size() << " split CZI files" << endl << endl;
+    }
+
+    // files of several timepoints move the numbers of the files after them
+    vector<int> numT;
+    vector<int> firstNum = czi_first_timepoints(opt.czi_path, files, numT);
+
+    // every file gets its own copy of the options, so workers never share output names
+    vector<skimOptions> fileOpts;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        // generate the complete path for output files
+        string nhdrFileName = opt.nhdr_path + GenerateOutName(firstNum[i], 3, ".nhdr");
+        string xmlFileName = opt.nhdr_path + GenerateOutName(firstNum[i], 3, ".xml");
+
+        // we want to check if current potential output file already exists, if so, skip
+        if (skim_outputs_exist(opt, firstNum[i], numT[i]))
+        {
+            cout << "Both " << nhdrFileName << " and " << xmlFileName << " exist, continue to next." << endl << endl;
+            continue;
+        }
+
+        skimOptions fileOpt = opt;
+        fileOpt.file = files[i].second;
+        fileOpt.nhdr_out_name = nhdrFileName;
+        fileOpt.xml_out_name = xmlFileName;
+        fileOpt.quiet = opt.jobs > 1;
+        auto parts = fileParts.find(files[i].second);
+        if (parts != fileParts.end())
+            fileOpt.file_parts = parts->second;
+        fileOpts.push_back(fileOpt);
+    }
+    return fileOpts;
+}
+
+vector<skimOptions> skim_single_file_jobs(skimOptions const &opt, int sequenceNum)
+{
+    // a part of a split dataset is read along with its first file
+    if (czi_is_file_part(opt.czi_path))
+    {
+        cout << opt.czi_path << " is a further part of a split CZI file, skim the first file of it instead" << endl;
+        return vector<skimOptions>();
+    }
+
+    // numbered as in directory mode, after the timepoints of the files before it
+    fs::path cziPath(opt.czi_path);
+    string cziDir = cziPath.has_parent_path() ? cziPath.parent_path().string() : ".";
+    int numT;
+    int firstNum = skim_first_timepoint(cziDir, cziPath.filename().string(), sequenceNum, numT);
+
+    // generate the complete path for output files
+    string nhdrFileName = opt.nhdr_path + GenerateOutName(firstNum, 3, ".nhdr");
+    string xmlFileName = opt.nhdr_path + GenerateOutName(firstNum, 3, ".xml");
+
+    // we want to check if current potential output file already exists, if so, skip
+    if (skim_outputs_exist(opt, firstNum, numT))
+    {
+        cout << "Both " << nhdrFileName << " and " << xmlFileName << " exist, no need to process again." << endl << endl;
+        return vector<skimOptions>();
+    }
+
+    skimOptions fileOpt = opt;
+    fileOpt.file = opt.czi_path;
+    fileOpt.nhdr_out_name = nhdrFileName;
+    fileOpt.xml_out_name = xmlFileName;
+    fileOpt.file_parts = czi_find_file_parts(cziDir, cziPath.filename().string());
+    return vector<skimOptions>(1, fileOpt);
+}
+
+// skim every file in "fileOpts" on a pool of "jobs" workers; a failing file does not stop the others,
+// and the per-file results are reported in input order
+void run_skim_jobs(vector<skimOptions> const &fileOpts, int jobs)
+{
+    int numJobs = fileOpts.size();
+    if (numJobs == 0)
+        return;
+    jobs = max(1, min(jobs, numJobs));
+
+    // shared state that must be set up before the workers start
+    if (!checkIfDirectory(fileOpts[0].nhdr_path))
+    {
+        cout << fileOpts[0].nhdr_path << " does not exits, but has been created" << endl;
+        boost::filesystem::create_directory(fileOpts[0].nhdr_path);
+    }
+    if (!fileOpts[0].proj_path.empty() && !checkIfDirectory(fileOpts[0].proj_path))
+    {
+        cout << fileOpts[0].proj_path << " does not exits, but has been created" << endl;
+        boost::filesystem::create_directory(fileOpts[0].proj_path);
+    }
+    if (!fileOpts[0].repack_path.empty() && !checkIfDirectory(fileOpts[0].repack_path))
+    {
+        cout << fileOpts[0].repack_path << " does not exits, but has been created" << endl;
+        boost::filesystem::create_directory(fileOpts[0].repack_path);
+    }
+    if (!fileOpts[0].preview_path.empty() && !checkIfDirectory(fileOpts[0].preview_path))
+    {
+        cout << fileOpts[0].preview_path << " does not exits, but has been created" << endl;
+        boost::filesystem::create_directory(fileOpts[0].preview_path);
+    }
+    xmlInitParser();
+
+    if (jobs > 1)
+        cout << "Skimming " << numJobs << " files with " << jobs << " workers" << endl << endl;
+    IoGovernor governor(fileOpts[0].io, jobs, fileOpts[0].nhdr_path);
+
+    vector<string> results(numJobs);
+    vector<bool> finished(numJobs, false);
+    int nextToReport = 0;
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(jobs)
+    for (int i = 0; i < numJobs; i++)
+    {
+        string result;
+        auto start = chrono::high_resolution_clock::now();
+        try 
+        {
+            skim_governed(fileOpts[i], &governor);
+            auto stop = chrono::high_resolution_clock::now();
+            result = "done in " + to_string(chrono::duration_cast<chrono::seconds>(stop - start).count()) + " seconds";
+        } 
+        catch(LSPException &e) 
+        {
+            result = "Exception thrown by " + e.get_func() + "() in " + e.get_file() + ": " + e.what();
+        }
+        catch(std::exception &e)
+        {
+            result = string("Exception: ") + e.what();
+        }
+
+        // print every result that is now contiguous with the ones already reported
+        #pragma omp critical(skim_progress)
+        {
+            results[i] = result;
+            finished[i] = true;
+            while (nextToReport < numJobs && finished[nextToReport])
+            {
+                ostream &out = results[nextToReport].compare(0, 9, "Exception") ? cout : cerr;
+                out << "[" << nextToReport + 1 << "/" << numJobs << "] " << fileOpts[nextToReport].file
+                    << " -> " << fileOpts[nextToReport].nhdr_out_name << ": " << results[nextToReport] << endl;
+                nextToReport++;
+            }
+        }
+    }
+
+    if (jobs > 1 && fileOpts[0].verbose)
+        cout << "Read bandwidth " << governor.bandwidth() << " MB/s with up to " << governor.limit()
+             << " files read at the same time" << endl;
+    xmlCleanupParser();
+}
+
+// a first .czi file the watch has seen, with the parts of it completed so far
+struct SkimWatchFile {
+    int sequenceNum;
+    int numT;
+    // files its SubBlockDirectory lists subblocks in, itself included
+    int numParts;
+    map<int, string> parts;
+    bool tried;
+};
+
+void run_skim_watch(skimOptions const &opt, function<void()> const &fileDone)
+{
+    CziDirectoryWatcher watcher(opt.czi_path, opt.watch_settle);
+    cout << endl << "Watching " << opt.czi_path << " for completed .czi files";
+    if (opt.watch_idle > 0)
+        cout << ", stopping after " << opt.watch_idle << " seconds without changes";
+    cout << endl << endl;
+
+    xmlInitParser();
+    IoGovernor governor(opt.io, 1, opt.nhdr_path);
+    int numSkimmed = 0;
+
+    // the grouping of parts is kept up to date with every completed file, instead of reading the headers
+    // of the whole directory again for each of them
+    map<string, SkimWatchFile> files;               // first files by name
+    map<string, string> fileGuids;                  // FileGuid -> name of the first file
+    map<string, map<int, string> > earlyParts;      // PrimaryFileGuid -> parts completed before their first file
+
+    // "again" skims a file whose outputs exist, for a part that completed after it was skimmed
+    auto skim_file = [&](string const &name, bool again)
+    {
+        SkimWatchFile &file = files[name];
+        file.tried = true;
+
+        // numbered past the timepoints of the files before it, which an acquisition completes first
+        int firstNum = file.sequenceNum;
+        for (auto const &other : files)
+            if (other.second.sequenceNum < file.sequenceNum)
+                firstNum += other.second.numT - 1;
+        string nhdrFileName = opt.nhdr_path + GenerateOutName(firstNum, 3, ".nhdr");
+        string xmlFileName = opt.nhdr_path + GenerateOutName(firstNum, 3, ".xml");
+        if (!again && skim_outputs_exist(opt, firstNum, file.numT))
+        {
+            cout << "Both " << nhdrFileName << " and " << xmlFileName << " exist, continue to next." << endl << endl;
+            return;
+        }
+
+        skimOptions fileOpt = opt;
+        fileOpt.file = name;
+        fileOpt.nhdr_out_name = nhdrFileName;
+        fileOpt.xml_out_name = xmlFileName;
+        fileOpt.file_parts = file.parts;
+
+        auto start = chrono::high_resolution_clock::now();
+        try 
+        {
+            skim_governed(fileOpt, &governor);
+        } 
+        catch(LSPException &e) 
+        {
+            std::cerr << "Exception thrown by " << e.get_func() << "() in " << e.get_file() << ": " << e.what() << std::endl;
+            return;
+        }
+        auto stop = chrono::high_resolution_clock::now();
+        cout << name << " -> " << nhdrFileName << ": done in "
+             << chrono::duration_cast<chrono::seconds>(stop - start).count() << " seconds" << endl << endl;
+        numSkimmed++;
+
+        if (fileDone)
+            fileDone();
+    };
+
+    string name;
+    while (watcher.next(name, opt.watch_idle))
+    {
+        string path = (fs::path(opt.czi_path) / name).string();
+        CziHeaderInfo header;
+        if (!czi_read_file_header(path, header))
+        {
+            cout << "WARNING: could not read the file header of " << path << ", skipping it" << endl;
+            continue;
+        }
+
+        // parts of a split dataset are read along with its first file
+        if (header.FilePart > 0)
+        {
+            string guid(header.PrimaryFileGuid, sizeof(header.PrimaryFileGuid));
+            auto first = fileGuids.find(guid);
+            if (first == fileGuids.end())
+            {
+                earlyParts[guid][(int)header.FilePart] = name;
+                continue;
+            }
+
+            SkimWatchFile &file = files[first->second];
+            file.parts[(int)header.FilePart] = name;
+            if (file.tried)
+            {
+                cout << name << " is part " << header.FilePart << " of " << first->second
+                     << ", which was skimmed without it, skimming it again" << endl;
+                skim_file(first->second, true);
+            }
+            else if (file.parts.size() + 1 >= (size_t)file.numParts)
+                skim_file(first->second, false);
+            continue;
+        }
+
+        SkimWatchFile &file = files[name];
+        czi_file_sequence_number(name, file.sequenceNum);
+        czi_directory_extent(path, file.numT, file.numParts);
+        file.tried = false;
+        string guid(header.FileGuid, sizeof(header.FileGuid));
+        fileGuids[guid] = name;
+        auto early = earlyParts.find(guid);
+        if (early != earlyParts.end())
+        {
+            file.parts = early->second;
+            earlyParts.erase(early);
+        }
+
+        // a split file is held back until the parts its directory lists have completed as well
+        if (file.parts.size() + 1 >= (size_t)file.numParts)
+            skim_file(name, false);
+        else
+            cout << name << " has subblocks in " << file.numParts - 1 << " further parts, waiting for them" << endl << endl;
+    }
+
+    // parts that never completed are left missing, the integrity check reports their slices
+    for (auto const &file : files)
+        if (!file.second.tried)
+            skim_file(file.first, false);
+    for (auto const &parts : earlyParts)
+        for (auto const &part : parts.second)
+            cout << "WARNING: " << part.second << " is part " << part.first << " of a CZI dataset whose first file is not in "
+                 << opt.czi_path << ", skipping it" << endl;
+    xmlCleanupParser();
+
+    cout << "No changes in " << opt.czi_path << " for " << opt.watch_idle << " seconds, stopped watching after skimming "
+         << numSkimmed << " files" << endl << endl;
+}
+
 void setup_skim(CLI::App &app) 
 {
     auto opt = std::make_shared<skimOptions>();
@@ -145,6 +554,27 @@ void setup_skim(CLI::App &app)
     sub->add_option("-i, --czi_path", opt->czi_path, "Input czi files directory or single file name (single file mode)")->required();
     sub->add_option("-o, --nhdr_path", opt->nhdr_path, "Output directory where outputs will be saved at")->required();
     sub->add_option("-v, --verbose", opt->verbose, "Level of verbose debugging messages");
+    sub->add_option("-p, --with-proj", opt->proj_path, "Also compute the projection files while skimming and save them in this directory, "
+                                                        "so that lsp proj does not need to read the data again");
+    sub->add_option("--prefetch", opt->prefetch, "Number of slice buffers an I/O thread fills ahead of the projections, "
+                                                  "0 reads slices from a memory mapping instead (Default: 4)");
+    sub->add_option("-j, --jobs", opt->jobs, "Number of .czi files skimmed in parallel in directory mode (Default: 1)");
+    sub->add_option("-r, --repack", opt->repack_path, "Also copy every timepoint into a contiguous raw volume in this directory, e.g. on "
+                                                     "local scratch, and let its nhdr read from there instead of from the CZI file");
+    sub->add_flag("-s, --stats", opt->stats, "Also write per-slice and per-channel min/max/mean and histograms of every timepoint "
+                                            "into NNN.stats next to its nhdr, for anim --stats and resamp --stats");
+    sub->add_option("--pyramid", opt->pyramid, "Also write this many box-downsampled levels of every timepoint, 1 to 3 for 2x, 4x "
+                                                "and 8x smaller along x, y and z, as NNN-L1.nrrd, ... next to its nhdr (Default: 0)");
+    sub->add_flag("-w, --watch", opt->watch, "Keep watching the input directory of a running acquisition and skim every .czi file "
+                                            "as soon as it has been written completely");
+    sub->add_option("--watch-idle", opt->watch_idle, "Stop watching after this many seconds without changes in the input directory, "
+                                                      "0 watches forever (Default: 1800)");
+    sub->add_option("--watch-settle", opt->watch_settle, "Seconds the size of a .czi file has to stay the same before it is "
+                                                          "checked for completeness (Default: 10)");
+    sub->add_option("--preview", opt->preview_path, "Only write low resolution projections and an 8-bit frame of every timepoint "
+                                                     "into this directory, from the image pyramid embedded in the CZI file when it has "
+                                                     "one, otherwise from every 4th row, column and slice; no nhdr or other outputs");
+    add_io_options(sub, opt->io);
 
     // we no longer want to have base number involved
     //sub->add_option("-b, --base_name", opt->base_name, "Base name that for the sequence of input czi files, for example, the files might be named as 1811131.czi, 1811132.czi, base name is 181113")->required();
@@ -157,9 +587,26 @@ void setup_skim(CLI::App &app)
     sub->set_callback([opt]() 
     {
         auto start = chrono::high_resolution_clock::now();
+        opt->io.verbose = opt->verbose;
         // we need to go through all the files in the given path "input_path" and find all .czi files
         // first check this input path is a directory or a single file name
-        if (checkIfDirectory(opt->czi_path))
+        if (opt->watch)
+        {
+            if (!checkIfDirectory(opt->czi_path))
+            {
+                cout << "ERROR: --watch needs an input directory, " << opt->czi_path << " is not one" << endl;
+                return;
+            }
+            try
+            {
+                run_skim_watch(*opt, nullptr);
+            }
+            catch(LSPException &e) 
+            {
+                std::cerr << "Exception thrown by " << e.get_func() << "() in " << e.get_file() << ": " << e.what() << std::endl;
+            }
+        }
+        else if (checkIfDirectory(opt->czi_path))
         {
             cout << endl << "Input path " << opt->czi_path << " is valid, start processing" << endl;
         
@@ -222,40 +669,8 @@ void setup_skim(CLI::App &app)
             {
                 cout << "ERROR: Not all valid files have been recorded" << endl;
             }
-                
-            // generate output files by running main
-            for (int i = 0; i < allValidFiles.size(); i++) 
-            {                
-                string nhdrFileName, xmlFileName;
-
-                // we need to refresh both for each iteration
-                opt->nhdr_out_name = "";
-                opt->xml_out_name = "";
-
-                // generate the complete path for output files
-                nhdrFileName = opt->nhdr_path + GenerateOutName(allValidFiles[i].first, 3, ".nhdr");
-                xmlFileName = opt->nhdr_path + GenerateOutName(allValidFiles[i].first, 3, ".xml");
-
-                // we want to check if current potential output file already exists, if so, skip
-                if (fs::exists(nhdrFileName) && fs::exists(xmlFileName))
-                {
-                    cout << "Both " << nhdrFileName << " and " << xmlFileName << " exist, continue to next." << endl << endl;
-                    continue;
-                }
-                
-                // run the processing program
-                try 
-                {
-                    opt->file = allValidFiles[i].second;
-                    opt->nhdr_out_name = nhdrFileName;
-                    opt->xml_out_name = xmlFileName;
-                    Skim(*opt).main();
-                } 
-                catch(LSPException &e) 
-                {
-                    std::cerr << "Exception thrown by " << e.get_func() << "() in " << e.get_file() << ": " << e.what() << std::endl;
-                }
-            }
+
+            run_skim_jobs(skim_file_jobs(*opt, allValidFiles), opt->jobs);
         }
         // Single file mode if the input_path is a single file path
         else
@@ -303,30 +718,7 @@ void setup_skim(CLI::App &app)
                 sequenceNum = 0;
             }
 
-            string nhdrFileName, xmlFileName;
-            // generate the complete path for output files
-            nhdrFileName = opt->nhdr_path + GenerateOutName(sequenceNum, 3, ".nhdr");
-            xmlFileName = opt->nhdr_path+ GenerateOutName(sequenceNum, 3, ".xml");
-
-            // we want to check if current potential output file already exists, if so, skip
-            if (fs::exists(nhdrFileName) && fs::exists(xmlFileName))
-            {
-                cout << "Both " << nhdrFileName << " and " << xmlFileName << " exist, no need to process again." << endl << endl;
-                return;
-            }
-        
-            try 
-            {
-                opt->file = curFile;
-                opt->nhdr_out_name = nhdrFileName;
-                opt->xml_out_name = xmlFileName;
-                Skim(*opt).main();
-            } 
-            catch(LSPException &e) 
-            {
-                std::cerr << "Exception thrown by " << e.get_func() << "() in " << e.get_file() << ": " << e.what() << std::endl;
-            }
-
+            run_skim_jobs(skim_single_file_jobs(*opt, sequenceNum), 1);
         }
 
         auto stop = chrono::high_resolution_clock::now(); 
@@ -338,7 +730,6 @@ void setup_skim(CLI::App &app)
 
 Skim::Skim(skimOptions const &opt)
 : opt(opt), mop(airMopNew()),
-    current_f(nullptr),
     proj_max_xy(nullptr),
     proj_mean_xy(nullptr),
     proj_max_xz(nullptr),
@@ -360,9 +751,12 @@ Skim::Skim(skimOptions const &opt)
     else
         cziFileName = opt.file;
 
-    cout << "Current procesing file is: " << cziFileName << endl;
-    cout << "Output .nhdr file path is: " << nhdrFileName << endl;
-    cout << "Output .xml file path is: " << xmlFileName << endl;
+    if (!opt.quiet)
+    {
+        cout << "Current procesing file is: " << cziFileName << endl;
+        cout << "Output .nhdr file path is: " << nhdrFileName << endl;
+        cout << "Output .xml file path is: " << xmlFileName << endl;
+    }
 
     // if output path does not exist, create one
     if (!checkIfDirectory(outputPath))
@@ -371,6 +765,30 @@ Skim::Skim(skimOptions const &opt)
         boost::filesystem::create_directory(outputPath);
     }
 
+    if (!opt.repack_path.empty() && !checkIfDirectory(opt.repack_path))
+    {
+        cout << opt.repack_path << " does not exits, but has been created" << endl;
+        boost::filesystem::create_directory(opt.repack_path);
+    }
+
+    if (!opt.preview_path.empty() && !checkIfDirectory(opt.preview_path))
+    {
+        cout << opt.preview_path << " does not exits, but has been created" << endl;
+        boost::filesystem::create_directory(opt.preview_path);
+    }
+
+    // projections share the three-digit base name of the nhdr file, e.g. 000-projXY.nrrd
+    if (!opt.proj_path.empty())
+    {
+        if (!checkIfDirectory(opt.proj_path))
+        {
+            cout << opt.proj_path << " does not exits, but has been created" << endl;
+            boost::filesystem::create_directory(opt.proj_path);
+        }
+        string baseName = fs::path(nhdrFileName).stem().string();
+        projBaseFileName = opt.proj_path + baseName;
+    }
+
     if (opt.verbose) 
     {
         std::cout << "===========PATHS==========" << endl;
@@ -380,10 +798,10 @@ Skim::Skim(skimOptions const &opt)
         std::cout << "NHDR : " <<  nhdrFileName << endl;
         std::cout << "XML  : " <<  xmlFileName << endl;
     
-        // if (!projBaseFileName.empty()) 
-        // {
-        //     std::cout << "PROJs: " << projBaseFileName << "-projXX.nrrd" << endl;
-        // }
+        if (!projBaseFileName.empty()) 
+        {
+            std::cout << "PROJs: " << projBaseFileName << "-projXX.nrrd" << endl;
+        }
         std::cout << "==========================" << endl;
     }
 
@@ -398,13 +816,31 @@ Skim::Skim(skimOptions const &opt)
     if (opt.verbose)
         cout << cziFileName << " has been openned" << endl;
 
-    
-    // output file
-    nhdrFile = fopen(nhdrFileName.c_str(), "w");
 
     // Re-used for all SID segments
     currentSID = (SID*)malloc(sizeof(SID));
     airMopAdd(mop, currentSID, airFree, airMopAlways);
+    headerInfo = nullptr;
+    xml = nullptr;
+    xmlSize = 0;
+    compressed = false;
+    writeRaw = false;
+    tileX = tileY = 0;
+
+    // the other parts of a split dataset lie next to the first one
+    partFileNames.assign(1, cziFileName);
+    partFiles.assign(1, cziFile);
+    for (auto const &part : opt.file_parts)
+    {
+        if (part.first < 1)
+            continue;
+        if ((size_t)part.first >= partFileNames.size())
+        {
+            partFileNames.resize(part.first + 1);
+            partFiles.resize(part.first + 1, -1);
+        }
+        partFileNames[part.first] = (fs::path(cziFileName).parent_path() / part.second).string();
+    }
 }
 
 
@@ -423,7 +859,7 @@ void Skim::parse_file(){
     //======================//
 
     // The header data for this file
-    CziHeaderInfo *headerInfo = (CziHeaderInfo*)malloc(sizeof(CziHeaderInfo));
+    headerInfo = (CziHeaderInfo*)malloc(sizeof(CziHeaderInfo));
     airMopAdd(mop, headerInfo, airFree, airMopAlways);
     memset(headerInfo, 0, sizeof(CziHeaderInfo));
 
@@ -441,6 +877,7 @@ void Skim::parse_file(){
                 fprintf(stdout, "Minor      : %" PRIu32"\n", headerInfo->Minor);
                 fprintf(stdout, "FilePart   : %" PRIu32"\n", headerInfo->FilePart);
                 fprintf(stdout, "MetaDataPos: %lu\n", headerInfo->MetadataPosition);
+                fprintf(stdout, "DirectoryPos: %lu\n", headerInfo->DirectoryPosition);
                 fprintf(stdout, "UpdatePend : %" PRIu32"\n", headerInfo->UpdatePending);
                 fprintf(stdout, "==========================\n\n");
             }
@@ -479,29 +916,23 @@ void Skim::parse_file(){
         fprintf(stdout, "==========================\n\n");
     }
 
-    // Grab the XML
-    char *xml = (char*)malloc(metaDataSegment->XmlSize);
+    // Grab the XML, kept for the sidecars of further timepoints
+    xmlSize = metaDataSegment->XmlSize;
+    xml = (char*)malloc(xmlSize);
     airMopAdd(mop, xml, airFree, airMopAlways);
-    read(cziFile, xml, metaDataSegment->XmlSize);
+    if (read(cziFile, xml, metaDataSegment->XmlSize) != (ssize_t)metaDataSegment->XmlSize)
+        throw LSPException("Could not read the XML metadata\n", "skimczi.cpp", "Skim::parse_file");
 
-    // Write XML to file
-    write(xmlFile, xml, metaDataSegment->XmlSize);
-
-    // Create XML doc from string in memory
-    xmlDoc *doc = NULL;
-    doc = xmlReadMemory(xml, metaDataSegment->XmlSize, "noname.xml", NULL, 0);
-    if (doc == NULL)
-        throw LSPException("Could not parse XML\n", "skimczi.cpp", "Skim::parse_file");
+    // Write XML to file, as one write of the whole block
+    if (write(xmlFile, xml, metaDataSegment->XmlSize) != (ssize_t)metaDataSegment->XmlSize)
+        throw LSPException("Could not write " + xmlFileName + "\n", "skimczi.cpp", "Skim::parse_file");
 
-    // Get the root element node
-    xmlNode *root_element = NULL;
-    root_element = xmlDocGetRootElement(doc);
-
-    // Parse XML for image dimensions
+    // Parse XML for image dimensions, streaming through it without building a DOM
     dims = (ImageDims*)malloc(sizeof(ImageDims));
     airMopAdd(mop, dims, airFree, airMopAlways);
     memset(dims, 0, sizeof(ImageDims));
-    get_image_dims(root_element, dims);
+    if (!stream_image_dims(xml, metaDataSegment->XmlSize, dims))
+        throw LSPException("Could not parse XML\n", "skimczi.cpp", "Skim::parse_file");
 
     if (verbose) {
         fprintf(stdout, "====IMAGE DIMS from XML===\n");
@@ -525,18 +956,18 @@ void Skim::parse_file(){
         throw LSPException(msg, "skimczi.cpp", "Skim::parse_file");
     }
 
-    // Clean up XML parser
-    xmlFreeDoc(doc);
-    xmlCleanupParser();
-
+    // the XML parser itself is cleaned up once all files are done,
+    // since other files may still be parsing in parallel
     close(xmlFile);
 }
 
 
-void Skim::update_projections(){
-    unsigned int sizeX = (unsigned int)dims->sizeX;
-    unsigned int sizeY = (unsigned int)dims->sizeY;
-    unsigned int sizeZ = (unsigned int)dims->sizeZ;
+// "current" is the slice (curr_c, curr_z), read straight out of the mapped CZI file
+template<typename T>
+void Skim::update_projections(const T *current){
+    size_t sizeX = (size_t)dims->sizeX;
+    size_t sizeY = (size_t)dims->sizeY;
+    size_t sizeZ = (size_t)dims->sizeZ;
 
     /* update pointers to what will actually be used in this call */
     size_t off_xy = sizeX * sizeY * curr_c;
@@ -545,59 +976,249 @@ void Skim::update_projections(){
 
     size_t off_yz = sizeY * (curr_z + sizeZ * curr_c);
 
-    /* all initializations */
+    /* all initializations, the XZ and YZ rows are written whole by every slice */
     if (curr_z == 0)
+        proj_init_xy(proj_max_xy + off_xy, proj_mean_xy + off_xy, sizeX*sizeY);
+
+    ProjSliceTargets targets;
+    targets.maxXY = proj_max_xy + off_xy;
+    targets.meanXY = proj_mean_xy + off_xy;
+    targets.maxXZ = proj_max_xz + off_xz;
+    targets.meanXZ = proj_mean_xz + off_xz;
+    targets.maxYZ = proj_max_yz + off_yz;
+    targets.meanYZ = proj_mean_yz + off_yz;
+    targets.scaleXY = 1.0f / sizeZ;
+    targets.scaleXZ = 1.0f / sizeY;
+    targets.scaleYZ = 1.0f / sizeX;
+    proj_accumulate_slice(current, sizeX, sizeY, targets);
+}
+
+
+struct Skim::ProjectSlice {
+    Skim *skim;
+    const unsigned char *slice;
+    template<typename T> void operator()(PixelTag<T>) const { skim->update_projections((const T*)slice); }
+};
+
+// typed projection update for one raw slice of the file's pixel type
+void Skim::project_slice(const unsigned char *slice){
+    if (!pixel_dispatch_czi(dims->pixelType, ProjectSlice{this, slice}))
+        throw LSPException("Can't deal with given pixelType\n",
+                    "skimczi.cpp", "Skim::project_slice");
+}
+
+
+void Skim::find_subblocks(){
+    //=====================//
+    // Locate Image Blocks //
+    //=====================//
+    int verbose = opt.verbose;
+
+    // all parts are opened and listed at the same time, each from its SubBlockDirectory, where one
+    // read of it replaces walking all the segments, or by scanning its segments when it has none
+    size_t numParts = partFiles.size();
+    vector< vector<CziSubBlockInfo> > found(numParts);
+    vector<char> scanned(numParts, 0);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (long p = 0; p < (long)numParts; p++)
+    {
+        uint64_t directoryPosition = headerInfo->DirectoryPosition;
+        if (p > 0)
+        {
+            CziHeaderInfo header;
+            if (partFileNames[p].empty() || !czi_read_file_header(partFileNames[p], header))
+                continue;
+            partFiles[p] = open(partFileNames[p].c_str(), O_RDONLY);
+            if (partFiles[p] < 0)
+                continue;
+            directoryPosition = header.DirectoryPosition;
+        }
+
+        if (!read_subblock_directory(partFiles[p], directoryPosition, found[p]))
+        {
+            scanned[p] = 1;
+            scan_subblocks(partFiles[p], (int)p, found[p]);
+        }
+
+        // what a further part lists itself lies in that part
+        if (p > 0)
+            for (CziSubBlockInfo &info : found[p])
+                info.entry.FilePart = (int32_t)p;
+    }
+
+    // the directory of the first part usually lists the subblocks of all parts, so the
+    // same subblock may be found twice
+    subBlocks.clear();
+    for (size_t p = 0; p < numParts; p++)
+    {
+        if (p > 0 && partFiles[p] < 0)
+            cout << "WARNING: part " << p << " of " << cziFileName << (partFileNames[p].empty() ? " was not found" : ", "
+                 + partFileNames[p] + ", could not be opened") << ", its slices are missing" << endl;
+        else if (scanned[p])
+            cout << "WARNING: SubBlockDirectory of " << partFileNames[p] << " is missing or damaged, scanning segments instead" << endl;
+        else if (verbose)
+            cout << "Read " << found[p].size() << " subblock entries from the SubBlockDirectory of " << partFileNames[p] << endl;
+        subBlocks.insert(subBlocks.end(), found[p].begin(), found[p].end());
+    }
+    sort(subBlocks.begin(), subBlocks.end(),
+         [](const CziSubBlockInfo &a, const CziSubBlockInfo &b)
+         {
+             if (a.entry.FilePart != b.entry.FilePart) return a.entry.FilePart < b.entry.FilePart;
+             return a.entry.FilePosition < b.entry.FilePosition;
+         });
+    subBlocks.erase(unique(subBlocks.begin(), subBlocks.end(),
+                           [](const CziSubBlockInfo &a, const CziSubBlockInfo &b)
+                           {
+                               return a.entry.FilePart == b.entry.FilePart && a.entry.FilePosition == b.entry.FilePosition;
+                           }),
+                    subBlocks.end());
+
+    // subblocks in parts that are not there are left out, the integrity check reports their slices as missing
+    size_t kept = 0;
+    for (size_t i = 0; i < subBlocks.size(); i++)
     {
-        for (auto idx = 0; idx < sizeX*sizeY; idx++){
-        proj_max_xy[off_xy+ idx] = FLT_MIN;
-        proj_mean_xy[off_xy+ idx] = 0;
+        int part = subBlocks[i].entry.FilePart;
+        if (part < 0 || (size_t)part >= numParts || partFiles[part] < 0)
+        {
+            if (i == 0 || subBlocks[i-1].entry.FilePart != part)
+                cout << "WARNING: " << cziFileName << " has subblocks in part " << part << ", which is not there" << endl;
+            continue;
         }
+        subBlocks[kept++] = subBlocks[i];
     }
-    for (int x = 0; x < sizeX; x++) 
+    subBlocks.resize(kept);
+
+    // pyramid subblocks are downsampled copies of the full resolution ones, only the preview reads them;
+    // they are moved into the same mosaic coordinates as the full resolution tiles
+    int minX = INT_MAX, minY = INT_MAX;
+    pyramidBlocks.clear();
+    kept = 0;
+    for (size_t i = 0; i < subBlocks.size(); i++)
     {
-        proj_max_xz[off_xz + x] = FLT_MIN;
-        proj_mean_xz[off_xz + x] = 0;
+        if (czi_subblock_is_pyramid(subBlocks[i]))
+        {
+            pyramidBlocks.push_back(subBlocks[i]);
+            continue;
+        }
+        minX = min(minX, subBlocks[i].x);
+        minY = min(minY, subBlocks[i].y);
+        subBlocks[kept++] = subBlocks[i];
     }
-    for (int y = 0; y < sizeY; y++) 
+    subBlocks.resize(kept);
+    for (CziSubBlockInfo &block : pyramidBlocks)
     {
-        proj_max_yz[off_yz + y] = FLT_MIN;
-        proj_mean_yz[off_yz + y] = 0;
+        block.x -= kept ? minX : 0;
+        block.y -= kept ? minY : 0;
     }
+    stable_sort(pyramidBlocks.begin(), pyramidBlocks.end(),
+                [](const CziSubBlockInfo &a, const CziSubBlockInfo &b) { return a.t < b.t; });
+    if (verbose && !pyramidBlocks.empty())
+        cout << "Found " << pyramidBlocks.size() << " pyramid subblocks, left out of the full resolution data" << endl;
+
+    // mosaic tiles are told apart by their M index and position, every tile gets its own nhdr
+    tiles = czi_index_tiles(subBlocks);
+    if (verbose && tiles.size() > 1)
+        cout << "Found " << tiles.size() << " mosaic tiles" << endl;
+
+    // NHDR axes go X Y C Z, so the slices need to be listed with c fastest
+    stable_sort(subBlocks.begin(), subBlocks.end(),
+                [](const CziSubBlockInfo &a, const CziSubBlockInfo &b)
+                {
+                    if (a.t != b.t) return a.t < b.t;
+                    if (a.tile != b.tile) return a.tile < b.tile;
+                    if (a.z != b.z) return a.z < b.z;
+                    return a.c < b.c;
+                });
+
+    // compressed slices cannot be listed in a SKIPLIST, they are decoded into a raw file instead
+    compressed = false;
+    for (size_t i = 0; i < subBlocks.size(); i++)
+        if (subBlocks[i].entry.Compression != CZICOMPRESSTYPE_RAW)
+            compressed = true;
+    if (verbose && compressed)
+        cout << "Subblocks are compressed, decoded data goes to raw files" << endl;
+    writeRaw = compressed || !opt.repack_path.empty();
+}
 
-    for (int y = 0; y < sizeY; y++)
-    {
-        for (int x = 0; x < sizeX; x++){
-        auto idx = x + sizeX*y;
-        auto cval = current_f[idx];
 
-        if (proj_max_xy[off_xy + idx] < cval) proj_max_xy[off_xy + idx] = cval;
-        proj_mean_xy[off_xy + idx] += cval / sizeZ;
+// fallback for damaged files: walk every segment of file part "part" and collect the ZISRAWSUBBLOCK headers
+void Skim::scan_subblocks(int fd, int part, std::vector<CziSubBlockInfo> &found){
+  int verbose = opt.verbose;
 
-        if (proj_max_xz[off_xz + x] < cval) proj_max_xz[off_xz + x] = cval;
-        proj_mean_xz[off_xz + x] += cval/sizeY;
+  // parts are scanned at the same time, so everything here is local to this call
+  SID sid;
+  CziSubBlockSegment imageSubBlockHeader;
+  off_t position = 0;
+  while(pread(fd, &sid, sizeof(SID), position) == sizeof(SID)){
+    // skip through file to get the image blocks
+    if (strcmp(sid.id, "ZISRAWSUBBLOCK") == 0){
+      // Read the ImageBlock header
+      memset(&imageSubBlockHeader, 0, sizeof(imageSubBlockHeader));
+      pread(fd, &imageSubBlockHeader, sizeof(CziSubBlockSegment), position + sizeof(SID));
+
+      // The segment carries its own copy of the directory entry, and lies in this part
+      CziSubBlockInfo info;
+      memset(&info, 0, sizeof(info));
+      memcpy(&info.entry, imageSubBlockHeader.SchemaType,
+             sizeof(CziDirectoryEntryDV));
+      info.entry.FilePart = part;
+      czi_subblock_info_set(info);
+      found.push_back(info);
 
-        if (proj_max_yz[off_yz + y] < cval) proj_max_yz[off_yz + y] = cval;
-        proj_mean_yz[off_yz + y] += cval / sizeX;
+      if (verbose > 1) {
+        fprintf(stdout, "======ZISRAWSUBBLOCK======\n");
+        fprintf(stdout, "ID       : %s\n", sid.id);
+        fprintf(stdout, "POS      : %ld\n", position);
+        fprintf(stdout, "allocSize: %lu\n", sid.allocatedSize);
+        fprintf(stdout, "usedSize : %lu\n", sid.usedSize);
+        fprintf(stdout, "--------CONTENTS----------\n");
+        fprintf(stdout, "MetadataSize   : %" PRIu32"\n",imageSubBlockHeader.MetadataSize);
+        fprintf(stdout, "AttachmentSize : %" PRIu32"\n",imageSubBlockHeader.AttachmentSize);
+        fprintf(stdout, "DataSize       : %lu\n",imageSubBlockHeader.DataSize);
+        fprintf(stdout, "PixelType      : %" PRIu32"\n",imageSubBlockHeader.PixelType);
+        fprintf(stdout, "FilePosition   : %lu\n",imageSubBlockHeader.FilePosition);
+        fprintf(stdout, "FilePart       : %" PRIu32"\n",imageSubBlockHeader.FilePart);
+        fprintf(stdout, "Compression    : %" PRIu32"\n",imageSubBlockHeader.Compression);
+        fprintf(stdout, "DimensionCount : %" PRIu32"\n",imageSubBlockHeader.DimensionCount);
+
+        if (verbose > 2) {
+          for (int i = 0; i < imageSubBlockHeader.DimensionCount; i++){
+            fprintf(stdout, "--------------------\n");
+            fprintf(stdout, "DimensionID     : %s\n", imageSubBlockHeader.DimensionEntries[i].Dimension);
+            fprintf(stdout, "Start           : %d\n", imageSubBlockHeader.DimensionEntries[i].Start);
+            fprintf(stdout, "Size            : %d\n", imageSubBlockHeader.DimensionEntries[i].Size);
+            fprintf(stdout, "StartCoordinate : %f\n", imageSubBlockHeader.DimensionEntries[i].StartCoordinate);
+            fprintf(stdout, "StoredSize      : %d\n", imageSubBlockHeader.DimensionEntries[i].StoredSize);
+            fprintf(stdout, "--------------------\n");
+          }
         }
+
+        fprintf(stdout, "DataBegin      : %ld\n", info.dataBegin);
+        fprintf(stdout, "==========================\n\n");
+      }
     }
+
+    // Advance to the next SID
+    position += sizeof(SID) + sid.allocatedSize;
+  }
 }
 
 
-void Skim::generate_nhdr(){
+// slices of one timepoint, subBlocks[first, last)
+void Skim::generate_nhdr(size_t first, size_t last){
     //======================//
     // Generate NRRD Header //
     //======================//
 
+    nhdrFile = fopen(nhdrFileName.c_str(), "w");
+    if (!nhdrFile)
+        throw LSPException("Could not open " + nhdrFileName + " for writing\n", "skimczi.cpp", "Skim::generate_nhdr");
+
     // NRRD Flavor
     fprintf(nhdrFile, "NRRD0006\n");
 
     // Pixel Type - (CZI p.23)
-    if (dims->pixelType == CZIPIXELTYPE_GRAY8)
-        fprintf(nhdrFile, "type: uchar\n");
-    else if (dims->pixelType == CZIPIXELTYPE_GRAY16)
-        fprintf(nhdrFile, "type: ushort\n");
-    else if (dims->pixelType == CZIPIXELTYPE_GRAY32FLOAT)
-        fprintf(nhdrFile, "type: float\n");
+    fprintf(nhdrFile, "type: %s\n", pixel_nrrd_name(dims->pixelType));
 
     // Endianness - (CZI p.7)
     fprintf(nhdrFile, "endian: little\n");
@@ -621,8 +1242,12 @@ void Skim::generate_nhdr(){
     // Coordinate system - Unclear based on CZI docs what they are using
     fprintf(nhdrFile, "space: 3D-right-handed\n");
 
-    // Origin - For now we use 0,0,0
-    fprintf(nhdrFile, "space origin: (0, 0, 0)\n");
+    // Origin - For now we use 0,0,0, the tiles of a mosaic start at their offset in it
+    if (tileX || tileY)
+        fprintf(nhdrFile, "space origin: (%.12f, %.12f, 0)\n",
+                tileX * dims->scalingX / 1e-7, tileY * dims->scalingY / 1e-7);
+    else
+        fprintf(nhdrFile, "space origin: (0, 0, 0)\n");
 
     // Voxel spacing - Units are in meters (CZI p.52) and we convert to um
     fprintf(nhdrFile, "space units: \"um\" \"um\" \"um\"\n");
@@ -634,30 +1259,122 @@ void Skim::generate_nhdr(){
             dims->sizeC < 2 ? "" : "none ",
             dims->scalingZ / 1e-7);
 
-    // Data format
-    fprintf(nhdrFile, "data file: SKIPLIST 2\n");
+    // Data format - compressed or repacked data is one contiguous raw file, raw slices are listed one
+    // by one, since every subblock in a CZI file has its own segment header in front of its pixels
+    if (writeRaw) {
+        // the raw file no longer says where its slices came from: channel:z:offset of every subblock in the CZI file,
+        // channel:z:offset:part when the dataset is split over several files, and the M index of a mosaic tile
+        bool split = partFiles.size() > 1;
+        fprintf(nhdrFile, "czi file:=%s\n", fs::absolute(cziFileName).string().c_str());
+        if (split) {
+            fprintf(nhdrFile, "czi file parts:=");
+            for (size_t p = 1; p < partFileNames.size(); p++)
+                fprintf(nhdrFile, "%s%zu:%s", p == 1 ? "" : " ", p, fs::absolute(partFileNames[p]).string().c_str());
+            fprintf(nhdrFile, "\n");
+        }
+        fprintf(nhdrFile, "czi timepoint:=%d\n", last > first ? subBlocks[first].t : 0);
+        if (tiles.size() > 1)
+            fprintf(nhdrFile, "czi tile:=%d\n", last > first ? subBlocks[first].m : 0);
+        fprintf(nhdrFile, "czi slices:=");
+        for (size_t i = first; i < last; i++) {
+            fprintf(nhdrFile, "%s%d:%d:%zu", i == first ? "" : " ", subBlocks[i].c, subBlocks[i].z, subBlocks[i].dataBegin);
+            if (split)
+                fprintf(nhdrFile, ":%d", subBlocks[i].entry.FilePart);
+        }
+        fprintf(nhdrFile, "\n");
+        fprintf(nhdrFile, "data file: %s\n", rawFileName.c_str());
+    }
+    else {
+        fprintf(nhdrFile, "data file: SKIPLIST 2\n");
+    }
 
 }
 
-void Skim::generate_nrrd(){
+// slices of one timepoint, subBlocks[first, last)
+void Skim::generate_nrrd(size_t first, size_t last){
     //===================//
     // Find Image Blocks //
     //===================//
     int verbose = opt.verbose;
 
-    void *current_raw = nullptr;
-    Nrrd *ncurrent = nullptr;
+    size_t numPixels = (size_t)dims->sizeX * dims->sizeY;
+    size_t sliceBytes = numPixels * dims->pixelSize;
+
+    // raw slices for the projections are read by an I/O thread while the previous ones are projected
+    // pixel data is only read for the projections, raw volumes, statistics and pyramid levels, otherwise the nhdr just points at it
+    bool readPixels = !projBaseFileName.empty() || writeRaw || opt.stats || opt.pyramid > 0;
+
+    // only then the timepoint takes a read slot, for the slices alone: headers, directory and XML are
+    // small, and the slot is given back before the outputs of the timepoint are written
+    IoGovernor::Read read(readPixels ? opt.governor : nullptr);
+    size_t pixelBytes = 0;
+    std::unique_ptr<SlicePrefetcher> prefetcher;
+    if (readPixels && !compressed && opt.prefetch > 0)
+    {
+        std::vector<int> fds;
+        std::vector<size_t> offsets;
+        for (size_t i = first; i < last; i++)
+        {
+            fds.push_back(partFiles[subBlocks[i].entry.FilePart]);
+            offsets.push_back(subBlocks[i].dataBegin);
+        }
+        prefetcher.reset(new SlicePrefetcher(fds, offsets, sliceBytes, opt.prefetch));
+    }
 
-    if (!projBaseFileName.empty()) 
+    // otherwise it is read in place from the mappings of the parts, as is data that has to be decoded
+    std::vector< std::unique_ptr<CziMappedFile> > cziMaps(partFiles.size());
+    std::vector<const CziMappedFile*> cziMapParts(partFiles.size(), nullptr);
+    if ((readPixels && !prefetcher) || compressed)
     {
-        /* Allocate space for current slice in both raw and float,
-        and for the projections */
-        current_raw = malloc(dims->sizeX * dims->sizeY * dims->pixelSize);
-        airMopAdd(mop, current_raw, airFree, airMopAlways);
-        ncurrent = safe_nrrd_new(mop, (airMopper)nrrdNuke);
-        nproj_xy = safe_nrrd_new(mop, (airMopper)nrrdNuke);
-        nproj_xz = safe_nrrd_new(mop, (airMopper)nrrdNuke);
-        nproj_yz = safe_nrrd_new(mop, (airMopper)nrrdNuke);
+        for (size_t p = 0; p < partFiles.size(); p++)
+        {
+            if (partFiles[p] < 0)
+                continue;
+            cziMaps[p].reset(new CziMappedFile(partFileNames[p]));
+            cziMaps[p]->advise_sequential();
+            cziMapParts[p] = cziMaps[p].get();
+        }
+    }
+
+    // compressed slices are decoded a batch at a time, in parallel
+    std::unique_ptr<CziSliceCache> sliceCache;
+    if (compressed)
+        sliceCache.reset(new CziSliceCache(cziMapParts, subBlocks, sliceBytes, dims->pixelSize,
+                                           2 * omp_get_max_threads()));
+
+    // raw volumes get their slices appended in X Y C Z order, starting at offset 0
+    FILE *rawFile = nullptr;
+    if (writeRaw)
+    {
+        rawFile = fopen(rawFileName.c_str(), "wb");
+        if (!rawFile)
+            throw LSPException("Could not open " + rawFileName + " for writing\n",
+                               "skimczi.cpp", "Skim::generate_nrrd");
+        // reserve the whole volume up front so the file system can keep it in few extents; only a hint
+        posix_fallocate(fileno(rawFile), 0, (off_t)sliceBytes * dims->sizeC * dims->sizeZ);
+    }
+
+    // statistics are gathered from the same slices on their way through
+    std::unique_ptr<CziStatsAccumulator> stats;
+    if (opt.stats)
+        stats.reset(new CziStatsAccumulator(*dims));
+
+    // and so are the downsampled levels
+    std::unique_ptr<CziPyramidWriter> pyramid;
+    if (opt.pyramid > 0)
+        pyramid.reset(new CziPyramidWriter(*dims, opt.pyramid, nhdrFileName, tileX, tileY));
+
+    // the projection buffers are shared by all timepoints of the file, and reallocated for tiles of another size
+    if (!projBaseFileName.empty() && (!nproj_xy || nproj_xy->axis[0].size != (size_t)dims->sizeX
+                                      || nproj_xy->axis[1].size != (size_t)dims->sizeY))
+    {
+        /* Allocate space for the projections */
+        if (!nproj_xy)
+        {
+            nproj_xy = safe_nrrd_new(mop, (airMopper)nrrdNuke);
+            nproj_xz = safe_nrrd_new(mop, (airMopper)nrrdNuke);
+            nproj_yz = safe_nrrd_new(mop, (airMopper)nrrdNuke);
+        }
 
         size_t sizeC = dims->sizeC;
         size_t sizeX = dims->sizeX;
@@ -667,9 +1384,7 @@ void Skim::generate_nrrd(){
         /* TODO: even if sizeC is 1, we still create an axis for the channels,
         because the code logic is simpler that way, but then we
         should probably remove it prior to saving out */
-        nrrd_checker(nrrdAlloc_va(ncurrent, nrrdTypeFloat, 2,
-                        sizeX, sizeY)
-                    || nrrdAlloc_va(nproj_xy, nrrdTypeFloat, 4,
+        nrrd_checker(nrrdAlloc_va(nproj_xy, nrrdTypeFloat, 4,
                                     sizeX, sizeY, sizeC, sizeP)
                     || nrrdAlloc_va(nproj_xz, nrrdTypeFloat, 4,
                                     sizeX, sizeZ, sizeC, sizeP)
@@ -681,7 +1396,6 @@ void Skim::generate_nrrd(){
         nrrdAxisInfoSet_va(nproj_xz, nrrdAxisInfoLabel, "x", "z", "c", "proj");
         nrrdAxisInfoSet_va(nproj_yz, nrrdAxisInfoLabel, "y", "z", "c", "proj");
 
-        current_f = (float*)ncurrent->data;
         size_t szslice = sizeX*sizeY*sizeC;
         proj_max_xy  = (float*)(nproj_xy->data) + 0;
         proj_mean_xy = (float*)(nproj_xy->data) + szslice;
@@ -693,9 +1407,6 @@ void Skim::generate_nrrd(){
         proj_mean_yz = (float*)(nproj_yz->data) + szslice;
     }
 
-    // Rewind the file to beginning
-    lseek(cziFile, 0, SEEK_SET);
-
     if (verbose) 
     {
         fprintf(stdout, "looking for %d slices ...", dims->sizeZ);
@@ -710,143 +1421,143 @@ void Skim::generate_nrrd(){
     Wait to be solved.
 */
   int ctr = 0;
-  size_t dataBegin;
+  size_t dataBegin = 0;
+  const char *dataFile = cziFileName.c_str();
 /* ================================================================== */
 
 
-  // Go hunting for image blocks
-  CziSubBlockSegment *imageSubBlockHeader = (CziSubBlockSegment*)malloc(sizeof(CziSubBlockSegment));
-  airMopAdd(mop, imageSubBlockHeader, airFree, airMopAlways);
-  while(read(cziFile, currentSID, 32) == 32){
-    // skip through file to get the image blocks
-    if (strcmp(currentSID->id, "ZISRAWSUBBLOCK") == 0){
-      // Remember where this segment begins
-      off_t start_of_segment = lseek(cziFile, 0, SEEK_CUR) - 32;
-
-      // Read the ImageBlock header
-      read(cziFile, imageSubBlockHeader, sizeof(CziSubBlockSegment));
+  // Go through the image blocks found by find_subblocks, in (t, z, c) order
+  for (size_t i = first; i < last; i++){
+      const CziSubBlockInfo &subBlock = subBlocks[i];
 
       // Make sure this image block has the expected PixelType
       // TODO: Also check image dimensions agree with XML?
-      if (imageSubBlockHeader->PixelType != dims->pixelType)
+      if (subBlock.entry.PixelType != dims->pixelType)
         throw LSPException("ImageSubBlock PixelType field doesn't agree with XML\n",
                            "skimczi.cpp", "Skim::generate_nrrd");
-      
 
-      // Make sure this image block has the expected compression
-      if (imageSubBlockHeader->Compression != CZICOMPRESSTYPE_RAW)
+      // Make sure this image block has a compression we can decode
+      if (!czi_compression_supported(subBlock.entry.Compression))
         throw LSPException("ImageSubBlock indicated unsupported compression type\n",
                           "skimczi.cpp", "Skim::generate_nrrd");
 
-      // Channel this image slice is from
-      curr_c = 0;
-      curr_z = 0;
-      for (int i = 0; i < imageSubBlockHeader->DimensionCount; i++){
-        if (!strcmp((char *)(imageSubBlockHeader->DimensionEntries[i].Dimension), "C"))
-          curr_c = imageSubBlockHeader->DimensionEntries[i].Start;
-        
-        if (!strcmp((char *)(imageSubBlockHeader->DimensionEntries[i].Dimension), "Z"))
-          curr_z = imageSubBlockHeader->DimensionEntries[i].Start;
+      // Channel and z slice this image slice is from
+      curr_c = subBlock.c;
+      curr_z = subBlock.z;
+      dataBegin = subBlock.dataBegin;
+      dataFile = partFileNames[subBlock.entry.FilePart].c_str();
+      const CziMappedFile *cziMap = cziMapParts[subBlock.entry.FilePart];
+
+      const unsigned char *current = nullptr;
+      if (compressed) {
+        if ((i - first) % sliceCache->capacity() == 0)
+          sliceCache->decode(i, min(sliceCache->capacity(), last - i));
+        current = sliceCache->slice(i);
       }
+      else {
+        // Add entry for this slice to nhdr file
+        if (!writeRaw)
+          fprintf(nhdrFile, "%ld %s\n", dataBegin, dataFile);
 
-      // Compute where the data begins
-      size_t headSize = sizeof(CziSubBlockSegment) - (12 * sizeof(CziDimensionEntryDV1)) + (imageSubBlockHeader->DimensionCount * 20);
-      dataBegin = imageSubBlockHeader->FilePosition + headSize + 32;
-
-      if (verbose > 1) {
-        fprintf(stdout, "======ZISRAWSUBBLOCK======\n");
-        fprintf(stdout, "ID       : %s\n", currentSID->id);
-        fprintf(stdout, "POS      : %ld\n", lseek(cziFile, 0, SEEK_CUR)-32);
-        fprintf(stdout, "allocSize: %lu\n", currentSID->allocatedSize);
-        fprintf(stdout, "usedSize : %lu\n", currentSID->usedSize);
-        fprintf(stdout, "--------CONTENTS----------\n");
-        fprintf(stdout, "MetadataSize   : %" PRIu32"\n",imageSubBlockHeader->MetadataSize);
-        fprintf(stdout, "AttachmentSize : %" PRIu32"\n",imageSubBlockHeader->AttachmentSize);
-        fprintf(stdout, "DataSize       : %lu\n",imageSubBlockHeader->DataSize);
-        fprintf(stdout, "PixelType      : %" PRIu32"\n",imageSubBlockHeader->PixelType);
-        fprintf(stdout, "FilePosition   : %lu\n",imageSubBlockHeader->FilePosition);
-        fprintf(stdout, "FilePart       : %" PRIu32"\n",imageSubBlockHeader->FilePart);
-        fprintf(stdout, "Compression    : %" PRIu32"\n",imageSubBlockHeader->Compression);
-        fprintf(stdout, "DimensionCount : %" PRIu32"\n",imageSubBlockHeader->DimensionCount);
-
-        if (verbose > 2) {
-          for (int i = 0; i < imageSubBlockHeader->DimensionCount; i++){
-            fprintf(stdout, "--------------------\n");
-            fprintf(stdout, "DimensionID     : %s\n", imageSubBlockHeader->DimensionEntries[i].Dimension);
-            fprintf(stdout, "Start           : %d\n", imageSubBlockHeader->DimensionEntries[i].Start);
-            fprintf(stdout, "Size            : %d\n", imageSubBlockHeader->DimensionEntries[i].Size);
-            fprintf(stdout, "StartCoordinate : %f\n", imageSubBlockHeader->DimensionEntries[i].StartCoordinate);
-            fprintf(stdout, "StoredSize      : %d\n", imageSubBlockHeader->DimensionEntries[i].StoredSize);
-            fprintf(stdout, "--------------------\n");
-          }
+        if (prefetcher) {
+          current = prefetcher->next();
         }
-
-        fprintf(stdout, "headSize       : %ld\n", headSize);
-        fprintf(stdout, "DataBegin      : %ld\n",dataBegin);
-        fprintf(stdout, "==========================\n\n");
+        else if (readPixels) {
+          // let the kernel start on the next slice while this one is used
+          if (i + 1 < last && cziMapParts[subBlocks[i+1].entry.FilePart])
+            cziMapParts[subBlocks[i+1].entry.FilePart]->will_need(subBlocks[i+1].dataBegin, sliceBytes);
+
+          current = cziMap->view<unsigned char>(dataBegin, sliceBytes);
+          if (!current)
+            throw LSPException("Slice data runs past the end of the file\n",
+                               "skimczi.cpp", "Skim::generate_nrrd");
+        }
+        if (readPixels)
+          pixelBytes += sliceBytes;
       }
-
-      // Add entry for this slice to nhdr file
-      fprintf(nhdrFile, "%ld %s\n", dataBegin, cziFileName.c_str());
       ++ctr;
 
-      // go to the beginning of data
-      lseek(cziFile, dataBegin, SEEK_SET);
+      // Append this slice to the raw file
+      if (writeRaw && fwrite(current, 1, sliceBytes, rawFile) != sliceBytes)
+        throw LSPException("Could not write " + rawFileName + "\n",
+                           "skimczi.cpp", "Skim::generate_nrrd");
 
-      if (!projBaseFileName.empty()) {
-        // read the current slice into *current_raw
-        read(cziFile, current_raw, dims->sizeX * dims->sizeY * dims->pixelSize);
+      // update the projections directly from the mapping or the decoded slice
+      if (!projBaseFileName.empty())
+        project_slice(current);
+
+      if (stats)
+        stats->add_slice(curr_c, curr_z, current);
+
+      if (pyramid)
+        pyramid->add_slice(curr_c, curr_z, current);
 
-        // cast pixels to floats if necessary
-        if (dims->pixelType == CZIPIXELTYPE_GRAY8){
-          char *current = (char*)current_raw;
-          for (int y = 0; y < dims->sizeY; y++)
-            for (int x = 0; x < dims->sizeX; x++)
-              current_f[y * dims->sizeX + x] = (float)current[y * dims->sizeX + x];
-        }
-        else if (dims->pixelType == CZIPIXELTYPE_GRAY16){
-          short *current = (short*)current_raw;
-          for (int y = 0; y < dims->sizeY; y++)
-            for (int x = 0; x < dims->sizeX; x++)
-              current_f[y * dims->sizeX + x] = (float)current[y * dims->sizeX + x];
-        }
-        else if (dims->pixelType == CZIPIXELTYPE_GRAY32FLOAT)
-          memcpy(current_f, current_raw, dims->sizeX * dims->sizeY * sizeof(float));
-        else
-          throw LSPException("Can't deal with given pixelType\n",
-                      "skimczi.cpp", "Skim::generate_nrrd");
-        
-        // update the projections
-        update_projections();
-      }
       if (verbose) {
         fprintf(stdout, " %d", curr_z);
 
         fflush(stdout);
       }
-
-      // Rewind to beginning of this segment before moving on
-      lseek(cziFile, start_of_segment, SEEK_SET);
-    }
-
-    // Advance to the next SID
-    lseek(cziFile, currentSID->allocatedSize, SEEK_CUR);
   }
 
+  if (compressed)
+    pixelBytes = sliceCache->bytes_read();
+  read.done(pixelBytes);
+
 /* ================================================================== */
 /* 
     TMP WORK AROUND: CONTINUE LINE 393 
+    The padded slices are listed as missing in the integrity manifest,
+    which proj and anim use to skip this timepoint.
 */
-  while(ctr++ < dims->sizeC*dims->sizeZ)
-    fprintf(nhdrFile, "%ld %s\n", dataBegin, cziFileName.c_str());
+  if (writeRaw) {
+    // the raw file has no line to repeat, the missing slices are left empty
+    std::vector<unsigned char> empty(sliceBytes, 0);
+    while(ctr++ < dims->sizeC*dims->sizeZ)
+      if (fwrite(empty.data(), 1, sliceBytes, rawFile) != sliceBytes)
+        throw LSPException("Could not write " + rawFileName + "\n",
+                           "skimczi.cpp", "Skim::generate_nrrd");
+    // a full scratch disk may only show up when the last buffer is flushed
+    if (fclose(rawFile) != 0)
+      throw LSPException("Could not write " + rawFileName + "\n",
+                         "skimczi.cpp", "Skim::generate_nrrd");
+  }
+  else {
+    while(ctr++ < dims->sizeC*dims->sizeZ)
+      fprintf(nhdrFile, "%ld %s\n", dataBegin, dataFile);
+  }
 /* ================================================================== */
 
 
   if (verbose)
     fprintf(stdout, "\n");
 
+  if (stats) {
+    string statsFileName = czi_stats_file_name(nhdrFileName);
+    stats->save(statsFileName);
+    if (verbose) {
+      for (int c = 0; c < dims->sizeC; c++) {
+        CziSliceStats channel = stats->stats().channel(c);
+        fprintf(stdout, "channel %d: min %g, max %g, mean %g\n", c, channel.min, channel.max, channel.mean);
+      }
+      fprintf(stdout, "statistics saved to %s\n", statsFileName.c_str());
+    }
+  }
+
+  if (pyramid) {
+    pyramid->finish();
+    if (verbose)
+      fprintf(stdout, "%d downsampled levels saved next to %s\n", min(opt.pyramid, CZIPYRAMID_MAX_LEVELS), nhdrFileName.c_str());
+  }
+
+  if (prefetcher) {
+    if (verbose)
+      fprintf(stdout, "prefetch: %.2f s waiting for slices, %.2f s projecting, %.2f s reading on the I/O thread\n",
+              prefetcher->io_wait_seconds(), prefetcher->compute_seconds(), prefetcher->read_seconds());
+    // the I/O thread reads from the part files, so it has to stop before they are closed
+    prefetcher.reset();
+  }
+
   fclose(nhdrFile);
-  close(cziFile);
 }
 
 void Skim::generate_proj(){
@@ -858,14 +1569,29 @@ void Skim::generate_proj(){
                                  + strlen("-projAA.nrrd") + 0, char);
     assert(projFName);
     airMopAdd(mop, projFName, airFree, airMopAlways);
-    /* TODO: put back in the relevant per-axis stuff that can be
-       sensibly set (like axis orientations).  We don't have a
-       Nrrd representation of the main CZI header, and nor would it
-       be very useful since nrrdWrite cannot currently generate
-       SKIPLIST headers.  But once that is added to the NrrdIO struct,
-       the header generation could be done by a call to nrrdWrite,
-       and then we'd have a slightly cleaner way of getting/setting
-       the per-axis meta data */
+    /* same per-axis meta data that Proj gets by projecting the nhdr,
+       so the two kinds of projection files can be used interchangeably */
+    double origin[3] = {tileX * dims->scalingX / 1e-7, tileY * dims->scalingY / 1e-7, 0};
+    double none[3] = {AIR_NAN, AIR_NAN, AIR_NAN};
+    double dirX[3] = {dims->scalingX / 1e-7, 0, 0};
+    double dirY[3] = {0, dims->scalingY / 1e-7, 0};
+    double dirZ[3] = {0, 0, dims->scalingZ / 1e-7};
+    Nrrd *nprojs[3] = {nproj_xy, nproj_xz, nproj_yz};
+    for (int i = 0; i < 3; i++)
+    {
+      nrrd_checker(nrrdSpaceSet(nprojs[i], nrrdSpace3DRightHanded)
+                    || nrrdSpaceOriginSet(nprojs[i], origin),
+                  mop, "Couldn't set projection space:\n",
+                  "skimczi.cpp", "Skim::generate_proj");
+      for (int j = 0; j < 3; j++)
+        nprojs[i]->spaceUnits[j] = airStrdup("um");
+      nrrdAxisInfoSet_va(nprojs[i], nrrdAxisInfoCenter,
+                         nrrdCenterCell, nrrdCenterCell, nrrdCenterUnknown, nrrdCenterUnknown);
+    }
+    nrrdAxisInfoSet_va(nproj_xy, nrrdAxisInfoSpaceDirection, dirX, dirY, none, none);
+    nrrdAxisInfoSet_va(nproj_xz, nrrdAxisInfoSpaceDirection, dirX, dirZ, none, none);
+    nrrdAxisInfoSet_va(nproj_yz, nrrdAxisInfoSpaceDirection, dirY, dirZ, none, none);
+
     int E = 0;
     if (!E) sprintf(projFName, "%s-projXY.nrrd", projBaseFileName.c_str());
     if (!E) E |= nrrdSave(projFName, nproj_xy, NULL);
@@ -906,16 +1632,227 @@ void Skim::generate_proj(){
 
 
 
+// low resolution projections and frame of the timepoint subBlocks[first, last), of all its tiles
+void Skim::generate_preview(size_t first, size_t last){
+    if (first == last)
+        throw LSPException("No image subblocks to preview\n", "skimczi.cpp", "Skim::generate_preview");
+    vector<CziSubBlockInfo> slices(subBlocks.begin() + first, subBlocks.begin() + last);
+    vector<CziSubBlockInfo> pyramid;
+    for (CziSubBlockInfo const &block : pyramidBlocks)
+        if (block.t == slices[0].t)
+            pyramid.push_back(block);
+
+    CziPreviewBuilder preview(*dims, partFiles);
+    IoGovernor::Read read(opt.governor);
+    preview.build(slices, pyramid);
+    read.done(preview.bytes_read());
+    string baseName = (fs::path(opt.preview_path) / fs::path(nhdrFileName).stem()).string();
+    preview.save(baseName);
+
+    if (!opt.quiet)
+    {
+        size_t fullBytes = (last - first) * (size_t)dims->sizeX * dims->sizeY * dims->pixelSize;
+        cout << "Generated preview " << baseName << "-max.png from "
+             << (preview.from_pyramid() ? to_string(preview.factor_xy()) + "x pyramid subblocks"
+                                        : "every " + to_string(preview.factor_xy()) + "th row, column and slice")
+             << ", read " << preview.bytes_read() / (1 << 20) << " of " << fullBytes / (1 << 20) << " MB" << endl;
+    }
+}
+
+// the thumbnail ZEN embeds, copied as it is next to the preview of the first timepoint
+void Skim::write_thumbnail(){
+    vector<CziAttachmentInfo> attachments;
+    if (!czi_read_attachment_directory(cziFile, headerInfo->AttachmentDirectoryPosition, attachments))
+        return;
+
+    for (CziAttachmentInfo const &attachment : attachments)
+    {
+        if (opt.verbose)
+            cout << "Attachment " << attachment.name << " (" << attachment.contentType << ")" << endl;
+        if (attachment.name != "Thumbnail")
+            continue;
+
+        int fd = attachment.filePart >= 0 && (size_t)attachment.filePart < partFiles.size() ? partFiles[attachment.filePart] : -1;
+        vector<unsigned char> data;
+        if (fd < 0 || !czi_read_attachment(fd, attachment, data))
+        {
+            cout << "WARNING: could not read the thumbnail of " << cziFileName << endl;
+            return;
+        }
+
+        string extension = attachment.contentType;
+        transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        string thumbnailFileName = (fs::path(opt.preview_path) / fs::path(nhdrFileName).stem()).string()
+                                 + "-thumbnail." + extension;
+        FILE *file = fopen(thumbnailFileName.c_str(), "wb");
+        bool written = file && fwrite(data.data(), 1, data.size(), file) == data.size();
+        if (file && fclose(file) != 0)
+            written = false;
+        if (!written)
+            throw LSPException("Could not write " + thumbnailFileName + "\n", "skimczi.cpp", "Skim::write_thumbnail");
+        if (!opt.quiet)
+            cout << "Copied the embedded thumbnail to " << thumbnailFileName << endl;
+        return;
+    }
+}
+
+void Skim::set_timepoint_names(size_t k, size_t numT){
+    // a single timepoint keeps the names it was given
+    if (numT > 1)
+    {
+        // timepoint k of file NNN becomes NNN+k, so a file of all timepoints starts at 000; NNN is
+        // past the timepoints of the files before it, see czi_first_timepoints
+        string stem = fs::path(opt.nhdr_out_name).stem().string();
+        string name = is_number(stem) ? GenerateOutName(stoi(stem) + (int)k, 3, "")
+                                      : stem + "-" + GenerateOutName((int)k, 3, "");
+        nhdrFileName = outputPath + name + ".nhdr";
+        xmlFileName = outputPath + name + ".xml";
+        if (!opt.proj_path.empty())
+            projBaseFileName = opt.proj_path + name;
+
+        // every timepoint gets the metadata of the whole file
+        int file = open(xmlFileName.c_str(), O_TRUNC | O_CREAT | O_WRONLY, 0666);
+        bool written = file >= 0 && write(file, xml, xmlSize) == (ssize_t)xmlSize;
+        if (file >= 0)
+            close(file);
+        if (!written)
+            throw LSPException("Could not write " + xmlFileName + "\n", "skimczi.cpp", "Skim::set_timepoint_names");
+    }
+
+    set_raw_file_name();
+}
+
+void Skim::set_tile_names(string const &timepointNhdr, int tile){
+    // tile KK of timepoint NNN becomes NNN-tiles/NNN-mKK.nhdr, its projections NNN-mKK-projXY.nrrd, ...
+    string name = fs::path(timepointNhdr).stem().string() + "-m" + GenerateOutName(tile, max(2, (int)to_string(tiles.size() - 1).size()), "");
+    nhdrFileName = czi_tiles_dir(timepointNhdr) + name + ".nhdr";
+    if (!opt.proj_path.empty())
+        projBaseFileName = opt.proj_path + name;
+    set_raw_file_name();
+}
+
+void Skim::set_raw_file_name(){
+    // raw volumes go next to the nhdr, or to the repack directory
+    if (writeRaw)
+    {
+        fs::path rawDir = opt.repack_path.empty() ? fs::path(nhdrFileName).parent_path() : fs::path(opt.repack_path);
+        rawFileName = fs::absolute(rawDir / fs::path(nhdrFileName).stem()).string() + ".raw";
+    }
+}
+
+// slices of one timepoint, or of one tile of it, subBlocks[first, last)
+void Skim::process_slices(size_t first, size_t last){
+    // recorded before any pixel data is read, so later stages know about the damage even if reading fails
+    TimepointIntegrity integrity = czi_check_integrity(partFiles, subBlocks, first, last, *dims);
+    integrity.name = fs::path(nhdrFileName).stem().string();
+    append_integrity_manifest(outputPath, integrity);
+
+    // a damaged timepoint still gets its nhdr, but no projections that later stages would pick up
+    string projBase = projBaseFileName;
+    if (!integrity.ok())
+    {
+        cerr << "WARNING: " << nhdrFileName << " is " << integrity.status() << ", only " << integrity.complete
+             << " of " << integrity.slices << " slices are complete" << (projBase.empty() ? "" : ", not projecting it") << endl;
+        projBaseFileName.clear();
+    }
+
+    generate_nhdr(first, last);
+    if (!opt.quiet)
+        cout << "Generated nhdr header " << nhdrFileName << " successfully" << endl;
+    generate_nrrd(first, last);
+    if (!opt.quiet)
+        cout << "Generated nrrd file successfully" << endl << endl;
+    if (!projBaseFileName.empty())
+    {
+        generate_proj();
+        if (!opt.quiet)
+            cout << "Generated proj files successfully" << endl << endl;
+    }
+    projBaseFileName = projBase;
+}
+
 void Skim::main()
 {  
     //cout << "Start Skim main" << endl;
     //cout << "Processing input file " << curFile << endl;
     parse_file();
-    cout << "Parsed the input file successfully" << endl;
-    generate_nhdr();
-    cout << "Generated nhdr header successfully" << endl;
-    generate_nrrd();
-    cout << "Generated nrrd file successfully" << endl << endl;
-    //generate_proj();
-    //cout << "Generated proj file successfully" << endl << endl << endl;
+    if (!opt.quiet)
+        cout << "Parsed the input file successfully" << endl;
+    find_subblocks();
+    if (!opt.quiet)
+        cout << "Found " << subBlocks.size() << " image subblocks" << endl;
+
+    // subBlocks are sorted by t first, so every timepoint is one run of them
+    vector<size_t> tBegin(1, 0);
+    for (size_t i = 1; i < subBlocks.size(); i++)
+        if (subBlocks[i].t != subBlocks[i-1].t)
+            tBegin.push_back(i);
+    tBegin.push_back(subBlocks.size());
+    size_t numT = tBegin.size() - 1;
+
+    if (numT > 1 && !opt.quiet)
+        cout << "Found " << numT << " timepoints (" << dims->sizeT << " in the XML), writing one nhdr for each" << endl;
+
+    if (tiles.size() > 1 && !opt.quiet)
+        cout << "Found " << tiles.size() << " mosaic tiles, " << (opt.preview_path.empty() ? "writing one nhdr for each"
+                                                                                         : "placing them in the preview") << endl;
+
+    for (size_t k = 0; k < numT; k++)
+    {
+        set_timepoint_names(k, numT);
+
+        if (!opt.preview_path.empty())
+        {
+            if (k == 0)
+                write_thumbnail();
+            generate_preview(tBegin[k], tBegin[k+1]);
+            continue;
+        }
+
+        if (tiles.size() <= 1)
+        {
+            process_slices(tBegin[k], tBegin[k+1]);
+            continue;
+        }
+
+        // every tile is written as a volume of its own size, placed in the mosaic by its origin
+        string timepointNhdr = nhdrFileName, timepointProj = projBaseFileName;
+        int sizeX = dims->sizeX, sizeY = dims->sizeY;
+        fs::create_directories(czi_tiles_dir(timepointNhdr));
+
+        vector<CziSubBlockInfo> timepointTiles;
+        vector<string> tileNhdrs;
+        for (size_t first = tBegin[k], last; first < tBegin[k+1]; first = last)
+        {
+            for (last = first + 1; last < tBegin[k+1] && subBlocks[last].tile == subBlocks[first].tile; last++)
+                ;
+            CziSubBlockInfo const &tile = tiles[subBlocks[first].tile];
+            set_tile_names(timepointNhdr, subBlocks[first].tile);
+            dims->sizeX = tile.sizeX > 0 ? tile.sizeX : sizeX;
+            dims->sizeY = tile.sizeY > 0 ? tile.sizeY : sizeY;
+            tileX = tile.x;
+            tileY = tile.y;
+            process_slices(first, last);
+
+            timepointTiles.push_back(tile);
+            tileNhdrs.push_back(fs::path(nhdrFileName).filename().string());
+        }
+
+        nhdrFileName = timepointNhdr;
+        projBaseFileName = timepointProj;
+        dims->sizeX = sizeX;
+        dims->sizeY = sizeY;
+        tileX = tileY = 0;
+
+        // written last, so skim knows the timepoint is done once it is there
+        string layoutFileName = czi_tiles_layout_file_name(timepointNhdr);
+        czi_write_tiles_layout(layoutFileName, timepointTiles, tileNhdrs);
+        if (!opt.quiet)
+            cout << "Generated tile layout " << layoutFileName << " successfully" << endl << endl;
+    }
+
+    for (size_t p = 1; p < partFiles.size(); p++)
+        if (partFiles[p] >= 0)
+            close(partFiles[p]);
+    close(cziFile);
 }
@@ -6,7 +6,10 @@
 #include "skimczi_util.h"
 
 #include <cfloat>
+#include <cstdlib>
 #include <string.h>
+#include <unistd.h>
+#include <vector>
 
 
 // Convert the string parameter to a CZI pixel type.
@@ -36,67 +39,200 @@ CziPixelType ConvertStringToPixelType(const char *wszValue) {
   return pixeltype;
 }
 
+// XML elements that make up ImageDims, in the order of the cases of set_image_dim
+static const char *imageDimNames[] = {"SizeX", "SizeY", "SizeZ", "SizeC", "SizeT",
+                                      "ScalingX", "ScalingY", "ScalingZ", "PixelType"};
+static const int numImageDims = sizeof(imageDimNames) / sizeof(imageDimNames[0]);
+
+// Index of the ImageDims element called "name", -1 if it is not one of them
+static int image_dim_field(const xmlChar *name) {
+  for (int i = 0; i < numImageDims; i++)
+    if (!xmlStrcmp(name, (const xmlChar *)imageDimNames[i]))
+      return i;
+  return -1;
+}
+
+// Store the text "value" of element "field" in dims
+static void set_image_dim(int field, const char *value, ImageDims *dims) {
+  switch (field) {
+    case 0: dims->sizeX = atoi(value); break;
+    case 1: dims->sizeY = atoi(value); break;
+    case 2: dims->sizeZ = atoi(value); break;
+    case 3: dims->sizeC = atoi(value); break;
+    case 4: dims->sizeT = atoi(value); break;
+    case 5: dims->scalingX = atof(value); break;
+    case 6: dims->scalingY = atof(value); break;
+    case 7: dims->scalingZ = atof(value); break;
+    case 8:
+      dims->pixelType = ConvertStringToPixelType(value);
+      if (dims->pixelType == CZIPIXELTYPE_GRAY8){
+        dims->pixelSize = sizeof(char);
+      }
+      else if (dims->pixelType == CZIPIXELTYPE_GRAY16){
+        dims->pixelSize = sizeof(short);
+      }
+      else if (dims->pixelType == CZIPIXELTYPE_GRAY32FLOAT){
+        dims->pixelSize = sizeof(float);
+      }
+      break;
+  }
+}
+
 void get_image_dims(xmlNode * a_node, ImageDims * dims) {
   xmlNode *cur_node = NULL;
   xmlChar *key;
 
   for (cur_node = a_node; cur_node; cur_node = cur_node->next) {
     if (cur_node->type == XML_ELEMENT_NODE) {
-      if (!xmlStrcmp(cur_node->name, (const xmlChar *)"SizeX")){
+      int field = image_dim_field(cur_node->name);
+      if (field >= 0) {
         key = xmlNodeGetContent(cur_node);
-        dims->sizeX = atoi((const char *)key);
-        xmlFree(key);
-      }
-      if (!xmlStrcmp(cur_node->name, (const xmlChar *)"SizeY")){
-        key = xmlNodeGetContent(cur_node);
-        dims->sizeY = atoi((const char *)key);
-        xmlFree(key);
-      }
-      if (!xmlStrcmp(cur_node->name, (const xmlChar *)"SizeZ")){
-        key = xmlNodeGetContent(cur_node);
-        dims->sizeZ = atoi((const char *)key);
-        xmlFree(key);
-      }
-      if (!xmlStrcmp(cur_node->name, (const xmlChar *)"SizeC")){
-        key = xmlNodeGetContent(cur_node);
-        dims->sizeC = atoi((const char *)key);
-        xmlFree(key);
-      }
-      if (!xmlStrcmp(cur_node->name, (const xmlChar *)"SizeT")){
-        key = xmlNodeGetContent(cur_node);
-        dims->sizeT = atoi((const char *)key);
-        xmlFree(key);
-      }
-      if (!xmlStrcmp(cur_node->name, (const xmlChar *)"ScalingX")){
-        key = xmlNodeGetContent(cur_node);
-        dims->scalingX = atof((const char *)key);
-        xmlFree(key);
-      }
-      if (!xmlStrcmp(cur_node->name, (const xmlChar *)"ScalingY")){
-        key = xmlNodeGetContent(cur_node);
-        dims->scalingY = atof((const char *)key);
-        xmlFree(key);
-      }
-      if (!xmlStrcmp(cur_node->name, (const xmlChar *)"ScalingZ")){
-        key = xmlNodeGetContent(cur_node);
-        dims->scalingZ = atof((const char *)key);
-        xmlFree(key);
-      }
-      if (!xmlStrcmp(cur_node->name, (const xmlChar *)"PixelType")){
-        key = xmlNodeGetContent(cur_node);
-        dims->pixelType = ConvertStringToPixelType((const char *)key);
-        if (dims->pixelType == CZIPIXELTYPE_GRAY8){
-          dims->pixelSize = sizeof(char);
-        }
-        else if (dims->pixelType == CZIPIXELTYPE_GRAY16){
-          dims->pixelSize = sizeof(short);
-        }
-        else if (dims->pixelType == CZIPIXELTYPE_GRAY32FLOAT){
-          dims->pixelSize = sizeof(float);
-        }
+        set_image_dim(field, (const char *)key, dims);
         xmlFree(key);
       }
     }
     get_image_dims(cur_node->children, dims);
   }
 }
+
+bool stream_image_dims(const char *xml, size_t size, ImageDims *dims) {
+  xmlTextReaderPtr reader = xmlReaderForMemory(xml, (int)size, "noname.xml", NULL, 0);
+  if (!reader)
+    return false;
+
+  int ret;
+  // the reader only ever holds the current node; like get_image_dims, a later element of the same
+  // name overwrites an earlier one, so the whole document is read
+  while ((ret = xmlTextReaderRead(reader)) == 1) {
+    if (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT)
+      continue;
+
+    int field = image_dim_field(xmlTextReaderConstLocalName(reader));
+    if (field < 0)
+      continue;
+
+    xmlChar *value = xmlTextReaderReadString(reader);
+    set_image_dim(field, value ? (const char *)value : "", dims);
+    xmlFree(value);
+  }
+
+  xmlFreeTextReader(reader);
+  return ret >= 0;
+}
+
+
+int czi_dimension_start(const CziDirectoryEntryDV &entry, const char *dim) {
+  for (int i = 0; i < entry.DimensionCount && i < 12; i++) {
+    if (!strcmp((const char *)(entry.DimensionEntries[i].Dimension), dim))
+      return entry.DimensionEntries[i].Start;
+  }
+  return 0;
+}
+
+int czi_dimension_size(const CziDirectoryEntryDV &entry, const char *dim) {
+  for (int i = 0; i < entry.DimensionCount && i < 12; i++) {
+    if (!strcmp((const char *)(entry.DimensionEntries[i].Dimension), dim))
+      return entry.DimensionEntries[i].Size;
+  }
+  return 0;
+}
+
+int czi_dimension_stored_size(const CziDirectoryEntryDV &entry, const char *dim) {
+  for (int i = 0; i < entry.DimensionCount && i < 12; i++) {
+    if (!strcmp((const char *)(entry.DimensionEntries[i].Dimension), dim))
+      return entry.DimensionEntries[i].StoredSize;
+  }
+  return 0;
+}
+
+bool czi_subblock_is_pyramid(const CziSubBlockInfo &info) {
+  return info.entry.PyramidType != 0
+      || (info.storedSizeX > 0 && info.storedSizeX < info.sizeX)
+      || (info.storedSizeY > 0 && info.storedSizeY < info.sizeY);
+}
+
+size_t czi_subblock_data_begin(const CziDirectoryEntryDV &entry) {
+  // same layout as the ZISRAWSUBBLOCK header: fixed part, then 20 bytes per dimension entry,
+  // all following the 32-byte segment header
+  size_t headSize = sizeof(CziSubBlockSegment) - (12 * sizeof(CziDimensionEntryDV1)) + (entry.DimensionCount * 20);
+  return entry.FilePosition + headSize + 32;
+}
+
+void czi_subblock_info_set(CziSubBlockInfo &info) {
+  info.c = czi_dimension_start(info.entry, "C");
+  info.z = czi_dimension_start(info.entry, "Z");
+  info.t = czi_dimension_start(info.entry, "T");
+  info.m = czi_dimension_start(info.entry, "M");
+  info.x = czi_dimension_start(info.entry, "X");
+  info.y = czi_dimension_start(info.entry, "Y");
+  info.sizeX = czi_dimension_size(info.entry, "X");
+  info.sizeY = czi_dimension_size(info.entry, "Y");
+  info.storedSizeX = czi_dimension_stored_size(info.entry, "X");
+  info.storedSizeY = czi_dimension_stored_size(info.entry, "Y");
+  info.tile = 0;
+  info.dataBegin = czi_subblock_data_begin(info.entry);
+}
+
+bool read_subblock_directory(int cziFile, uint64_t position, std::vector<CziSubBlockInfo> &subBlocks) {
+  subBlocks.clear();
+
+  // files that were never finalized have no directory
+  if (position == 0)
+    return false;
+
+  off_t fileSize = lseek(cziFile, 0, SEEK_END);
+  if (fileSize < 0 || position + sizeof(SID) > (uint64_t)fileSize)
+    return false;
+
+  SID sid;
+  if (pread(cziFile, &sid, sizeof(SID), position) != sizeof(SID))
+    return false;
+  if (strncmp(sid.id, "ZISRAWDIRECTORY", sizeof(sid.id)) != 0)
+    return false;
+  if (sid.usedSize < sizeof(CziSubBlockDirectorySegmentHeader)
+      || position + sizeof(SID) + sid.usedSize > (uint64_t)fileSize)
+    return false;
+
+  // one read for the whole segment, entries are parsed from memory
+  std::vector<unsigned char> segment(sid.usedSize);
+  if (pread(cziFile, segment.data(), segment.size(), position + sizeof(SID)) != (ssize_t)segment.size())
+    return false;
+
+  CziSubBlockDirectorySegmentHeader header;
+  memcpy(&header, segment.data(), sizeof(header));
+  if (header.EntryCount < 0)
+    return false;
+
+  const size_t entryHeadSize = sizeof(CziDirectoryEntryDV_HeaderOnly);
+  const size_t dimSize = sizeof(CziDimensionEntryDV1);
+  size_t pos = sizeof(CziSubBlockDirectorySegmentHeader);
+  subBlocks.reserve(header.EntryCount);
+
+  for (int32_t i = 0; i < header.EntryCount; i++) {
+    if (pos + entryHeadSize > segment.size())
+      break;
+
+    CziSubBlockInfo info;
+    memset(&info, 0, sizeof(info));
+    memcpy(&info.entry, segment.data() + pos, entryHeadSize);
+
+    if (info.entry.SchemaType[0] != 'D' || info.entry.SchemaType[1] != 'V'
+        || info.entry.DimensionCount < 0 || info.entry.DimensionCount > 12
+        || pos + entryHeadSize + info.entry.DimensionCount * dimSize > segment.size())
+      break;
+
+    memcpy(info.entry.DimensionEntries, segment.data() + pos + entryHeadSize, info.entry.DimensionCount * dimSize);
+    pos += entryHeadSize + info.entry.DimensionCount * dimSize;
+
+    czi_subblock_info_set(info);
+    subBlocks.push_back(info);
+  }
+
+  // a short directory means a damaged file, let the caller scan instead
+  if (subBlocks.size() != (size_t)header.EntryCount) {
+    subBlocks.clear();
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,129 @@
+//! \file sliceprefetch.cpp
+//! \brief Reads image slices ahead of their use on an I/O thread, through a small ring of buffers.
+
+#include "sliceprefetch.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+using namespace std;
+
+static double seconds_since(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+SlicePrefetcher::SlicePrefetcher(int fd, vector<size_t> const &offsets, size_t sliceBytes, size_t depth)
+: SlicePrefetcher(vector<int>(offsets.size(), fd), offsets, sliceBytes, depth)
+{
+}
+
+SlicePrefetcher::SlicePrefetcher(vector<int> const &fds, vector<size_t> const &offsets, size_t sliceBytes, size_t depth)
+: fds(fds), offsets(offsets), sliceBytes(sliceBytes),
+  // one slot is held by the consumer, so fewer than two would not overlap anything
+  ring(max(depth, (size_t)2), vector<unsigned char>(sliceBytes)),
+  filled(0), released(0), stop(false), readSeconds(0),
+  holding(false), waitSeconds(0), computeSeconds(0)
+{
+    vector<int> files(fds);
+    sort(files.begin(), files.end());
+    for (size_t i = 0; i < files.size(); i++)
+        if (i == 0 || files[i] != files[i-1])
+            posix_fadvise(files[i], 0, 0, POSIX_FADV_SEQUENTIAL);
+    io = thread(&SlicePrefetcher::run, this);
+}
+
+SlicePrefetcher::~SlicePrefetcher()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stop = true;
+    }
+    releasedCond.notify_all();
+    io.join();
+}
+
+void SlicePrefetcher::run()
+{
+    for (size_t k = 0; k < offsets.size(); k++)
+    {
+        {
+            // wait for the slot of slice k to be given back
+            unique_lock<mutex> guard(lock);
+            releasedCond.wait(guard, [&]{ return stop || k - released < ring.size(); });
+            if (stop)
+                return;
+        }
+
+        auto start = chrono::steady_clock::now();
+        unsigned char *buffer = ring[k % ring.size()].data();
+        size_t done = 0;
+        string readError;
+        while (done < sliceBytes)
+        {
+            ssize_t got = pread(fds[k], buffer + done, sliceBytes - done, offsets[k] + done);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0)
+            {
+                readError = string("Could not read slice data: ") + strerror(errno) + "\n";
+                break;
+            }
+            if (got == 0)
+            {
+                readError = "Slice data runs past the end of the file\n";
+                break;
+            }
+            done += got;
+        }
+
+        {
+            lock_guard<mutex> guard(lock);
+            readSeconds += seconds_since(start);
+            if (!readError.empty())
+            {
+                error = readError;
+                filledCond.notify_all();
+                return;
+            }
+            filled = k + 1;
+        }
+        filledCond.notify_all();
+    }
+}
+
+const unsigned char *SlicePrefetcher::next()
+{
+    if (holding)
+        computeSeconds += seconds_since(lastReturn);
+
+    auto start = chrono::steady_clock::now();
+    unique_lock<mutex> guard(lock);
+    if (holding)
+    {
+        released++;
+        holding = false;
+        releasedCond.notify_all();
+    }
+    if (released == offsets.size())
+        return nullptr;
+
+    filledCond.wait(guard, [&]{ return filled > released || !error.empty(); });
+    if (filled <= released)
+        throw LSPException(error, "sliceprefetch.cpp", "SlicePrefetcher::next");
+
+    holding = true;
+    lastReturn = chrono::steady_clock::now();
+    waitSeconds += chrono::duration<double>(lastReturn - start).count();
+    return ring[released % ring.size()].data();
+}
+
+double SlicePrefetcher::read_seconds() const
+{
+    lock_guard<mutex> guard(lock);
+    return readSeconds;
+}
@@ -29,6 +29,7 @@
 #include "CLI11.hpp"
 
 #include "skimczi.h"
+#include "cziintegrity.h"
 #include "util.h"
 #include "skimczi_util.h"
 
@@ -84,6 +85,29 @@ using namespace std;
 
 namespace fs = boost::filesystem;
 
+// sequence numbers and base names of the usable .nhdr files in nhdrPath, in ascending order
+static vector< pair<int, string> > list_nhdr_files(string const &nhdrPath)
+{
+    vector< pair<int, string> > nhdrFiles;
+    for (string const &curFile : GetDirectoryFiles(nhdrPath))
+    {
+        size_t end = curFile.rfind(".nhdr");
+        if (end == string::npos || end != curFile.length() - 5)
+            continue;
+
+        // names are zero padded, like 001, and 000 is the initial time stamp
+        string curFileName = curFile.substr(0, end);
+        size_t start = curFileName.find_first_not_of('0');
+        string sequenceNumString = start == string::npos ? "0" : curFileName.substr(start);
+        if (is_number(sequenceNumString))
+            nhdrFiles.push_back(make_pair(stoi(sequenceNumString), curFileName));
+    }
+    sort(nhdrFiles.begin(), nhdrFiles.end());
+    // timepoints skim found damaged are left out, see the integrity manifest
+    skip_damaged_timepoints(nhdrPath, nhdrFiles);
+    return nhdrFiles;
+}
+
 void start_standard_process(CLI::App &app) 
 {
     auto opt = make_shared<startOptions>();
@@ -101,6 +125,13 @@ void start_standard_process(CLI::App &app)
     sub->add_option("-f, --num_files", opt->maxFileNum, "Max number for files that we want to process");
     // verbose
     sub->add_option("-v, --verbose", opt->verbose, "Progress printed in terminal or not");
+    // watch mode
+    sub->add_flag("-w, --watch", opt->watch, "Keep watching the czi directory of a running acquisition and make the frames of every "
+                                            ".czi file as soon as it has been written completely; the videos are made once it stops");
+    sub->add_option("--watch-idle", opt->watch_idle, "Stop watching after this many seconds without changes in the czi directory, "
+                                                      "0 watches forever (Default: 1800)");
+    sub->add_option("--watch-settle", opt->watch_settle, "Seconds the size of a .czi file has to stay the same before it is "
+                                                          "checked for completeness (Default: 10)");
 
     sub->set_callback([opt]() 
     {
@@ -116,7 +147,59 @@ void start_standard_process(CLI::App &app)
         auto start = chrono::high_resolution_clock::now();
         // we need to go through all the files in the given path "input_path" and find all .czi files
         // first check this input path is a directory or a single file name
-        if (checkIfDirectory(opt->czi_path))
+        if (opt->watch)
+        {
+            if (!checkIfDirectory(opt->czi_path))
+            {
+                cout << "ERROR: --watch needs a czi directory, " << opt->czi_path << " is not one" << endl;
+                return;
+            }
+
+            auto opt_skim = std::make_shared<skimOptions>();
+            opt_skim->czi_path = opt->czi_path;
+            opt_skim->nhdr_path = opt->nhdr_path;
+            opt_skim->verbose = opt->verbose;
+            opt_skim->proj_path = opt->proj_path;
+            opt_skim->watch_idle = opt->watch_idle;
+            opt_skim->watch_settle = opt->watch_settle;
+
+            // skim already wrote the projections of the new timepoints, so they only need their frames;
+            // frames that exist are skipped by anim
+            auto make_frames = [opt]()
+            {
+                try
+                {
+                    auto opt_anim = make_shared<animOptions>();
+                    opt_anim->nhdr_path = opt->nhdr_path;
+                    opt_anim->proj_path = opt->proj_path;
+                    opt_anim->anim_path = opt->anim_path;
+                    opt_anim->allValidFiles = list_nhdr_files(opt->nhdr_path);
+                    opt_anim->tmax = opt_anim->allValidFiles.size();
+                    opt_anim->dwn_sample = opt->dwn_sample;
+                    opt_anim->scale_x = opt->scale_x;
+                    opt_anim->scale_z = opt->scale_z;
+                    opt_anim->verbose = opt->verbose;
+                    opt_anim->skip_video = true;
+                    Anim(*opt_anim).main();
+                }
+                catch(LSPException &e)
+                {
+                    std::cerr << "Exception thrown by " << e.get_func() << "() in " << e.get_file() << ": " << e.what() << std::endl;
+                }
+            };
+
+            try
+            {
+                run_skim_watch(*opt_skim, make_frames);
+            }
+            catch(LSPException &e)
+            {
+                std::cerr << "Exception thrown by " << e.get_func() << "() in " << e.get_file() << ": " << e.what() << std::endl;
+                return;
+            }
+            // once the acquisition is over, the passes below catch up on anything left and make the videos
+        }
+        else if (checkIfDirectory(opt->czi_path))
         {
             cout << endl << "Input path " << opt->czi_path << " is valid, start processing" << endl;
         
@@ -180,48 +263,15 @@ void start_standard_process(CLI::App &app)
                 cout << "ERROR: Not all valid files have been recorded" << endl;
             }
                 
-            // generate output files by running main
-            for (int i = 0; i < allValidFiles.size(); i++) 
-            {                
-                string nhdrFileName, xmlFileName;
-
-                // we need to refresh both for each iteration
-                opt->nhdr_out_name = "";
-                opt->xml_out_name = "";
-
-                // generate the complete path for output files
-                nhdrFileName = opt->nhdr_path + GenerateOutName(allValidFiles[i].first, 3, ".nhdr");
-                xmlFileName = opt->nhdr_path + GenerateOutName(allValidFiles[i].first, 3, ".xml");
-
-                // we want to check if current potential output file already exists, if so, skip
-                if (fs::exists(nhdrFileName) && fs::exists(xmlFileName))
-                {
-                    cout << "Both " << nhdrFileName << " and " << xmlFileName << " exist, continue to next." << endl << endl;
-                    continue;
-                }
-                
-                // run the processing program
-                try 
-                {
-                    opt->file = allValidFiles[i].second;
-                    opt->nhdr_out_name = nhdrFileName;
-                    opt->xml_out_name = xmlFileName;
-
-                    // convert startOptions to skimOptions
-                    auto opt_skim = std::make_shared<skimOptions>();
-                    opt_skim->czi_path = opt->czi_path;
-                    opt_skim->nhdr_path = opt->nhdr_path;
-                    opt_skim->nhdr_out_name = opt->nhdr_out_name;
-                    opt_skim->xml_out_name = opt->xml_out_name;
-                    opt_skim->file = opt->file;
-                    opt_skim->verbose = opt->verbose;
-                    Skim(*opt_skim).main();
-                } 
-                catch(LSPException &e) 
-                {
-                    std::cerr << "Exception thrown by " << e.get_func() << "() in " << e.get_file() << ": " << e.what() << std::endl;
-                }
-            }
+            // convert startOptions to skimOptions
+            skimOptions opt_skim;
+            opt_skim.czi_path = opt->czi_path;
+            opt_skim.nhdr_path = opt->nhdr_path;
+            opt_skim.verbose = opt->verbose;
+            // compute the projections while the data is read, the proj pass below then skips these files
+            opt_skim.proj_path = opt->proj_path;
+            // parts of split files and files of several timepoints are handled as skim does it
+            run_skim_jobs(skim_file_jobs(opt_skim, allValidFiles), 1);
         }
         // Single file mode if the input_path is a single file path
         else
@@ -269,38 +319,15 @@ void start_standard_process(CLI::App &app)
                 sequenceNum = 0;
             }
 
-            string nhdrFileName, xmlFileName;
-            // generate the complete path for output files
-            nhdrFileName = opt->nhdr_path + GenerateOutName(sequenceNum, 3, ".nhdr");
-            xmlFileName = opt->nhdr_path+ GenerateOutName(sequenceNum, 3, ".xml");
-
-            // we want to check if current potential output file already exists, if so, skip
-            if (fs::exists(nhdrFileName) && fs::exists(xmlFileName))
-            {
-                cout << "Both " << nhdrFileName << " and " << xmlFileName << " exist, no need to process again." << endl << endl;
-                return;
-            }
-        
-            try 
-            {
-                opt->file = curFile;
-                opt->nhdr_out_name = nhdrFileName;
-                opt->xml_out_name = xmlFileName;
-                
-                // convert startOptions to skimOptions
-                auto opt_skim = std::make_shared<skimOptions>();
-                opt_skim->czi_path = opt->czi_path;
-                opt_skim->nhdr_path = opt->nhdr_path;
-                opt_skim->nhdr_out_name = opt->nhdr_out_name;
-                opt_skim->xml_out_name = opt->xml_out_name;
-                opt_skim->file = opt->file;
-                opt_skim->verbose = opt->verbose;
-                Skim(*opt_skim).main();
-            } 
-            catch(LSPException &e) 
-            {
-                std::cerr << "Exception thrown by " << e.get_func() << "() in " << e.get_file() << ": " << e.what() << std::endl;
-            }
+            // convert startOptions to skimOptions
+            skimOptions opt_skim;
+            opt_skim.czi_path = curFile;
+            opt_skim.nhdr_path = opt->nhdr_path;
+            opt_skim.verbose = opt->verbose;
+            // compute the projections while the data is read, the proj pass below then skips this file
+            opt_skim.proj_path = opt->proj_path;
+            // parts of a split file and files of several timepoints are handled as skim does it
+            run_skim_jobs(skim_single_file_jobs(opt_skim, sequenceNum), 1);
 
         }
 
@@ -394,6 +421,9 @@ void start_standard_process(CLI::App &app)
                 cout << "ERROR: Not all valid files have been recorded" << endl;
             }
 
+            // timepoints skim found damaged are left out, see the integrity manifest
+            nhdrNum -= skip_damaged_timepoints(opt->nhdr_path, allValidFiles);
+
             // update file number
             opt->file_number = nhdrNum;
             cout << "Starting second loop for processing" << endl << endl;
@@ -580,6 +610,9 @@ void start_standard_process(CLI::App &app)
                 cout << "ERROR: Not all valid files have been recorded" << endl;
             }
 
+            // timepoints skim found damaged are left out, see the integrity manifest
+            nhdrNum -= skip_damaged_timepoints(opt->nhdr_path, opt->allValidFiles);
+
             // if the user restricts the number of files to process
             if (!opt->maxFileNum.empty())
             {
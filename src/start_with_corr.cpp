@@ -29,6 +29,7 @@
 #include "CLI11.hpp"
 
 #include "skimczi.h"
+#include "cziintegrity.h"
 #include "util.h"
 #include "skimczi_util.h"
 
@@ -192,48 +193,15 @@ void start_standard_process_with_corr(CLI::App &app)
                 cout << "ERROR: Not all valid files have been recorded" << endl;
             }
                 
-            // generate output files by running main
-            for (int i = 0; i < allValidFiles.size(); i++) 
-            {                
-                string nhdrFileName, xmlFileName;
-
-                // we need to refresh both for each iteration
-                opt->nhdr_out_name = "";
-                opt->xml_out_name = "";
-
-                // generate the complete path for output files
-                nhdrFileName = opt->nhdr_path + GenerateOutName(allValidFiles[i].first, 3, ".nhdr");
-                xmlFileName = opt->nhdr_path + GenerateOutName(allValidFiles[i].first, 3, ".xml");
-
-                // we want to check if current potential output file already exists, if so, skip
-                if (fs::exists(nhdrFileName) && fs::exists(xmlFileName))
-                {
-                    cout << "Both " << nhdrFileName << " and " << xmlFileName << " exist, continue to next." << endl << endl;
-                    continue;
-                }
-                
-                // run the processing program
-                try 
-                {
-                    opt->file = allValidFiles[i].second;
-                    opt->nhdr_out_name = nhdrFileName;
-                    opt->xml_out_name = xmlFileName;
-
-                    // convert startwithcorrOptions to skimOptions
-                    auto opt_skim = std::make_shared<skimOptions>();
-                    opt_skim->czi_path = opt->czi_path;
-                    opt_skim->nhdr_path = opt->nhdr_path;
-                    opt_skim->nhdr_out_name = opt->nhdr_out_name;
-                    opt_skim->xml_out_name = opt->xml_out_name;
-                    opt_skim->file = opt->file;
-                    opt_skim->verbose = opt->verbose;
-                    Skim(*opt_skim).main();
-                } 
-                catch(LSPException &e) 
-                {
-                    std::cerr << "Exception thrown by " << e.get_func() << "() in " << e.get_file() << ": " << e.what() << std::endl;
-                }
-            }
+            // convert startwithcorrOptions to skimOptions
+            skimOptions opt_skim;
+            opt_skim.czi_path = opt->czi_path;
+            opt_skim.nhdr_path = opt->nhdr_path;
+            opt_skim.verbose = opt->verbose;
+            // compute the projections while the data is read, the proj pass below then skips these files
+            opt_skim.proj_path = opt->proj_path;
+            // parts of split files and files of several timepoints are handled as skim does it
+            run_skim_jobs(skim_file_jobs(opt_skim, allValidFiles), 1);
         }
         // Single file mode if the input_path is a single file path
         else
@@ -281,38 +249,15 @@ void start_standard_process_with_corr(CLI::App &app)
                 sequenceNum = 0;
             }
 
-            string nhdrFileName, xmlFileName;
-            // generate the complete path for output files
-            nhdrFileName = opt->nhdr_path + GenerateOutName(sequenceNum, 3, ".nhdr");
-            xmlFileName = opt->nhdr_path+ GenerateOutName(sequenceNum, 3, ".xml");
-
-            // we want to check if current potential output file already exists, if so, skip
-            if (fs::exists(nhdrFileName) && fs::exists(xmlFileName))
-            {
-                cout << "Both " << nhdrFileName << " and " << xmlFileName << " exist, no need to process again." << endl << endl;
-                return;
-            }
-        
-            try 
-            {
-                opt->file = curFile;
-                opt->nhdr_out_name = nhdrFileName;
-                opt->xml_out_name = xmlFileName;
-                
-                // convert startwithcorrOptions to skimOptions
-                auto opt_skim = std::make_shared<skimOptions>();
-                opt_skim->czi_path = opt->czi_path;
-                opt_skim->nhdr_path = opt->nhdr_path;
-                opt_skim->nhdr_out_name = opt->nhdr_out_name;
-                opt_skim->xml_out_name = opt->xml_out_name;
-                opt_skim->file = opt->file;
-                opt_skim->verbose = opt->verbose;
-                Skim(*opt_skim).main();
-            } 
-            catch(LSPException &e) 
-            {
-                std::cerr << "Exception thrown by " << e.get_func() << "() in " << e.get_file() << ": " << e.what() << std::endl;
-            }
+            // convert startwithcorrOptions to skimOptions
+            skimOptions opt_skim;
+            opt_skim.czi_path = curFile;
+            opt_skim.nhdr_path = opt->nhdr_path;
+            opt_skim.verbose = opt->verbose;
+            // compute the projections while the data is read, the proj pass below then skips this file
+            opt_skim.proj_path = opt->proj_path;
+            // parts of a split file and files of several timepoints are handled as skim does it
+            run_skim_jobs(skim_single_file_jobs(opt_skim, sequenceNum), 1);
 
         }
 
@@ -405,6 +350,9 @@ void start_standard_process_with_corr(CLI::App &app)
                 cout << "ERROR: Not all valid files have been recorded" << endl;
             }
 
+            // timepoints skim found damaged are left out, see the integrity manifest
+            nhdrNum -= skip_damaged_timepoints(opt->nhdr_path, allValidFiles);
+
             // update file number
             opt->file_number = nhdrNum;
             cout << "Starting second loop for processing" << endl << endl;
@@ -1336,6 +1284,9 @@ void start_standard_process_with_corr(CLI::App &app)
                 cout << "ERROR: Not all valid files have been recorded" << endl;
             }
 
+            // timepoints skim found damaged are left out, see the integrity manifest
+            nhdrNum -= skip_damaged_timepoints(opt->nhdr_path, allValidFiles);
+
             // if the user restricts the number of files to process
             if (!opt->maxFileNum.empty())
             {
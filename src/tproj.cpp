@@ -0,0 +1,236 @@
+//! \file tproj.cpp
+//! \brief Projections through time of the projection files lsp proj writes.
+
+#include <teem/nrrd.h>
+#include "tproj.h"
+#include "util.h"
+#include "skimczi.h"
+#include "projengine.h"
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <cfloat>
+#include <iostream>
+#include <omp.h>
+
+#include <chrono>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+void setup_tproj(CLI::App &app)
+{
+    auto opt = std::make_shared<tprojOptions>();
+    auto sub = app.add_subcommand("tproj", "Max, mean and variance over time of the projection files generated by lsp proj, "
+                                           "and the intensity of every timepoint.");
+
+    sub->add_option("-i, --proj_path", opt->proj_path, "Input path which contains the NRRD projection files")->required();
+    sub->add_option("-o, --out_path", opt->out_path, "Where to output tprojXY.nrrd and tprojXY-curve.txt")->required();
+    sub->add_option("-p, --plane", opt->plane, "Projection files to read, XY, XZ or YZ (Default: XY)");
+    sub->add_option("-m, --measure", opt->measure, "Measure of the projection files followed through time, one of those "
+                                                  "lsp proj --measures wrote (Default: max)");
+    sub->add_option("-j, --jobs", opt->jobs, "Number of projection files loaded at the same time (Default: 4)");
+    sub->add_option("-v, --verbose", opt->verbose, "Turn on (1) or off (0) debug messages, by default turned off");
+    add_io_options(sub, opt->io);
+
+    sub->set_callback([opt]()
+    {
+        opt->io.verbose = opt->verbose;
+        try
+        {
+            auto start = chrono::high_resolution_clock::now();
+            Tproj(*opt).main();
+            auto stop = chrono::high_resolution_clock::now();
+            auto duration = chrono::duration_cast<chrono::seconds>(stop - start);
+            cout << "Processing took " << duration.count() << " seconds" << endl;
+        }
+        catch(LSPException &e)
+        {
+            std::cerr << "Exception thrown by " << e.get_func() << "() in " << e.get_file() << ": " << e.what() << std::endl;
+        }
+    });
+}
+
+
+Tproj::Tproj(tprojOptions const &opt): opt(opt), nout(nullptr), sizeA(0), sizeB(0), sizeC(0), count(0), mop(airMopNew())
+{
+    if (opt.plane != "XY" && opt.plane != "XZ" && opt.plane != "YZ")
+        throw LSPException("Unknown plane " + opt.plane + ", expected XY, XZ or YZ\n", "tproj.cpp", "Tproj::Tproj");
+    if (proj_parse_measures(opt.measure).size() != 1)
+        throw LSPException("tproj follows one measure through time, not " + opt.measure + "\n", "tproj.cpp", "Tproj::Tproj");
+    if (!checkIfDirectory(opt.proj_path))
+        throw LSPException(opt.proj_path + " is not a directory\n", "tproj.cpp", "Tproj::Tproj");
+
+    // NNN-projXY.nrrd, in time order
+    string suffix = "-proj" + opt.plane + ".nrrd";
+    for (string const &curFile : GetDirectoryFiles(opt.proj_path))
+    {
+        if (curFile.size() <= suffix.size() || curFile.compare(curFile.size() - suffix.size(), suffix.size(), suffix))
+            continue;
+        string sequenceNumString = curFile.substr(0, curFile.size() - suffix.size());
+        if (is_number(sequenceNumString))
+            files.push_back(make_pair(stoi(sequenceNumString), curFile));
+        else
+            cout << "WARNING: " << sequenceNumString << " is NOT a number" << endl;
+    }
+    sort(files.begin(), files.end());
+    if (files.empty())
+        throw LSPException("No *" + suffix + " files found in " + opt.proj_path + "\n", "tproj.cpp", "Tproj::Tproj");
+    cout << files.size() << " NRRD projection files *" << suffix << " found in input path " << opt.proj_path << endl;
+
+    if (!checkIfDirectory(opt.out_path))
+    {
+        cout << opt.out_path << " does not exist, but has been created" << endl;
+        boost::filesystem::create_directory(opt.out_path);
+    }
+    out_name = opt.out_path + "tproj" + opt.plane + ".nrrd";
+    curve_name = opt.out_path + "tproj" + opt.plane + "-curve.txt";
+}
+
+
+Tproj::~Tproj(){
+  airMopOkay(mop);
+}
+
+
+void Tproj::main(){
+    nrrdStateVerboseIO = 0;
+    int jobs = max(1, min(opt.jobs, (int)files.size()));
+    IoGovernor governor(opt.io, jobs, opt.out_path);
+
+    // files are loaded by up to "jobs" threads but added in time order, so no more than "jobs" of them are
+    // in memory however many timepoints there are
+    #pragma omp parallel for ordered schedule(dynamic, 1) num_threads(jobs)
+    for (int i = 0; i < (int)files.size(); i++)
+    {
+        string input_name = opt.proj_path + files[i].second;
+        airArray *fileMop = airMopNew();
+        Nrrd *nin = nullptr;
+        string error;
+        try
+        {
+            IoGovernor::Read read(&governor);
+            nin = safe_nrrd_load(fileMop, input_name);
+            read.done(nrrdElementNumber(nin) * nrrdElementSize(nin));
+        }
+        catch(LSPException &e)
+        {
+            error = e.what();
+        }
+
+        #pragma omp ordered
+        {
+            if (nin)
+            {
+                try
+                {
+                    add_timepoint(files[i].first, nin);
+                }
+                catch(LSPException &e)
+                {
+                    error = e.what();
+                }
+            }
+            if (!error.empty())
+                cout << "WARNING: skipping " << input_name << ": " << error;
+            else if (opt.verbose)
+                cout << "Added " << input_name << endl;
+        }
+        airMopOkay(fileMop);
+    }
+
+    if (!count)
+        throw LSPException("None of the projection files could be used\n", "tproj.cpp", "Tproj::main");
+
+    // the sums of squared differences become the variance
+    size_t planeSize = sizeA * sizeB * sizeC;
+    float *m2 = (float*)nout->data + 2 * planeSize;
+    for (size_t i = 0; i < planeSize; i++)
+        m2[i] /= count;
+
+    nout->axis[3].label = airStrdup("stat");
+    nrrd_checker(nrrdKeyValueAdd(nout, "stats", "max,mean,var")
+                 || nrrdKeyValueAdd(nout, "measure", opt.measure.c_str())
+                 || nrrdKeyValueAdd(nout, "timepoints", to_string(count).c_str())
+                 || nrrdSave(out_name.c_str(), nout, nullptr),
+                 mop, "Error saving projections through time:\n", "tproj.cpp", "Tproj::main");
+
+    cout << count << " timepoints projected through time to " << out_name << ", intensities written to " << curve_name << endl;
+}
+
+
+// fold the projection file of "timepoint" into the running max, mean and variance, and append its
+// intensity to the curve
+void Tproj::add_timepoint(int timepoint, Nrrd *nin)
+{
+    if (nin->dim != 4 || nin->type != nrrdTypeFloat)
+        throw LSPException("not a projection file of lsp proj\n", "tproj.cpp", "Tproj::add_timepoint");
+
+    // files written with the default measures don't list them
+    char *listed = nrrdKeyValueGet(nin, "measures");
+    string list = listed ? listed : PROJ_DEFAULT_MEASURES;
+    airFree(listed);
+    vector<ProjMeasure> measures = proj_parse_measures(list);
+    string wanted = proj_measure_name(proj_parse_measures(opt.measure)[0]);
+    size_t m = 0;
+    while (m < measures.size() && proj_measure_name(measures[m]) != wanted)
+        m++;
+    if (m == measures.size() || nin->axis[3].size != measures.size())
+        throw LSPException("no " + wanted + " projection among " + list + "\n", "tproj.cpp", "Tproj::add_timepoint");
+
+    if (!nout)
+    {
+        sizeA = nin->axis[0].size;
+        sizeB = nin->axis[1].size;
+        sizeC = nin->axis[2].size;
+        nout = safe_nrrd_new(mop, (airMopper)nrrdNuke);
+        int axmap[4] = {0, 1, 2, -1};
+        int basicExclude = NRRD_BASIC_INFO_DATA_BIT | NRRD_BASIC_INFO_TYPE_BIT | NRRD_BASIC_INFO_BLOCKSIZE_BIT
+                           | NRRD_BASIC_INFO_DIMENSION_BIT | NRRD_BASIC_INFO_CONTENT_BIT | NRRD_BASIC_INFO_COMMENTS_BIT
+                           | NRRD_BASIC_INFO_KEYVALUEPAIRS_BIT;
+        nrrd_checker(nrrdAlloc_va(nout, nrrdTypeFloat, 4, sizeA, sizeB, sizeC, (size_t)3)
+                     || nrrdAxisInfoCopy(nout, nin, axmap, NRRD_AXIS_INFO_SIZE_BIT)
+                     || nrrdBasicInfoCopy(nout, nin, basicExclude),
+                     mop, "Couldn't allocate projections through time:\n", "tproj.cpp", "Tproj::add_timepoint");
+        size_t planeSize = sizeA * sizeB * sizeC;
+        float *out = (float*)nout->data;
+        fill(out, out + planeSize, -FLT_MAX);
+        fill(out + planeSize, out + 3 * planeSize, 0.0f);
+
+        curve.open(curve_name);
+        if (!curve)
+            throw LSPException("Could not open " + curve_name + "\n", "tproj.cpp", "Tproj::add_timepoint");
+        curve << "# timepoint";
+        for (size_t c = 0; c < sizeC; c++)
+            curve << " mean_c" << c << " max_c" << c;
+        curve << endl;
+    }
+    else if (nin->axis[0].size != sizeA || nin->axis[1].size != sizeB || nin->axis[2].size != sizeC)
+        throw LSPException("its size differs from the first projection file\n", "tproj.cpp", "Tproj::add_timepoint");
+
+    // Welford's running mean and sum of squared differences
+    count++;
+    size_t sizeAB = sizeA * sizeB, planeSize = sizeAB * sizeC;
+    float *maxT = (float*)nout->data, *meanT = maxT + planeSize, *m2T = meanT + planeSize;
+    const float *in = (const float*)nin->data + planeSize * m;
+    curve << timepoint;
+    for (size_t c = 0; c < sizeC; c++)
+    {
+        double sum = 0;
+        float high = -FLT_MAX;
+        for (size_t i = sizeAB * c; i < sizeAB * (c + 1); i++)
+        {
+            float v = in[i];
+            sum += v;
+            high = max(high, v);
+            maxT[i] = max(maxT[i], v);
+            float d = v - meanT[i];
+            meanT[i] += d / count;
+            m2T[i] += d * (v - meanT[i]);
+        }
+        curve << " " << sum / sizeAB << " " << high;
+    }
+    // flushed per timepoint, so the curve can be followed while it grows
+    curve << endl;
+}
@@ -28,15 +28,16 @@ const char *lspVolBiffKey = "lspVol";
 static const airEnum _lspType_ae = 
 {
     "pixel value type", //name
-    4, // number of valid types
-    (const char*[]) { "(unknown_type)", "uchar",      "short",      "unsigned short",   "double" },
-    (int [])        {lspTypeUnknown,    lspTypeUChar, lspTypeShort, lspTypeUShort,      lspTypeDouble},
+    5, // number of valid types
+    (const char*[]) { "(unknown_type)", "uchar",      "short",      "unsigned short",   "double",      "float" },
+    (int [])        {lspTypeUnknown,    lspTypeUChar, lspTypeShort, lspTypeUShort,      lspTypeDouble, lspTypeFloat},
     (const char*[]) {
         "unknown type",
         "unsigned char",
         "short",
         "unsigned short",
-        "double"
+        "double",
+        "float"
     },
     NULL, NULL,
     AIR_FALSE // if require case matching on strings
@@ -61,6 +62,8 @@ static lspType typeNRRDtoLSP(int ntype)
             break;
         case nrrdTypeDouble: ret = lspTypeDouble;
             break;
+        case nrrdTypeFloat: ret = lspTypeFloat;
+            break;
         default: 
             ret = lspTypeUnknown;
     }
@@ -83,6 +86,8 @@ static int typeLSPtoNRRD(lspType ltype)
             break;
         case lspTypeDouble: ret = nrrdTypeDouble;
             break;
+        case lspTypeFloat: ret = nrrdTypeFloat;
+            break;
         default: 
             ret = nrrdTypeUnknown;
     }
@@ -172,6 +177,8 @@ static size_t lsptypeSize(lspType dtype)
             break;
         case lspTypeDouble: ret = sizeof(double);
             break;
+        case lspTypeFloat: ret = sizeof(float);
+            break;
         // unknown case
         default: ret = 0;
     }
@@ -190,12 +197,14 @@ static int lspNrrdDataCheck(const Nrrd *nin)
     if (!( nrrdTypeUChar == nin->type 
           || nrrdTypeShort == nin->type 
           || nrrdTypeUShort == nin->type 
+          || nrrdTypeFloat == nin->type 
           || nrrdTypeDouble == nin->type )) 
     {
-        printf("%s: can't handle nrrd type %s (need %s, %s, %s or %s)\n", __func__, airEnumStr(nrrdType, nin->type),
+        printf("%s: can't handle nrrd type %s (need %s, %s, %s, %s or %s)\n", __func__, airEnumStr(nrrdType, nin->type),
                  airEnumStr(nrrdType, nrrdTypeUChar),
                  airEnumStr(nrrdType, nrrdTypeShort),
                  airEnumStr(nrrdType, nrrdTypeUShort),
+                 airEnumStr(nrrdType, nrrdTypeFloat),
                  airEnumStr(nrrdType, nrrdTypeDouble));
         
         return 1;
@@ -542,24 +551,13 @@ int lspVolumeFromNrrd(lspVolume *vol, const Nrrd* nin)
     uint elSize = (uint)nrrdElementSize(nin);
     uint elNum = (uint)nrrdElementNumber(nin);
 
-    if (ltype == lspTypeUChar) 
-    {
-        memcpy(vol->data.vd, nin->data, elSize*elNum);
-    }
-    // we want to have unsigned short become short since negativity would be useful later
-    else if (ltype == lspTypeUShort || ltype == lspTypeShort)
-    {
-        memcpy(vol->data.s, nin->data, elSize*elNum);
-    }
-    else if (ltype == lspTypeDouble)
-    {
-        memcpy(vol->data.dl, nin->data, elSize*elNum);
-    }
-    else
+    // the volume keeps the type of the data, unsigned short stays unsigned so that values above 32767 survive
+    if (ltype == lspTypeUnknown)
     {
         cout << "lspVolumeFromNrrd: Unknown data type" << endl;
         return 1;
     }
+    memcpy(vol->data.vd, nin->data, (size_t)elSize*elNum);
 
     // set the ItoW matrix
     setItoW3D(vol->ItoW, nin);
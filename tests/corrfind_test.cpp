@@ -0,0 +1,36 @@
+//! \file corrfind_test.cpp
+//! \brief The alignment files of corrfind are named after the timepoints, also around a missing one.
+
+#include "util.h"
+#include "skimczi.h"
+#include "corrfind.h"
+
+#include <iostream>
+
+using namespace std;
+
+int main()
+{
+    // timepoint 2 was damaged and left no projections
+    vector< pair<int, string> > images = {{0, "000-projXY"}, {1, "001-projXY"}, {3, "003-projXY"}, {4, "004-projXY"}};
+    vector< pair<string, int> > jobs = corrfind_jobs(images);
+
+    vector< pair<string, int> > expected = {{"000.txt", -1}, {"001.txt", 0}, {"003.txt", 1}, {"004.txt", 2}};
+    if (jobs != expected)
+    {
+        cerr << "corrfind_jobs:";
+        for (auto const &job : jobs)
+            cerr << " " << job.first << "<-" << job.second;
+        cerr << endl;
+        return 1;
+    }
+
+    // the first timepoint there is the reference, whatever its number
+    jobs = corrfind_jobs({{5, "005-projXY"}, {6, "006-projXY"}});
+    if (jobs.size() != 2 || jobs[0] != make_pair(string("005.txt"), -1) || jobs[1] != make_pair(string("006.txt"), 0))
+    {
+        cerr << "corrfind_jobs without timepoint 0 is wrong" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,52 @@
+//! \file projengine_test.cpp
+//! \brief Percentiles along z are exact for stacks of up to five planes, not the median of them.
+
+#include "util.h"
+#include "projengine.h"
+
+#include <cmath>
+#include <iostream>
+
+#include <teem/nrrd.h>
+
+using namespace std;
+
+int main()
+{
+    // one pixel, one channel and five planes, in no particular order along z
+    unsigned short planes[5] = {50, 10, 40, 30, 20};
+
+    airArray *mop = airMopNew();
+    Nrrd *nin = nrrdNew(), *nxy = nrrdNew(), *nxz = nrrdNew(), *nyz = nrrdNew();
+    airMopAdd(mop, nin, (airMopper)nrrdNix, airMopAlways);
+    airMopAdd(mop, nxy, (airMopper)nrrdNuke, airMopAlways);
+    airMopAdd(mop, nxz, (airMopper)nrrdNuke, airMopAlways);
+    airMopAdd(mop, nyz, (airMopper)nrrdNuke, airMopAlways);
+    if (nrrdWrap_va(nin, planes, nrrdTypeUShort, 4, (size_t)1, (size_t)1, (size_t)1, (size_t)5))
+    {
+        cerr << "Couldn't wrap the volume" << endl;
+        airMopOkay(mop);
+        return 1;
+    }
+
+    vector<ProjMeasure> measures = proj_parse_measures("p90,p50,p10");
+    {
+        ProjEngine engine(nin->type, 1, 1, 1, 5, nxy, nxz, nyz, measures, 1);
+        engine.add_slab(nin->data, 0, 5);
+        engine.finish(nin);
+    }
+
+    // interpolated between the closest of the sorted values 10 20 30 40 50
+    const float expected[3] = {46, 30, 14};
+    const float *out = (const float*)nxy->data;
+    int failed = 0;
+    for (size_t m = 0; m < measures.size(); m++)
+        if (fabs(out[m] - expected[m]) > 1e-4)
+        {
+            cerr << proj_measure_name(measures[m]) << " of 5 planes is " << out[m] << " instead of " << expected[m] << endl;
+            failed = 1;
+        }
+
+    airMopOkay(mop);
+    return failed;
+}
@@ -0,0 +1,57 @@
+//! \file skimczi_util_test.cpp
+//! \brief Streaming the CZI metadata XML gives the image dims the DOM lookup gave, also when an
+//! element occurs more than once and when there is no SizeT.
+
+#include "skimczi.h"
+#include "skimczi_util.h"
+
+#include <cstring>
+#include <iostream>
+
+#include <libxml/parser.h>
+
+using namespace std;
+
+static bool same_dims(ImageDims const &a, ImageDims const &b)
+{
+    return a.sizeX == b.sizeX && a.sizeY == b.sizeY && a.sizeZ == b.sizeZ && a.sizeC == b.sizeC
+           && a.sizeT == b.sizeT && a.scalingX == b.scalingX && a.scalingY == b.scalingY
+           && a.scalingZ == b.scalingZ && a.pixelType == b.pixelType && a.pixelSize == b.pixelSize;
+}
+
+int main()
+{
+    // a second SizeZ further down, as in the dimensions of an experiment block, and no SizeT
+    const string xml =
+        "<ImageDocument><Metadata>"
+        "<Information><Image><SizeX>512</SizeX><SizeY>256</SizeY><SizeZ>40</SizeZ><SizeC>2</SizeC>"
+        "<PixelType>Gray16</PixelType></Image></Information>"
+        "<Experiment><SizeZ>7</SizeZ></Experiment>"
+        "</Metadata></ImageDocument>";
+
+    ImageDims streamed, walked;
+    memset(&streamed, 0, sizeof(ImageDims));
+    memset(&walked, 0, sizeof(ImageDims));
+
+    if (!stream_image_dims(xml.c_str(), xml.size(), &streamed))
+    {
+        cerr << "stream_image_dims could not parse the XML" << endl;
+        return 1;
+    }
+
+    xmlDocPtr doc = xmlReadMemory(xml.c_str(), (int)xml.size(), "noname.xml", NULL, 0);
+    if (!doc)
+    {
+        cerr << "xmlReadMemory could not parse the XML" << endl;
+        return 1;
+    }
+    get_image_dims(xmlDocGetRootElement(doc), &walked);
+    xmlFreeDoc(doc);
+
+    if (!same_dims(streamed, walked) || streamed.sizeZ != 7 || streamed.sizeX != 512 || streamed.pixelSize != 2)
+    {
+        cerr << "stream_image_dims gave SizeZ " << streamed.sizeZ << ", get_image_dims " << walked.sizeZ << endl;
+        return 1;
+    }
+    return 0;
+}